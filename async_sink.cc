@@ -0,0 +1,159 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "async_sink.h"
+
+#include <chrono>
+
+using namespace kerror;
+
+constexpr size_t AsyncReportSink::kRecordSize;
+
+static size_t RoundUpToPowerOf2(size_t n) noexcept
+{
+  size_t ret = 1;
+  while (ret < n) ret <<= 1;
+  return ret;
+}
+
+AsyncReportSink::AsyncReportSink(size_t capacity, OverflowPolicy policy,
+                                 ReportSink &downstream)
+  : mask_(RoundUpToPowerOf2(capacity ? capacity : 1) - 1)
+  , policy_(policy)
+  , downstream_(downstream)
+  , tail_(0)
+  , dropped_(0)
+  , truncated_(0)
+  , head_(0)
+  , stopped_(false)
+{
+  records_.reset(new Record[mask_ + 1]);
+  for (size_t i = 0; i <= mask_; ++i) {
+    records_[i].seq.store(i, std::memory_order_relaxed);
+  }
+  flusher_ = std::thread([this]() { Run(); });
+}
+
+AsyncReportSink::~AsyncReportSink() noexcept
+{
+  // Don't restore if another sink has been set
+  if (&GetReportSink() == this) SetReportSink(nullptr);
+
+  stopped_.store(true, std::memory_order_release);
+  flusher_.join();
+}
+
+void AsyncReportSink::Write(char const *data, size_t n) noexcept
+{
+  if (n == 0) return;
+  // The long report is written into consecutive records, so it is not
+  // interleaved with the others
+  auto count = (n + kRecordSize - 1) / kRecordSize;
+  if (count > capacity()) {
+    count = capacity();
+    n = count * kRecordSize;
+    truncated_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  auto pos = tail_.load(std::memory_order_relaxed);
+  for (;;) {
+    intptr_t diff = 0;
+    for (size_t i = 0; i < count && diff == 0; ++i) {
+      auto const seq = records_[(pos + i) & mask_].seq.load(
+          std::memory_order_acquire);
+      diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + i);
+    }
+    if (diff == 0) {
+      // The records are free, claim them
+      if (tail_.compare_exchange_weak(pos, pos + count,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // A record is not consumed yet, i.e. the ring is full
+      if (policy_ == OverflowPolicy::kDrop) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      std::this_thread::yield();
+      pos = tail_.load(std::memory_order_relaxed);
+    } else {
+      // Claimed by another thread
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    auto &record = records_[(pos + i) & mask_];
+    auto const size = n < kRecordSize ? n : kRecordSize;
+    memcpy(record.data, data, size);
+    record.size = static_cast<uint32_t>(size);
+    record.seq.store(pos + i + 1, std::memory_order_release);
+    data += size;
+    n -= size;
+  }
+}
+
+bool AsyncReportSink::ConsumeBatch(char *buf, size_t cap) noexcept
+{
+  auto head = head_.load(std::memory_order_relaxed);
+  size_t size = 0;
+  for (;;) {
+    auto &record = records_[head & mask_];
+    if (record.seq.load(std::memory_order_acquire) != head + 1) break;
+    if (size + record.size > cap) break;
+
+    memcpy(buf + size, record.data, record.size);
+    size += record.size;
+    // Free the record for the next round
+    record.seq.store(head + mask_ + 1, std::memory_order_release);
+    ++head;
+  }
+
+  if (size == 0) return false;
+  downstream_.Write(buf, size);
+  // Published after written to the downstream for Flush()
+  head_.store(head, std::memory_order_release);
+  return true;
+}
+
+void AsyncReportSink::Run() noexcept
+{
+  // Batch the records to reduce the write calls of the downstream
+  char buf[64 * kRecordSize];
+
+  // The reporting threads don't notify this, since it is not allowed in
+  // signal handler. Instead, the idle interval increases up to 50ms.
+  auto idle = std::chrono::microseconds(100);
+  auto const kMaxIdle = std::chrono::microseconds(50 * 1000);
+
+  for (;;) {
+    if (ConsumeBatch(buf, sizeof buf)) {
+      idle = std::chrono::microseconds(100);
+      continue;
+    }
+
+    if (stopped_.load(std::memory_order_acquire)) {
+      // The reports written before stop are consumed
+      while (ConsumeBatch(buf, sizeof buf)) {
+      }
+      break;
+    }
+
+    std::this_thread::sleep_for(idle);
+    if (idle < kMaxIdle) idle *= 2;
+  }
+  downstream_.Flush();
+}
+
+void AsyncReportSink::Flush() noexcept
+{
+  auto const tail = tail_.load(std::memory_order_acquire);
+  // The record claimed but not written yet is waited too
+  for (int i = 0; i < 1000; ++i) {
+    if (static_cast<intptr_t>(head_.load(std::memory_order_acquire) - tail) >=
+        0) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  downstream_.Flush();
+}
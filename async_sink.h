@@ -0,0 +1,123 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Asynchronous report sink.
+//
+// The reporting threads copy the report into a fixed-size record of a
+// bounded lock-free ring, then a background thread writes the records to
+// the downstream sink in batches. So the reporting threads are never
+// serialized by the lock of stdio or the file during an error storm:
+//   static AsyncReportSink sink;
+//   SetReportSink(&sink);
+//
+// The reports longer than kRecordSize are written into consecutive records,
+// only the ones longer than the whole ring are truncated, see truncated().
+
+#ifndef _KERROR_ASYNC_SINK_H__
+#define _KERROR_ASYNC_SINK_H__
+
+#include <thread>
+
+#include "kerror.h"
+
+namespace kerror {
+
+class AsyncReportSink final : public ReportSink {
+ public:
+  static constexpr size_t kRecordSize = 256;
+
+  /**
+   * What to do if the ring is full
+   */
+  enum class OverflowPolicy {
+    // Drop the report and count it in dropped()
+    kDrop,
+    // Spin until there is a free record, don't use it in signal handler
+    kBlock,
+  };
+
+  /**
+   * \Param capacity The number of records, rounded up to a power of 2
+   * \Param downstream The sink that the records are written to
+   *                   It must outlive this
+   */
+  explicit AsyncReportSink(size_t capacity = 1024,
+                           OverflowPolicy policy = OverflowPolicy::kDrop,
+                           ReportSink &downstream = StderrSink());
+
+  /**
+   * The remaining records are written before return.
+   * If this is the current report sink, StderrSink() is restored.
+   */
+  ~AsyncReportSink() noexcept override;
+
+  /**
+   * Lock-free and async-signal-safe(if the policy is kDrop)
+   * The report is dropped if its records are not free together.
+   */
+  void Write(char const *data, size_t n) noexcept override;
+
+  /**
+   * Wait for the records written before to be written to the downstream,
+   * at most about 1 second in case the flusher thread is stuck.
+   */
+  void Flush() noexcept override;
+
+  /**
+   * \return
+   *   The number of reports dropped since the ring is full
+   */
+  size_t dropped() const noexcept
+  {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \return
+   *   The number of reports truncated to capacity() * kRecordSize
+   */
+  size_t truncated() const noexcept
+  {
+    return truncated_.load(std::memory_order_relaxed);
+  }
+
+  size_t capacity() const noexcept { return mask_ + 1; }
+
+ private:
+  struct Record {
+    // == position: free, == position + 1: written
+    std::atomic<size_t> seq;
+    uint32_t size;
+    char data[kRecordSize];
+  };
+
+  void Run() noexcept;
+
+  // \return false if the ring is empty
+  bool ConsumeBatch(char *buf, size_t cap) noexcept;
+
+  std::unique_ptr<Record[]> records_;
+  size_t mask_;
+  OverflowPolicy policy_;
+  ReportSink &downstream_;
+
+  // Padding instead of alignas(64), so this can be allocated by new in
+  // C++11(no over-aligned new)
+  char pad0_[64];
+
+  // Written by the reporting threads
+  std::atomic<size_t> tail_;
+  std::atomic<size_t> dropped_;
+  std::atomic<size_t> truncated_;
+  char pad1_[64];
+
+  // Written by the flusher thread
+  std::atomic<size_t> head_;
+  char pad2_[64];
+
+  std::atomic<bool> stopped_;
+  std::thread flusher_;
+};
+
+} // namespace kerror
+
+#endif
@@ -0,0 +1,226 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "backtrace.h"
+
+#include <mutex>
+#include <unordered_map>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <unwind.h>
+
+using namespace kerror;
+
+constexpr int Backtrace::kMaxFrames;
+
+namespace {
+
+#if KERROR_BACKTRACE_FRAME_POINTER
+// The top(the highest address) of the stack of this thread, the frame
+// pointers out of the stack are not followed since the frames without frame
+// pointer leave garbage in the register.
+thread_local uintptr_t t_stack_top = 0;
+
+KERROR_COLD KERROR_NOINLINE uintptr_t GetStackTop() noexcept
+{
+  uintptr_t top = UINTPTR_MAX;
+#  ifdef __GLIBC__
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void *addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+      top = reinterpret_cast<uintptr_t>(addr) + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+#  endif
+  return top;
+}
+#else
+struct UnwindState {
+  void **frames;
+  int size;
+  int skip;
+};
+
+_Unwind_Reason_Code UnwindFrame(_Unwind_Context *context, void *arg)
+{
+  auto state = static_cast<UnwindState *>(arg);
+  auto const ip = _Unwind_GetIP(context);
+  if (ip == 0) return _URC_END_OF_STACK;
+  if (state->skip > 0) {
+    --state->skip;
+    return _URC_NO_REASON;
+  }
+  state->frames[state->size++] = reinterpret_cast<void *>(ip);
+  return state->size == Backtrace::kMaxFrames ? _URC_END_OF_STACK
+                                              : _URC_NO_REASON;
+}
+#endif
+
+struct CodeQuery {
+  uintptr_t address;
+  bool found;
+};
+
+int FindCode(dl_phdr_info *info, size_t, void *arg)
+{
+  auto query = static_cast<CodeQuery *>(arg);
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    auto const &phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+    auto const start = info->dlpi_addr + phdr.p_vaddr;
+    if (query->address - start < phdr.p_memsz) {
+      query->found = true;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Symbolize the return address \p frame
+ * The frames of the same address are symbolized once.
+ *
+ * \return
+ *   Empty if \p frame is not in the code of a module, i.e. it is garbage
+ *   found by walking the frames without frame pointer
+ */
+std::string const &Symbolize(void *frame)
+{
+  static std::mutex mutex;
+  // Never destroyed, since an error may be printed after exit()
+  static auto &cache = *new std::unordered_map<void *, std::string>();
+
+  std::lock_guard<std::mutex> guard(mutex);
+  auto iter = cache.find(frame);
+  if (iter != cache.end()) return iter->second;
+
+  CodeQuery query{reinterpret_cast<uintptr_t>(frame), false};
+  dl_iterate_phdr(FindCode, &query);
+  if (!query.found) return cache[frame];
+
+  // The return address may be the start of the next function if the call
+  // is the last instruction, e.g. the call to noreturn function
+  auto const pc = static_cast<char *>(frame) - 1;
+  char buf[64];
+  std::string symbol;
+  Dl_info info;
+  auto const found = dladdr(pc, &info) != 0;
+  if (found && info.dli_sname) {
+    int status = -1;
+    auto demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr,
+                                         &status);
+    symbol = status == 0 ? demangled : info.dli_sname;
+    free(demangled);
+    snprintf(buf, sizeof buf, "+0x%zx",
+             static_cast<size_t>(static_cast<char *>(frame) -
+                                 static_cast<char *>(info.dli_saddr)));
+    symbol += buf;
+  } else {
+    symbol = "??";
+  }
+
+  if (found && info.dli_fname && info.dli_fname[0]) {
+    symbol += " (";
+    symbol += info.dli_fname;
+    // The offset in the module for addr2line
+    snprintf(buf, sizeof buf, "+0x%zx)",
+             static_cast<size_t>(static_cast<char *>(frame) -
+                                 static_cast<char *>(info.dli_fbase)));
+    symbol += buf;
+  }
+  return cache.emplace(frame, std::move(symbol)).first->second;
+}
+
+} // namespace
+
+// The garbage frame pointers may point to the redzones of the sanitizers
+#if defined(__SANITIZE_ADDRESS__)
+#  define KERROR_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define KERROR_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#  endif
+#endif
+#ifndef KERROR_NO_SANITIZE_ADDRESS
+#  define KERROR_NO_SANITIZE_ADDRESS
+#endif
+
+KERROR_NO_SANITIZE_ADDRESS auto
+kerror::Backtrace::CaptureFrom(void *frame, int skip) noexcept -> Backtrace
+{
+  Backtrace backtrace;
+#if KERROR_BACKTRACE_FRAME_POINTER
+  if (KERROR_UNLIKELY(t_stack_top == 0)) t_stack_top = GetStackTop();
+  auto const top = t_stack_top;
+  // The frame layout of x86-64 and AArch64: [fp] = the fp of the caller,
+  // [fp + 1] = the return address
+  auto fp = static_cast<void **>(frame);
+  while (backtrace.size_ < kMaxFrames) {
+    auto const next = static_cast<void **>(fp[0]);
+    auto const ret = fp[1];
+    if (!ret) break;
+    if (skip > 0)
+      --skip;
+    else
+      backtrace.frames_[backtrace.size_++] = ret;
+    // The stack grows down, stop at the corrupted or the outermost frame
+    if (next <= fp || reinterpret_cast<uintptr_t>(next) % sizeof(void *) ||
+        reinterpret_cast<uintptr_t>(next + 2) > top || next - fp > (1 << 20))
+    {
+      break;
+    }
+    fp = next;
+  }
+#else
+  (void)frame;
+  // The first frames are this and the caller of Capture()
+  UnwindState state{backtrace.frames_, 0, skip + 2};
+  _Unwind_Backtrace(UnwindFrame, &state);
+  backtrace.size_ = state.size;
+#endif
+  return backtrace;
+}
+
+void kerror::Backtrace::Write(MessageSink &sink) const
+{
+  for (int i = 0; i < size_; ++i) {
+    auto const &symbol = Symbolize(frames_[i]);
+    // The outer frames are garbage too
+    if (symbol.empty()) break;
+    char buf[64];
+    auto const n = snprintf(buf, sizeof buf, "#%d %p in ", i, frames_[i]);
+    sink.Write(buf, static_cast<size_t>(n));
+    sink.Write(symbol.data(), symbol.size());
+    sink.Write("\n", 1);
+  }
+}
+
+auto kerror::WithBacktrace(Error err) -> Error
+{
+  if (!err) return err;
+  // The innermost frame is the caller creating the error
+  auto const backtrace = Backtrace::Capture();
+  return MakeError<BacktraceErrorInfo>(std::move(err), backtrace);
+}
+
+auto kerror::GetBacktrace(Error const &err) noexcept -> Backtrace const *
+{
+  auto info = DynCast<BacktraceErrorInfo>(err.info());
+  return info ? &info->backtrace() : nullptr;
+}
+
+void kerror::PErrorBacktrace(char const *prefix, Error const &err)
+{
+  StringSink sink;
+  sink.Write(prefix, strlen(prefix));
+  err.WriteMessage(sink);
+  sink.Write("\n", 1);
+  if (auto backtrace = GetBacktrace(err)) backtrace->Write(sink);
+  // A single write like PError()
+  auto const &report = sink.str();
+  GetReportSink().Write(report.data(), report.size());
+}
@@ -0,0 +1,162 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Backtrace captured when the error is created.
+//
+// Only the return addresses are recorded into a fixed-size array, the
+// symbolization is deferred to printing, and the symbolized frames are
+// cached, so capturing is cheap enough for the error path:
+//   return WithBacktrace(MakeMsgError("Unexpected EOF"));
+//   ...
+//   PErrorBacktrace("Reason: ", err);
+//
+// The frames are collected by walking the frame pointers on x86-64 and
+// AArch64 by default, which costs tens of nanoseconds. The code should be
+// compiled with -fno-omit-frame-pointer(the default of many distributions),
+// otherwise the walk stops at the first frame without frame pointer, but the
+// innermost frame, i.e. the one creating the error, is always captured.
+// Define KERROR_BACKTRACE_FRAME_POINTER to 0 to collect the frames by
+// _Unwind_Backtrace() instead, which doesn't need the frame pointers but
+// costs about 200ns per frame, see KERROR_BACKTRACE_MAX_FRAMES.
+// The symbols of the executable are found only if it is linked with -rdynamic,
+// otherwise the module and the offset are printed, which can be resolved by
+// addr2line.
+
+#ifndef _KERROR_BACKTRACE_H__
+#define _KERROR_BACKTRACE_H__
+
+#include "kerror.h"
+
+#ifndef KERROR_BACKTRACE_FRAME_POINTER
+#  if defined(__x86_64__) || defined(__aarch64__)
+#    define KERROR_BACKTRACE_FRAME_POINTER 1
+#  else
+#    define KERROR_BACKTRACE_FRAME_POINTER 0
+#  endif
+#endif
+
+#ifndef KERROR_BACKTRACE_MAX_FRAMES
+#  if KERROR_BACKTRACE_FRAME_POINTER
+#    define KERROR_BACKTRACE_MAX_FRAMES 32
+#  else
+#    define KERROR_BACKTRACE_MAX_FRAMES 8
+#  endif
+#endif
+
+namespace kerror {
+
+class Backtrace {
+ public:
+  static constexpr int kMaxFrames = KERROR_BACKTRACE_MAX_FRAMES;
+
+  Backtrace() noexcept = default;
+
+  /**
+   * Capture the backtrace of the caller, the deeper frames are dropped.
+   * This is inlined, so the caller sets up its frame pointer, and the
+   * return address of the caller is always found.
+   *
+   * \Param skip
+   *   The number of the innermost frames to skip, the return address of
+   *   the caller(i.e. in the caller of the caller) is 0
+   */
+  KERROR_INLINE static Backtrace Capture(int skip = 0) noexcept
+  {
+    return CaptureFrom(__builtin_frame_address(0), skip);
+  }
+
+  int size() const noexcept { return size_; }
+  void *const *frames() const noexcept { return frames_; }
+
+  /**
+   * Write the symbolized frames, one frame per line:
+   *   #0 0x55d0c3a4b1f0 in ReadHeader(int)+0x1a (./server)
+   * The frames from the first one out of the code of the modules are
+   * dropped, which are garbage found by walking the frame pointers.
+   */
+  void Write(MessageSink &sink) const;
+
+ private:
+  /**
+   * \Param frame The frame address of the caller of Capture()
+   */
+  KERROR_NOINLINE static Backtrace CaptureFrom(void *frame, int skip) noexcept;
+
+  void *frames_[kMaxFrames];
+  int size_ = 0;
+};
+
+/**
+ * Wrap the cause with the backtrace, the message and the type of the cause
+ * are kept, i.e. IsA<T>() and DynCast<T>() see through it.
+ */
+class BacktraceErrorInfo : public ErrorInfo<BacktraceErrorInfo> {
+ public:
+  BacktraceErrorInfo(Error cause, Backtrace const &backtrace) noexcept
+    : cause_(std::move(cause))
+    , backtrace_(backtrace)
+  {
+    cause_.IgnoreCheck();
+  }
+
+  std::string GetMessage() const override
+  {
+    auto info = cause_.info();
+    return info ? info->GetFullMessage() : std::string();
+  }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    cause_.WriteMessage(sink);
+  }
+
+  IErrorInfo const *CastTo(void const *class_id) const noexcept override
+  {
+    if (auto self = ErrorInfo::CastTo(class_id)) return self;
+    auto info = cause_.info();
+    return info ? info->CastTo(class_id) : nullptr;
+  }
+
+  void const *GetClassId() const noexcept override
+  {
+    auto info = cause_.info();
+    return info ? info->GetClassId() : IErrorInfo::ClassId();
+  }
+
+  Error const &cause() const noexcept { return cause_; }
+  Backtrace const &backtrace() const noexcept { return backtrace_; }
+
+ private:
+  Error cause_;
+  Backtrace backtrace_;
+};
+
+/**
+ * Capture the backtrace of the caller into \p err
+ * No-op if \p err is a success.
+ */
+KERROR_COLD KERROR_NOINLINE Error WithBacktrace(Error err);
+
+/**
+ * \return
+ *   The backtrace captured by WithBacktrace(), nullptr if there is not
+ */
+Backtrace const *GetBacktrace(Error const &err) noexcept;
+
+/**
+ * Like PError(), the backtrace is printed following the message if there is.
+ * This is not async-signal-safe since the symbolization allocates.
+ */
+KERROR_COLD void PErrorBacktrace(char const *prefix, Error const &err);
+
+} // namespace kerror
+
+/**
+ * WithBacktrace(err) if sampled, see KERROR_SAMPLED()
+ * \p err is evaluated once in whichever branch runs, so it should be an
+ * expression creating the error(a prvalue), a variable of Error can't be
+ * passed since Error is move-only.
+ */
+#define KERROR_SAMPLED_BACKTRACE(policy, n, err)                               \
+  (KERROR_SAMPLED(policy, n) ? ::kerror::WithBacktrace(err) : (err))
+
+#endif
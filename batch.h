@@ -0,0 +1,190 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Results of a batch operation in struct-of-arrays layout.
+//
+// std::vector<ErrorOr<T>> stores an Error and a flag with each value, which
+// more than doubles the memory of small T and breaks the dense layout of
+// the values. ErrorOrBatch<T> stores the values densely, a bitmap of the
+// failed indices and the errors of only the failed indices:
+//   ErrorOrBatch<float> scores(n);
+//   for (size_t i = 0; i < n; ++i) {
+//     if (!Valid(rows[i]))
+//       scores.SetError(i, MakeStaticError("invalid row"));
+//     else
+//       scores[i] = Score(rows[i]);
+//   }
+//   if (!scores.all_succeeded()) {
+//     for (auto const &failure : scores.failures()) ...
+//   }
+
+#ifndef _KERROR_BATCH_H__
+#define _KERROR_BATCH_H__
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "kerror.h"
+
+namespace kerror {
+namespace detail {
+
+KERROR_INLINE int Popcount(uint64_t word) noexcept
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(word);
+#else
+  int n = 0;
+  for (; word; word &= word - 1) ++n;
+  return n;
+#endif
+}
+
+} // namespace detail
+
+template <typename T>
+class ErrorOrBatch {
+ public:
+  struct Failure {
+    size_t index;
+    Error error;
+  };
+
+  /**
+   * The values are value-initialized, i.e. all succeeded
+   */
+  explicit ErrorOrBatch(size_t n)
+    : values_(new T[n]())
+    , size_(n)
+    , bitmap_((n + 63) / 64)
+  {
+  }
+
+  size_t size() const noexcept { return size_; }
+
+  T &operator[](size_t i) noexcept { return values_[i]; }
+  T const &operator[](size_t i) const noexcept { return values_[i]; }
+
+  /**
+   * The values are dense, the value of the failed index is unspecified
+   */
+  T *data() noexcept { return values_.get(); }
+  T const *data() const noexcept { return values_.get(); }
+
+  /**
+   * Mark \p i as failed with \p err
+   * No-op if \p err is a success.
+   *
+   * \warning
+   *   Not thread-safe, the threads should fill the separate batches
+   */
+  KERROR_NOINLINE void SetError(size_t i, Error err)
+  {
+    assert(i < size());
+    if (!err) return;
+
+    auto &word = bitmap_[i / 64];
+    auto const bit = uint64_t(1) << (i % 64);
+    if (word & bit) {
+      // Replace the error of the failed index
+      auto &error = failures_[FindFailure(i) - failures_.data()].error;
+      error = std::move(err);
+      error.IgnoreCheck();
+      return;
+    }
+
+    word |= bit;
+    // Usually filled in order, then the table is kept sorted
+    if (!failures_.empty() && failures_.back().index > i) sorted_ = false;
+    failures_.push_back(Failure{i, std::move(err)});
+    // Checked by the reader of the failures
+    failures_.back().error.IgnoreCheck();
+  }
+
+  bool failed(size_t i) const noexcept
+  {
+    return bitmap_[i / 64] & (uint64_t(1) << (i % 64));
+  }
+
+  /**
+   * \return
+   *   nullptr if \p i is not failed
+   */
+  Error const *error(size_t i) const
+  {
+    auto failure = failed(i) ? FindFailure(i) : nullptr;
+    return failure ? &failure->error : nullptr;
+  }
+
+  /**
+   * Scan the bitmap, 64 items per word
+   */
+  bool all_succeeded() const noexcept
+  {
+    uint64_t any = 0;
+    for (auto word : bitmap_) {
+      any |= word;
+    }
+    return any == 0;
+  }
+
+  /**
+   * Count the failures by popcount of the bitmap
+   */
+  size_t failure_count() const noexcept
+  {
+    size_t n = 0;
+    for (auto word : bitmap_) {
+      n += static_cast<size_t>(detail::Popcount(word));
+    }
+    return n;
+  }
+
+  /**
+   * \return
+   *   The failures ordered by index
+   */
+  std::vector<Failure> const &failures() const
+  {
+    EnsureSorted();
+    return failures_;
+  }
+
+ private:
+  Failure const *FindFailure(size_t i) const
+  {
+    EnsureSorted();
+    auto iter = std::lower_bound(
+        failures_.begin(), failures_.end(), i,
+        [](Failure const &failure, size_t index) {
+          return failure.index < index;
+        });
+    return iter != failures_.end() && iter->index == i ? &*iter : nullptr;
+  }
+
+  void EnsureSorted() const
+  {
+    if (sorted_) return;
+    std::sort(failures_.begin(), failures_.end(),
+              [](Failure const &x, Failure const &y) {
+                return x.index < y.index;
+              });
+    // The move assignment of Error resets the checked bit
+    for (auto &failure : failures_) {
+      failure.error.IgnoreCheck();
+    }
+    sorted_ = true;
+  }
+
+  // Not std::vector<T>, which is not contiguous for bool
+  std::unique_ptr<T[]> values_;
+  size_t size_;
+  std::vector<uint64_t> bitmap_;
+  // Sorted lazily by the const readers
+  mutable std::vector<Failure> failures_;
+  mutable bool sorted_ = true;
+};
+
+} // namespace kerror
+
+#endif
@@ -0,0 +1,481 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Benchmarks of Error/ErrorOr against exceptions, std::error_code and
+// std::expected(if the standard library provides it, i.e. C++23).
+//
+// There is no build script like the library, e.g.
+//   g++ -std=c++23 -O2 -DNDEBUG -fno-omit-frame-pointer bench.cc kerror.cc
+//       async_sink.cc backtrace.cc binlog.cc -pthread
+//   ./a.out [filter]
+// Only the benchmarks whose name contains the filter are run.
+
+#include "kerror.h"
+#include "async_sink.h"
+#include "backtrace.h"
+#include "binlog.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__has_include)
+#  if __has_include(<version>)
+#    include <version>
+#  endif
+#endif
+#if defined(__cpp_lib_expected)
+#  include <expected>
+#endif
+
+using namespace kerror;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+char const *g_filter = "";
+
+// Read in each iteration, so the result is not folded
+volatile bool g_fail = true;
+volatile bool g_succeed = false;
+
+template <typename T>
+KERROR_INLINE void DoNotOptimize(T const &value)
+{
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+double ElapsedNs(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count();
+}
+
+/**
+ * Run \p f(i) with increasing iterations until it takes 100ms at least
+ */
+template <typename F>
+void Bench(char const *name, F &&f)
+{
+  if (!strstr(name, g_filter)) return;
+
+  for (uint64_t iters = 1;;) {
+    auto const start = Clock::now();
+    for (uint64_t i = 0; i < iters; ++i) {
+      f(i);
+    }
+    auto const ns = ElapsedNs(start);
+    if (ns >= 1e8 || iters >= (uint64_t(1) << 32)) {
+      printf("%-44s %10.2f ns/op %12llu iters\n", name, ns / iters,
+             static_cast<unsigned long long>(iters));
+      return;
+    }
+    iters *= ns < 1e7 ? 10 : 2;
+  }
+}
+
+/**
+ * Run \p f(i) \p iters times on each of \p threads, the result is the
+ * elapsed time over all operations, i.e. the reciprocal of the throughput
+ */
+template <typename F>
+void BenchThreads(char const *name, int threads, uint64_t iters, F f)
+{
+  char full_name[64];
+  snprintf(full_name, sizeof full_name, "%s/threads:%d", name, threads);
+  if (!strstr(full_name, g_filter)) return;
+
+  std::vector<std::thread> workers;
+  auto const start = Clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&f, iters]() {
+      for (uint64_t i = 0; i < iters; ++i) {
+        f(i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto const ns = ElapsedNs(start);
+  printf("%-44s %10.2f ns/op %12llu iters\n", full_name,
+         ns / (iters * threads),
+         static_cast<unsigned long long>(iters * threads));
+}
+
+// The returns through N frames, the innermost one fails if fail is true.
+
+template <int N>
+struct Frames {
+  KERROR_NOINLINE static Error Kerror(bool fail)
+  {
+    KERROR_TRY(Frames<N - 1>::Kerror(fail));
+    return MakeSuccess();
+  }
+
+  KERROR_NOINLINE static ErrorOr<int> KerrorOr(bool fail)
+  {
+    int value;
+    KERROR_ASSIGN_OR_RETURN(value, Frames<N - 1>::KerrorOr(fail));
+    return value + 1;
+  }
+
+  KERROR_NOINLINE static int Exception(bool fail)
+  {
+    return Frames<N - 1>::Exception(fail) + 1;
+  }
+
+  KERROR_NOINLINE static std::error_code ErrorCode(bool fail)
+  {
+    auto ec = Frames<N - 1>::ErrorCode(fail);
+    if (ec) return ec;
+    return {};
+  }
+
+#if defined(__cpp_lib_expected)
+  KERROR_NOINLINE static std::expected<int, std::error_code>
+  Expected(bool fail)
+  {
+    auto res = Frames<N - 1>::Expected(fail);
+    if (!res) return res;
+    return *res + 1;
+  }
+#endif
+};
+
+template <>
+struct Frames<0> {
+  KERROR_NOINLINE static Error Kerror(bool fail)
+  {
+    if (fail) return MakeCodeError(SystemCategory(), EINVAL);
+    return MakeSuccess();
+  }
+
+  KERROR_NOINLINE static ErrorOr<int> KerrorOr(bool fail)
+  {
+    if (fail) return MakeCodeError(SystemCategory(), EINVAL);
+    return 0;
+  }
+
+  KERROR_NOINLINE static int Exception(bool fail)
+  {
+    if (fail) throw std::system_error(EINVAL, std::generic_category());
+    return 0;
+  }
+
+  KERROR_NOINLINE static std::error_code ErrorCode(bool fail)
+  {
+    if (fail) return std::error_code(EINVAL, std::generic_category());
+    return {};
+  }
+
+#if defined(__cpp_lib_expected)
+  KERROR_NOINLINE static std::expected<int, std::error_code>
+  Expected(bool fail)
+  {
+    if (fail) {
+      return std::unexpected(std::error_code(EINVAL, std::generic_category()));
+    }
+    return 0;
+  }
+#endif
+};
+
+template <int N>
+void BenchFrames(bool fail)
+{
+  char name[64];
+  auto const suffix = fail ? "failure" : "success";
+  auto const flag = fail ? &g_fail : &g_succeed;
+
+  snprintf(name, sizeof name, "frames:%d/%s/Error", N, suffix);
+  Bench(name, [flag](uint64_t) {
+    auto err = Frames<N>::Kerror(*flag);
+    if (err) DoNotOptimize(err.code());
+  });
+
+  snprintf(name, sizeof name, "frames:%d/%s/ErrorOr<int>", N, suffix);
+  Bench(name, [flag](uint64_t) {
+    auto res = Frames<N>::KerrorOr(*flag);
+    if (res)
+      DoNotOptimize(res.error().code());
+    else
+      DoNotOptimize(*res);
+  });
+
+  snprintf(name, sizeof name, "frames:%d/%s/exception", N, suffix);
+  Bench(name, [flag](uint64_t) {
+    try {
+      DoNotOptimize(Frames<N>::Exception(*flag));
+    }
+    catch (std::system_error const &e) {
+      DoNotOptimize(e.code().value());
+    }
+  });
+
+  snprintf(name, sizeof name, "frames:%d/%s/error_code", N, suffix);
+  Bench(name, [flag](uint64_t) {
+    auto ec = Frames<N>::ErrorCode(*flag);
+    DoNotOptimize(ec.value());
+  });
+
+#if defined(__cpp_lib_expected)
+  snprintf(name, sizeof name, "frames:%d/%s/expected", N, suffix);
+  Bench(name, [flag](uint64_t) {
+    auto res = Frames<N>::Expected(*flag);
+    if (res)
+      DoNotOptimize(*res);
+    else
+      DoNotOptimize(res.error().value());
+  });
+#endif
+}
+
+struct HeapErrorInfo : ErrorInfo<HeapErrorInfo> {
+  char buf[KERROR_INLINE_INFO_SIZE + 64];
+
+  std::string GetMessage() const override { return "heap"; }
+};
+
+void BenchCreation()
+{
+  Bench("create/MakeNoInfoError", [](uint64_t) {
+    auto err = MakeNoInfoError();
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  Bench("create/MakeStaticError", [](uint64_t) {
+    auto err = MakeStaticError("Failed to read the header");
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  Bench("create/MakeCodeError", [](uint64_t) {
+    auto err = MakeCodeError(SystemCategory(), EINVAL);
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  Bench("create/MakeMsgError", [](uint64_t) {
+    auto err = MakeMsgError("Failed to read the header");
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  Bench("create/MakeMsgErrorf", [](uint64_t i) {
+    auto err = MakeMsgErrorf("Failed to read %d bytes of %s",
+                             static_cast<int>(i), "the header");
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  Bench("create/MakeLazyMsgErrorf", [](uint64_t i) {
+    auto err = MakeLazyMsgErrorf("Failed to read %d bytes of %s",
+                                 static_cast<int>(i), "the header");
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  // Too large to be stored inline, recycled by the free list of the thread
+  Bench("create/MakeError(heap)", [](uint64_t) {
+    auto err = MakeError<HeapErrorInfo>();
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+  Bench("create/exception", [](uint64_t) {
+    try {
+      throw std::runtime_error("Failed to read the header");
+    }
+    catch (std::exception const &e) {
+      DoNotOptimize(e.what());
+    }
+  });
+  Bench("create/error_code", [](uint64_t) {
+    auto ec = std::error_code(EINVAL, std::generic_category());
+    DoNotOptimize(ec);
+  });
+#if defined(__cpp_lib_expected)
+  Bench("create/expected", [](uint64_t) {
+    std::expected<int, std::error_code> res =
+        std::unexpected(std::error_code(EINVAL, std::generic_category()));
+    DoNotOptimize(res);
+  });
+#endif
+}
+
+// The backtraces through N frames, the frame pointers are walked only if
+// compiled with -fno-omit-frame-pointer, otherwise only 1 frame is captured.
+
+template <int N>
+struct BacktraceFrames {
+  KERROR_NOINLINE static int Capture()
+  {
+    return BacktraceFrames<N - 1>::Capture() + 1;
+  }
+
+  KERROR_NOINLINE static Error Fail()
+  {
+    KERROR_TRY(BacktraceFrames<N - 1>::Fail());
+    return MakeSuccess();
+  }
+};
+
+template <>
+struct BacktraceFrames<0> {
+  KERROR_NOINLINE static int Capture()
+  {
+    auto const backtrace = Backtrace::Capture();
+    DoNotOptimize(backtrace);
+    return backtrace.size();
+  }
+
+  KERROR_NOINLINE static Error Fail()
+  {
+    return WithBacktrace(MakeStaticError("Unexpected EOF"));
+  }
+};
+
+void BenchBacktrace()
+{
+  Bench("backtrace/frames:10/Capture", [](uint64_t) {
+    DoNotOptimize(BacktraceFrames<10>::Capture());
+  });
+  Bench("backtrace/frames:10/WithBacktrace", [](uint64_t) {
+    auto err = BacktraceFrames<10>::Fail();
+    DoNotOptimize(err);
+    err.IgnoreCheck();
+  });
+}
+
+void BenchMoves()
+{
+  Bench("move/ErrorOr<int>", [](uint64_t i) {
+    ErrorOr<int> a(static_cast<int>(i));
+    ErrorOr<int> b(std::move(a));
+    DoNotOptimize(b);
+  });
+
+  std::vector<int> vec(64, 1);
+  Bench("move/ErrorOr<vector<int>>", [&vec](uint64_t) {
+    ErrorOr<std::vector<int>> a(std::move(vec));
+    ErrorOr<std::vector<int>> b(std::move(a));
+    DoNotOptimize(b);
+    vec = std::move(*b);
+  });
+
+#if defined(__cpp_lib_expected)
+  Bench("move/expected<int>", [](uint64_t i) {
+    std::expected<int, std::error_code> a(static_cast<int>(i));
+    std::expected<int, std::error_code> b(std::move(a));
+    DoNotOptimize(b);
+  });
+
+  Bench("move/expected<vector<int>>", [&vec](uint64_t) {
+    std::expected<std::vector<int>, std::error_code> a(std::move(vec));
+    std::expected<std::vector<int>, std::error_code> b(std::move(a));
+    DoNotOptimize(b);
+    vec = std::move(*b);
+  });
+#endif
+}
+
+// Discard the reports, so the cost of the reporting itself is measured
+struct NullSink final : ReportSink {
+  void Write(char const *data, size_t n) noexcept override
+  {
+    DoNotOptimize(data);
+    DoNotOptimize(n);
+  }
+};
+
+void BenchReport()
+{
+  NullSink null_sink;
+  auto const old = SetReportSink(&null_sink);
+  auto null_file = fopen("/dev/null", "w");
+  for (int threads : {1, 4, 16}) {
+    uint64_t const iters = 400000 / threads;
+    BenchThreads("report/PError", threads, iters, [](uint64_t) {
+      PError("Reason: ", MakeCodeError(SystemCategory(), ENOENT));
+    });
+    BenchThreads("report/fprintf", threads, iters, [null_file](uint64_t) {
+      fprintf(null_file, "Reason: %s\n", strerror(ENOENT));
+    });
+    // Only the exceptions are thrown, the unwinder is shared by threads
+    BenchThreads("report/exception", threads, iters / 10, [](uint64_t) {
+      try {
+        throw std::system_error(ENOENT, std::generic_category());
+      }
+      catch (std::exception const &e) {
+        DoNotOptimize(e.what());
+      }
+    });
+  }
+
+  {
+    AsyncReportSink async_sink(1024, AsyncReportSink::OverflowPolicy::kDrop,
+                               null_sink);
+    SetReportSink(&async_sink);
+    for (int threads : {1, 4, 16}) {
+      BenchThreads("report/PError(async)", threads, 400000 / threads,
+                   [](uint64_t) {
+                     PError("Reason: ",
+                            MakeCodeError(SystemCategory(), ENOENT));
+                   });
+    }
+  }
+  fclose(null_file);
+  SetReportSink(old == &StderrSink() ? nullptr : old);
+
+  // The buffers are large enough, so the reports are not dropped
+  auto const path = "/tmp/kerror_bench.klog";
+  if (auto err = OpenBinaryLog(path, 32 << 20)) {
+    PError("Failed to open the binary log: ", err);
+    return;
+  }
+  // Allocate the buffers of the threads before, they are reused by the
+  // threads of the benchmarks after the threads exit
+  {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 16; ++t) {
+      workers.emplace_back([]() {
+        KERROR_BINLOG_PERROR("Warmup: ",
+                             MakeCodeError(SystemCategory(), ENOENT));
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+  for (int threads : {1, 4, 16}) {
+    uint64_t const iters = 200000 / threads;
+    BenchThreads("report/KERROR_BINLOG_PERROR", threads, iters, [](uint64_t) {
+      KERROR_BINLOG_PERROR("Reason: ", MakeCodeError(SystemCategory(), ENOENT));
+    });
+    BenchThreads("report/KERROR_BINLOG_PSYSERRORF", threads, iters,
+                 [](uint64_t i) {
+                   KERROR_BINLOG_PSYSERRORF("Failed to read %d bytes of %s",
+                                            static_cast<int>(i), "the header");
+                 });
+  }
+  CloseBinaryLog();
+  unlink(path);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc > 1) g_filter = argv[1];
+
+  for (bool fail : {false, true}) {
+    BenchFrames<1>(fail);
+    BenchFrames<5>(fail);
+    BenchFrames<20>(fail);
+  }
+  BenchCreation();
+  BenchBacktrace();
+  BenchMoves();
+  BenchReport();
+}
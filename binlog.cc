@@ -0,0 +1,910 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "binlog.h"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace kerror;
+
+// The file is a header followed by the entries:
+//   char[7] "KBINLOG", u8 version
+//   entry:  u8 type(EntryType), u32 size of the whole entry
+//   kSite:     u32 id, u8 kind, i32 line, file and format terminated by null
+//   kRecord:   u32 site id, u64 coarse realtime in ns, arguments
+//   kDropped:  u64 the number of reports dropped since the buffer is full
+// where the argument is u8 BinlogArg followed by:
+//   kInt, kUint, kDouble, kPointer: 8 bytes
+//   kString:   u32 length, bytes
+//   kError:    u8 kErrorCode, i64 code, u32 length, category name
+//              u8 kErrorText, u32 length, full message
+// The integers are in native byte order, the entries of a site are written
+// after its definition.
+
+namespace {
+
+constexpr char kMagic[] = "KBINLOG";
+constexpr uint8_t kBinlogVersion = 1;
+constexpr size_t kFileHeaderSize = sizeof kMagic;
+constexpr size_t kEntryHeaderSize = 5;
+constexpr size_t kRecordHeaderSize = kEntryHeaderSize + 4 + 8;
+// The sites are static objects of the program, the larger ids read by the
+// decoder are corrupted instead of being allocated for
+constexpr uint32_t kMaxSites = 1 << 20;
+
+enum EntryType : uint8_t {
+  kSite = 1,
+  kRecord,
+  kDropped,
+};
+
+enum ErrorForm : uint8_t {
+  kErrorCode,
+  kErrorText,
+};
+
+std::atomic<BinlogSite *> g_sites{nullptr};
+std::atomic<uint32_t> g_site_count{0};
+
+/**
+ * The bytes of the records of a thread, an SPSC ring between the owner
+ * thread and the flusher. Reused by other threads after the owner exits
+ * like the shards of metrics.cc, so the flusher never reads a freed buffer.
+ */
+struct ThreadBuffer {
+  std::unique_ptr<char[]> data;
+  size_t mask;
+  char pad0_[64];
+
+  // Written by the owner thread
+  std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> dropped;
+  char pad1_[64];
+
+  // Written by the flusher
+  std::atomic<uint64_t> head;
+  uint64_t reported_dropped;
+
+  std::atomic<bool> in_use;
+  ThreadBuffer *next;
+};
+
+std::atomic<ThreadBuffer *> g_buffers{nullptr};
+std::atomic<size_t> g_buffer_size{1 << 20};
+
+// Trivial, so it is accessed without the TLS wrapper
+thread_local ThreadBuffer *t_buffer = nullptr;
+
+struct BufferReleaser {
+  ~BufferReleaser() noexcept
+  {
+    t_buffer->in_use.store(false, std::memory_order_release);
+    t_buffer = nullptr;
+  }
+};
+
+size_t RoundUpToPowerOf2(size_t n) noexcept
+{
+  size_t ret = 1;
+  while (ret < n) ret <<= 1;
+  return ret;
+}
+
+KERROR_COLD KERROR_NOINLINE ThreadBuffer *AcquireBuffer() noexcept
+{
+  auto const size =
+      RoundUpToPowerOf2(g_buffer_size.load(std::memory_order_relaxed));
+  ThreadBuffer *buffer = nullptr;
+  for (auto p = g_buffers.load(std::memory_order_acquire); p; p = p->next) {
+    // The buffers smaller than the current size are not reused
+    bool expected = false;
+    if (p->mask + 1 >= size &&
+        p->in_use.compare_exchange_strong(expected, true,
+                                          std::memory_order_acquire))
+    {
+      buffer = p;
+      break;
+    }
+  }
+
+  if (!buffer) {
+    buffer = new (std::nothrow) ThreadBuffer();
+    if (!buffer) return nullptr;
+    buffer->data.reset(new (std::nothrow) char[size]);
+    if (!buffer->data) {
+      delete buffer;
+      return nullptr;
+    }
+    // Touch the pages, so the reporting threads don't take the page faults
+    memset(buffer->data.get(), 0, size);
+    buffer->mask = size - 1;
+    buffer->in_use.store(true, std::memory_order_relaxed);
+    buffer->next = g_buffers.load(std::memory_order_relaxed);
+    while (!g_buffers.compare_exchange_weak(buffer->next, buffer,
+                                            std::memory_order_release))
+    {
+    }
+  }
+
+  t_buffer = buffer;
+  static thread_local BufferReleaser releaser;
+  (void)releaser;
+  return buffer;
+}
+
+void Push(ThreadBuffer &buffer, char const *data, size_t n) noexcept
+{
+  auto const tail = buffer.tail.load(std::memory_order_relaxed);
+  auto const head = buffer.head.load(std::memory_order_acquire);
+  if (n > buffer.mask + 1 - (tail - head)) {
+    // Single writer, no read-modify-write is required
+    buffer.dropped.store(buffer.dropped.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+    return;
+  }
+
+  auto const pos = static_cast<size_t>(tail) & buffer.mask;
+  auto const first = n < buffer.mask + 1 - pos ? n : buffer.mask + 1 - pos;
+  memcpy(buffer.data.get() + pos, data, first);
+  memcpy(buffer.data.get(), data + first, n - first);
+  buffer.tail.store(tail + n, std::memory_order_release);
+}
+
+/**
+ * Write the file by a sliding shared mapping of kWindowSize, the file is
+ * extended by ftruncate() before the window is mapped
+ */
+class MappedFile {
+ public:
+  static constexpr size_t kWindowSize = 4 << 20;
+
+  bool is_open() const noexcept { return fd_ >= 0; }
+
+  Error Open(char const *path)
+  {
+    fd_ = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) return MakeSysError();
+    size_ = 0;
+    if (!Map(0)) {
+      auto err = MakeSysError();
+      close(fd_);
+      fd_ = -1;
+      return err;
+    }
+    return MakeSuccess();
+  }
+
+  /**
+   * The bytes are discarded if the file can't be extended
+   */
+  void Write(char const *data, size_t n) noexcept
+  {
+    while (n > 0 && map_) {
+      auto const used = static_cast<size_t>(size_ - offset_);
+      auto const len = n < kWindowSize - used ? n : kWindowSize - used;
+      memcpy(map_ + used, data, len);
+      size_ += len;
+      data += len;
+      n -= len;
+      if (size_ - offset_ == kWindowSize) Map(size_);
+    }
+  }
+
+  void Close() noexcept
+  {
+    if (map_) munmap(map_, kWindowSize);
+    map_ = nullptr;
+    // Drop the unused tail of the window
+    if (ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+      // Keep the zeros, the decoder stops there
+    }
+    close(fd_);
+    fd_ = -1;
+  }
+
+ private:
+  bool Map(uint64_t offset) noexcept
+  {
+    if (map_) munmap(map_, kWindowSize);
+    map_ = nullptr;
+    offset_ = offset;
+    if (ftruncate(fd_, static_cast<off_t>(offset + kWindowSize)) != 0) {
+      return false;
+    }
+    auto map = mmap(nullptr, kWindowSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd_, static_cast<off_t>(offset));
+    if (map == MAP_FAILED) return false;
+    map_ = static_cast<char *>(map);
+    return true;
+  }
+
+  int fd_ = -1;
+  char *map_ = nullptr;
+  // The offset of the window
+  uint64_t offset_ = 0;
+  // The bytes written
+  uint64_t size_ = 0;
+};
+
+constexpr size_t MappedFile::kWindowSize;
+
+void PutU32(char *p, uint32_t v) noexcept { memcpy(p, &v, sizeof v); }
+
+/**
+ * The state of the open log, the rounds of copying the buffers are
+ * serialized by mutex, and open/close by control_mutex
+ */
+struct BinaryLog {
+  struct Snapshot {
+    ThreadBuffer *buffer;
+    uint64_t tail;
+  };
+
+  std::mutex control_mutex;
+  std::mutex mutex;
+  MappedFile file;
+  std::vector<bool> written_sites;
+  std::vector<Snapshot> snapshots;
+  std::atomic<bool> stopped{false};
+  std::thread flusher;
+
+  void WriteEntryHeader(EntryType type, size_t size) noexcept
+  {
+    char header[kEntryHeaderSize];
+    header[0] = static_cast<char>(type);
+    PutU32(header + 1, static_cast<uint32_t>(size));
+    file.Write(header, sizeof header);
+  }
+
+  void WriteSite(BinlogSite const &site)
+  {
+    auto const file_size = strlen(site.file()) + 1;
+    auto const format_size = strlen(site.format()) + 1;
+    WriteEntryHeader(kSite, kEntryHeaderSize + 4 + 1 + 4 + file_size +
+                                format_size);
+    char fields[9];
+    PutU32(fields, site.id());
+    fields[4] = static_cast<char>(site.kind());
+    int32_t const line = site.line();
+    memcpy(fields + 5, &line, sizeof line);
+    file.Write(fields, sizeof fields);
+    file.Write(site.file(), file_size);
+    file.Write(site.format(), format_size);
+  }
+
+  void WriteNewSites()
+  {
+    for (BinlogSite const *site = g_sites.load(std::memory_order_acquire);
+         site; site = site->next())
+    {
+      if (site->id() >= written_sites.size()) {
+        written_sites.resize(site->id() + 1);
+      }
+      if (written_sites[site->id()]) continue;
+      WriteSite(*site);
+      written_sites[site->id()] = true;
+    }
+  }
+
+  /**
+   * \return
+   *   false if there is nothing to copy
+   */
+  bool Round()
+  {
+    // The tails are loaded before the sites, then the sites of the records
+    // before the tails are linked(the site is registered before its use).
+    snapshots.clear();
+    for (auto buffer = g_buffers.load(std::memory_order_acquire); buffer;
+         buffer = buffer->next)
+    {
+      snapshots.push_back(
+          Snapshot{buffer, buffer->tail.load(std::memory_order_acquire)});
+    }
+    WriteNewSites();
+
+    bool copied = false;
+    for (auto const &snapshot : snapshots) {
+      auto &buffer = *snapshot.buffer;
+      auto const head = buffer.head.load(std::memory_order_relaxed);
+      auto const n = static_cast<size_t>(snapshot.tail - head);
+      if (n > 0) {
+        auto const pos = static_cast<size_t>(head) & buffer.mask;
+        auto const first =
+            n < buffer.mask + 1 - pos ? n : buffer.mask + 1 - pos;
+        file.Write(buffer.data.get() + pos, first);
+        file.Write(buffer.data.get(), n - first);
+        buffer.head.store(snapshot.tail, std::memory_order_release);
+        copied = true;
+      }
+
+      auto const dropped = buffer.dropped.load(std::memory_order_relaxed);
+      if (dropped != buffer.reported_dropped) {
+        uint64_t const count = dropped - buffer.reported_dropped;
+        WriteEntryHeader(kDropped, kEntryHeaderSize + sizeof count);
+        file.Write(reinterpret_cast<char const *>(&count), sizeof count);
+        buffer.reported_dropped = dropped;
+      }
+    }
+    return copied;
+  }
+
+  void Run()
+  {
+    // Like AsyncReportSink, the reporting threads don't notify this
+    auto idle = std::chrono::microseconds(100);
+    auto const kMaxIdle = std::chrono::microseconds(50 * 1000);
+
+    while (!stopped.load(std::memory_order_acquire)) {
+      bool copied;
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        copied = Round();
+      }
+      if (copied) {
+        idle = std::chrono::microseconds(100);
+        continue;
+      }
+      std::this_thread::sleep_for(idle);
+      if (idle < kMaxIdle) idle *= 2;
+    }
+  }
+};
+
+// Leaked, so the log can be closed by atexit()
+BinaryLog &GetBinaryLog()
+{
+  static auto log = new BinaryLog;
+  return *log;
+}
+
+class Reader {
+ public:
+  explicit Reader(StringSlice data) noexcept
+    : p_(data.data())
+    , end_(data.data() + data.size())
+  {
+  }
+
+  bool Read(void *out, size_t n) noexcept
+  {
+    if (n > static_cast<size_t>(end_ - p_)) return false;
+    memcpy(out, p_, n);
+    p_ += n;
+    return true;
+  }
+
+  bool ReadSlice(StringSlice *slice) noexcept
+  {
+    uint32_t size;
+    if (!Read(&size, sizeof size) || size > static_cast<size_t>(end_ - p_)) {
+      return false;
+    }
+    *slice = StringSlice(p_, size);
+    p_ += size;
+    return true;
+  }
+
+  /**
+   * Read the string terminated by null
+   */
+  char const *ReadString() noexcept
+  {
+    auto const end = static_cast<char const *>(memchr(p_, 0, end_ - p_));
+    if (!end) return nullptr;
+    auto const str = p_;
+    p_ = end + 1;
+    return str;
+  }
+
+ private:
+  char const *p_;
+  char const *end_;
+};
+
+struct Arg {
+  detail::BinlogArg type;
+  union {
+    long long i;
+    unsigned long long u;
+    double d;
+    void const *p;
+  };
+  ErrorForm form;
+  StringSlice str{""};
+};
+
+bool ReadArg(Reader &reader, Arg *arg) noexcept
+{
+  if (!reader.Read(&arg->type, 1)) return false;
+  switch (arg->type) {
+    case detail::BinlogArg::kInt:
+    case detail::BinlogArg::kUint:
+    case detail::BinlogArg::kDouble:
+    case detail::BinlogArg::kPointer:
+      static_assert(sizeof arg->p <= 8, "The pointer is written in 8 bytes");
+      return reader.Read(&arg->u, 8);
+    case detail::BinlogArg::kString:
+      return reader.ReadSlice(&arg->str);
+    case detail::BinlogArg::kError:
+      if (!reader.Read(&arg->form, 1)) return false;
+      if (arg->form == kErrorCode && !reader.Read(&arg->i, 8)) return false;
+      return reader.ReadSlice(&arg->str);
+  }
+  return false;
+}
+
+void WriteInt(MessageSink &sink, long long v)
+{
+  char buf[32];
+  auto const n = snprintf(buf, sizeof buf, "%lld", v);
+  sink.Write(buf, static_cast<size_t>(n));
+}
+
+void WriteError(Arg const &arg, MessageSink &sink)
+{
+  if (arg.form == kErrorText) {
+    sink.Write(arg.str.data(), arg.str.size());
+    return;
+  }
+  // The category may be not registered in the decoder
+  if (auto category = detail::FindErrorCategory(arg.str)) {
+    category->WriteMessage(static_cast<int>(arg.i), sink);
+    return;
+  }
+  sink.Write(arg.str.data(), arg.str.size());
+  sink.Write(":", 1);
+  WriteInt(sink, arg.i);
+}
+
+/**
+ * Format \p fmt with the arguments read from \p reader as printf().
+ * The length modifiers are replaced by the written type of the argument,
+ * and the conversion which doesn't match the type is replaced by the
+ * default conversion of the type.
+ */
+void Format(char const *fmt, Reader &reader, MessageSink &sink)
+{
+  char out[512];
+  auto literal = fmt;
+  for (auto p = fmt; *p;) {
+    if (*p != '%') {
+      ++p;
+      continue;
+    }
+    sink.Write(literal, static_cast<size_t>(p - literal));
+
+    auto const spec_begin = p++;
+    if (*p == '%') {
+      sink.Write("%", 1);
+      literal = ++p;
+      continue;
+    }
+
+    // %[flags][width][.precision][length]conversion, the flags and width
+    // are kept in spec, the overlong ones are ignored
+    char spec[32] = "%";
+    size_t size = 1;
+    for (; *p && strchr("-+ #0", *p); ++p) {
+      if (size < 8) spec[size++] = *p;
+    }
+    for (; *p >= '0' && *p <= '9'; ++p) {
+      if (size < 16) spec[size++] = *p;
+    }
+    int precision = -1;
+    if (*p == '.') {
+      precision = 0;
+      for (++p; *p >= '0' && *p <= '9'; ++p) {
+        if (precision < 4096) precision = precision * 10 + (*p - '0');
+      }
+    }
+    while (*p && strchr("hlLqjzt", *p)) ++p;
+    char conv = *p;
+    if (conv) ++p;
+    literal = p;
+
+    Arg arg;
+    if (!conv || conv == 'n' || !ReadArg(reader, &arg)) {
+      // Keep the conversion without argument as it is
+      sink.Write(spec_begin, static_cast<size_t>(p - spec_begin));
+      continue;
+    }
+
+    // Append the precision and \p suffix to spec
+    auto finish = [&spec, size, precision](char const *suffix) {
+      auto n = size;
+      if (precision >= 0) {
+        n += static_cast<size_t>(
+            snprintf(spec + n, sizeof spec - n, ".%d", precision));
+      }
+      snprintf(spec + n, sizeof spec - n, "%s", suffix);
+    };
+
+    int n = 0;
+    switch (arg.type) {
+      case detail::BinlogArg::kInt:
+      case detail::BinlogArg::kUint: {
+        if (conv == 'c') {
+          finish("c");
+          n = snprintf(out, sizeof out, spec, static_cast<int>(arg.i));
+          break;
+        }
+        if (!strchr("diouxX", conv)) {
+          conv = arg.type == detail::BinlogArg::kInt ? 'd' : 'u';
+        }
+        char const suffix[] = {'l', 'l', conv, 0};
+        finish(suffix);
+        if (conv == 'd' || conv == 'i')
+          n = snprintf(out, sizeof out, spec, arg.i);
+        else
+          n = snprintf(out, sizeof out, spec, arg.u);
+      } break;
+      case detail::BinlogArg::kDouble: {
+        if (!strchr("fFeEgGaA", conv)) conv = 'g';
+        char const suffix[] = {conv, 0};
+        finish(suffix);
+        n = snprintf(out, sizeof out, spec, arg.d);
+      } break;
+      case detail::BinlogArg::kPointer:
+        finish("p");
+        n = snprintf(out, sizeof out, spec, arg.p);
+        break;
+      case detail::BinlogArg::kString: {
+        // The string is not terminated by null, the length is the precision
+        auto len = static_cast<int>(arg.str.size());
+        if (precision >= 0 && precision < len) len = precision;
+        snprintf(spec + size, sizeof spec - size, ".*s");
+        n = snprintf(out, sizeof out, spec, len, arg.str.data());
+      } break;
+      case detail::BinlogArg::kError:
+        WriteError(arg, sink);
+        break;
+    }
+    if (n > 0) {
+      sink.Write(out, static_cast<size_t>(n) < sizeof out
+                          ? static_cast<size_t>(n)
+                          : sizeof out - 1);
+    }
+  }
+  sink.Write(literal, strlen(literal));
+}
+
+/**
+ * Render the arguments of a record like PError() or PSysErrorf()
+ */
+void Render(uint8_t kind, char const *format, StringSlice args,
+            MessageSink &sink)
+{
+  Reader reader(args);
+  Arg arg;
+  if (kind == BinlogSite::kPError) {
+    sink.Write(format, strlen(format));
+    if (ReadArg(reader, &arg) && arg.type == detail::BinlogArg::kError) {
+      WriteError(arg, sink);
+    }
+    sink.Write("\n", 1);
+    return;
+  }
+
+  long long saved_errno = 0;
+  if (ReadArg(reader, &arg)) saved_errno = arg.i;
+  Format(format, reader, sink);
+  sink.Write("\nSysError: ", 11);
+  SystemCategory().WriteMessage(static_cast<int>(saved_errno), sink);
+  sink.Write("(", 1);
+  WriteInt(sink, saved_errno);
+  sink.Write(")\n", 2);
+}
+
+} // namespace
+
+namespace kerror {
+namespace detail {
+
+std::atomic<bool> g_binlog_open{false};
+
+} // namespace detail
+} // namespace kerror
+
+kerror::BinlogSite::BinlogSite(Kind kind, char const *file, int line,
+                               char const *format) noexcept
+  : file_(file)
+  , format_(format)
+  , line_(line)
+  , kind_(kind)
+  , id_(g_site_count.fetch_add(1, std::memory_order_relaxed))
+  , next_(g_sites.load(std::memory_order_relaxed))
+{
+  while (!g_sites.compare_exchange_weak(next_, this,
+                                        std::memory_order_release))
+  {
+  }
+}
+
+constexpr size_t detail::BinlogRecord::kMaxSize;
+
+kerror::detail::BinlogRecord::BinlogRecord(BinlogSite const &site) noexcept
+  : site_(site)
+  , size_(kRecordHeaderSize)
+{
+  timespec ts;
+  // The coarse clock is several times cheaper, a tick is enough to order the
+  // reports of different threads roughly
+#ifdef CLOCK_REALTIME_COARSE
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+  uint64_t const now = static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+                       static_cast<uint64_t>(ts.tv_nsec);
+  buf_[0] = static_cast<char>(kRecord);
+  PutU32(buf_ + kEntryHeaderSize, site.id());
+  memcpy(buf_ + kEntryHeaderSize + 4, &now, sizeof now);
+}
+
+void kerror::detail::BinlogRecord::Write(char const *data, size_t n) noexcept
+{
+  auto const len = n < kMaxSize - size_ ? n : kMaxSize - size_;
+  memcpy(buf_ + size_, data, len);
+  size_ += len;
+}
+
+void kerror::detail::BinlogRecord::PutFixed(BinlogArg arg,
+                                            void const *value) noexcept
+{
+  // The argument is not truncated
+  if (kMaxSize - size_ < 9) return;
+  buf_[size_] = static_cast<char>(arg);
+  memcpy(buf_ + size_ + 1, value, 8);
+  size_ += 9;
+}
+
+void kerror::detail::BinlogRecord::Put(long long value) noexcept
+{
+  PutFixed(BinlogArg::kInt, &value);
+}
+
+void kerror::detail::BinlogRecord::Put(unsigned long long value) noexcept
+{
+  PutFixed(BinlogArg::kUint, &value);
+}
+
+void kerror::detail::BinlogRecord::Put(double value) noexcept
+{
+  PutFixed(BinlogArg::kDouble, &value);
+}
+
+void kerror::detail::BinlogRecord::Put(void const *value) noexcept
+{
+  uint64_t const v = reinterpret_cast<uintptr_t>(value);
+  PutFixed(BinlogArg::kPointer, &v);
+}
+
+void kerror::detail::BinlogRecord::Put(char const *value) noexcept
+{
+  if (!value) value = "(null)";
+  if (kMaxSize - size_ < 5) return;
+  buf_[size_] = static_cast<char>(BinlogArg::kString);
+  auto const start = size_ += 5;
+  Write(value, strlen(value));
+  PutU32(buf_ + start - 4, static_cast<uint32_t>(size_ - start));
+}
+
+void kerror::detail::BinlogRecord::Put(Error const &err) noexcept
+{
+  if (kMaxSize - size_ < 2 + 8 + 4) return;
+  buf_[size_] = static_cast<char>(BinlogArg::kError);
+
+  auto const category = err.is_error() ? err.category() : nullptr;
+  // Don't materialize the packed error code
+  IErrorInfo const *info =
+      err.is_inline() || err.is_allocated() ? err.info() : nullptr;
+  if (category && !(info && info->context())) {
+    buf_[size_ + 1] = static_cast<char>(kErrorCode);
+    int64_t const code = err.code();
+    memcpy(buf_ + size_ + 2, &code, sizeof code);
+    size_ += 2 + 8 + 4;
+    auto const start = size_;
+    auto const name = StringSlice(category->GetName());
+    Write(name.data(), name.size());
+    PutU32(buf_ + start - 4, static_cast<uint32_t>(size_ - start));
+    return;
+  }
+
+  buf_[size_ + 1] = static_cast<char>(kErrorText);
+  size_ += 2 + 4;
+  auto const start = size_;
+  err.WriteMessage(*this);
+  PutU32(buf_ + start - 4, static_cast<uint32_t>(size_ - start));
+}
+
+void kerror::detail::BinlogRecord::Commit() noexcept
+{
+  PutU32(buf_ + 1, static_cast<uint32_t>(size_));
+  if (KERROR_LIKELY(g_binlog_open.load(std::memory_order_acquire))) {
+    auto buffer = t_buffer;
+    if (KERROR_UNLIKELY(!buffer)) {
+      buffer = AcquireBuffer();
+      if (!buffer) return;
+    }
+    Push(*buffer, buf_, size_);
+    return;
+  }
+
+  // Closed, render it as the text report
+  char text[kMaxSize];
+  BufferSink sink(text, sizeof text);
+  Render(site_.kind(), site_.format(),
+         StringSlice(buf_ + kRecordHeaderSize, size_ - kRecordHeaderSize),
+         sink);
+  GetReportSink().Write(text, sink.size() < sizeof text ? sink.size()
+                                                        : sizeof text - 1);
+}
+
+void kerror::detail::BinlogPError(BinlogSite const &site,
+                                  Error const &err) noexcept
+{
+  if (!g_binlog_open.load(std::memory_order_acquire)) {
+    PError(site.format(), err);
+    return;
+  }
+  BinlogRecord record(site);
+  record.Put(err);
+  record.Commit();
+}
+
+auto kerror::OpenBinaryLog(char const *path, size_t buffer_size) -> Error
+{
+  auto &log = GetBinaryLog();
+  std::lock_guard<std::mutex> control_guard(log.control_mutex);
+  if (log.file.is_open()) {
+    return MakeStaticError("The binary log is already open");
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(log.mutex);
+    KERROR_TRY(log.file.Open(path));
+    char header[kFileHeaderSize];
+    memcpy(header, kMagic, sizeof kMagic - 1);
+    header[sizeof kMagic - 1] = static_cast<char>(kBinlogVersion);
+    log.file.Write(header, sizeof header);
+    log.written_sites.clear();
+
+    // The records left in the buffers belong to the closed log
+    for (auto buffer = g_buffers.load(std::memory_order_acquire); buffer;
+         buffer = buffer->next)
+    {
+      buffer->head.store(buffer->tail.load(std::memory_order_acquire),
+                         std::memory_order_release);
+      buffer->reported_dropped =
+          buffer->dropped.load(std::memory_order_relaxed);
+    }
+  }
+
+  g_buffer_size.store(buffer_size ? buffer_size : 1,
+                      std::memory_order_relaxed);
+  static bool const registered = std::atexit(CloseBinaryLog) == 0;
+  (void)registered;
+
+  log.stopped.store(false, std::memory_order_relaxed);
+  log.flusher = std::thread([&log]() { log.Run(); });
+  detail::g_binlog_open.store(true, std::memory_order_release);
+  return MakeSuccess();
+}
+
+void kerror::FlushBinaryLog() noexcept
+{
+  auto &log = GetBinaryLog();
+  std::lock_guard<std::mutex> guard(log.mutex);
+  if (log.file.is_open()) log.Round();
+}
+
+void kerror::CloseBinaryLog() noexcept
+{
+  auto &log = GetBinaryLog();
+  std::lock_guard<std::mutex> control_guard(log.control_mutex);
+  if (!log.file.is_open()) return;
+
+  detail::g_binlog_open.store(false, std::memory_order_release);
+  log.stopped.store(true, std::memory_order_release);
+  log.flusher.join();
+
+  std::lock_guard<std::mutex> guard(log.mutex);
+  log.Round();
+  log.file.Close();
+}
+
+auto kerror::DecodeBinaryLog(StringSlice data, MessageSink &sink) -> Error
+{
+  if (data.size() < kFileHeaderSize ||
+      memcmp(data.data(), kMagic, sizeof kMagic - 1) != 0)
+  {
+    return MakeStaticError("Not a binary log");
+  }
+  if (static_cast<uint8_t>(data.data()[sizeof kMagic - 1]) !=
+      kBinlogVersion)
+  {
+    return MakeStaticError("Unsupported version of binary log");
+  }
+
+  struct Site {
+    char const *format = nullptr;
+    uint8_t kind = 0;
+  };
+  std::vector<Site> sites;
+
+  auto p = data.data() + kFileHeaderSize;
+  auto const end = data.data() + data.size();
+  while (p != end) {
+    uint32_t size;
+    if (end - p < static_cast<ptrdiff_t>(kEntryHeaderSize)) {
+      return MakeStaticError("Truncated binary log");
+    }
+    memcpy(&size, p + 1, sizeof size);
+    // The zeros of the unused window if the process crashed
+    if (p[0] == 0 && size == 0) break;
+    if (size < kEntryHeaderSize || size > static_cast<size_t>(end - p)) {
+      return MakeStaticError("Truncated binary log");
+    }
+
+    auto const type = static_cast<uint8_t>(p[0]);
+    Reader reader(StringSlice(p + kEntryHeaderSize, size - kEntryHeaderSize));
+    p += size;
+    if (type == kSite) {
+      uint32_t id;
+      uint8_t kind;
+      int32_t line;
+      if (!reader.Read(&id, sizeof id) || !reader.Read(&kind, 1) ||
+          !reader.Read(&line, sizeof line) || !reader.ReadString())
+      {
+        return MakeStaticError("Malformed site of binary log");
+      }
+      auto const format = reader.ReadString();
+      if (!format || id >= kMaxSites) {
+        return MakeStaticError("Malformed site of binary log");
+      }
+      if (id >= sites.size()) sites.resize(id + 1);
+      sites[id].format = format;
+      sites[id].kind = kind;
+    } else if (type == kRecord) {
+      uint32_t id;
+      uint64_t now;
+      if (!reader.Read(&id, sizeof id) || !reader.Read(&now, sizeof now) ||
+          id >= sites.size() || !sites[id].format)
+      {
+        return MakeStaticError("Malformed record of binary log");
+      }
+
+      char time[64];
+      auto const sec = static_cast<time_t>(now / 1000000000);
+      tm local;
+      localtime_r(&sec, &local);
+      auto n = strftime(time, sizeof time, "%Y-%m-%d %H:%M:%S", &local);
+      n += static_cast<size_t>(
+          snprintf(time + n, sizeof time - n, ".%03u ",
+                   static_cast<unsigned>(now % 1000000000 / 1000000)));
+      sink.Write(time, n);
+
+      auto const args = p - size + kRecordHeaderSize;
+      Render(sites[id].kind, sites[id].format,
+             StringSlice(args, static_cast<size_t>(p - args)), sink);
+    } else if (type == kDropped) {
+      uint64_t count;
+      if (!reader.Read(&count, sizeof count)) {
+        return MakeStaticError("Malformed binary log");
+      }
+      sink.Write("(", 1);
+      WriteInt(sink, static_cast<long long>(count));
+      sink.Write(" reports are dropped)\n", 22);
+    }
+    // Skip the unknown entries of the newer writers
+  }
+  return MakeSuccess();
+}
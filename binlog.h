@@ -0,0 +1,239 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Deferred binary reports(like NanoLog).
+//
+// The reports are not formatted by the reporting thread. The macros below
+// write the id of the static call site and the raw bytes of the arguments
+// into a buffer of the calling thread, and a background thread copies the
+// buffers into a memory-mapped file, which is rendered to text offline by
+// binlog_decoder:
+//   OpenBinaryLog("errors.klog");
+//   KERROR_BINLOG_PERROR("Failed to connect: ", err);
+//   KERROR_BINLOG_PSYSERRORF("Failed to open %s", path);
+//
+//   $ g++ -O2 binlog_decoder.cc binlog.cc kerror.cc -o binlog_decoder
+//   $ ./binlog_decoder errors.klog
+//
+// The format string, file and line are written once per call site. The
+// error code is written as the code and the name of its category, so the
+// message of the category(e.g. strerror()) is rendered by the decoder. The
+// message of the other infos is written by WriteMessage(), i.e. copied for
+// the static messages. The file is written through the shared mapping, so
+// the records already copied survive the crash of the process.
+//
+// If the binary log is not open, the macros fall back to the text reports
+// of PError() and PSysErrorf().
+
+#ifndef _KERROR_BINLOG_H__
+#define _KERROR_BINLOG_H__
+
+#include <type_traits>
+
+#include "kerror.h"
+
+namespace kerror {
+
+/**
+ * A call site of the binary log registered in its first use.
+ * Use the macros instead of constructing it.
+ */
+class BinlogSite {
+ public:
+  enum Kind : uint8_t {
+    // format is the prefix, the argument is the error
+    kPError,
+    // format is the format string, the first argument is errno
+    kPSysErrorf,
+  };
+
+  /**
+   * \Param file, format String literals
+   */
+  BinlogSite(Kind kind, char const *file, int line,
+             char const *format) noexcept;
+
+  BinlogSite(BinlogSite const &) = delete;
+  BinlogSite &operator=(BinlogSite const &) = delete;
+
+  Kind kind() const noexcept { return kind_; }
+  char const *file() const noexcept { return file_; }
+  int line() const noexcept { return line_; }
+  char const *format() const noexcept { return format_; }
+
+  /**
+   * Dense id in registration order
+   */
+  uint32_t id() const noexcept { return id_; }
+
+  BinlogSite const *next() const noexcept { return next_; }
+
+ private:
+  char const *file_;
+  char const *format_;
+  int line_;
+  Kind kind_;
+  uint32_t id_;
+  BinlogSite *next_;
+};
+
+/**
+ * Create(or truncate) the log file at \p path and start the flusher thread
+ *
+ * \Param buffer_size The size of the buffer of each reporting thread,
+ *                    rounded up to a power of 2. The report is dropped if
+ *                    the buffer is full, and the number of dropped reports
+ *                    is written to the file.
+ */
+Error OpenBinaryLog(char const *path, size_t buffer_size = 1 << 20);
+
+/**
+ * Copy the reports written before into the file.
+ * The reports of a thread are in order, but the reports of the different
+ * threads are only ordered by the flushes.
+ */
+void FlushBinaryLog() noexcept;
+
+/**
+ * Flush and close the file, the reports after this are written as text.
+ * The reports written concurrently with this may be lost.
+ */
+void CloseBinaryLog() noexcept;
+
+/**
+ * Render the binary log \p data(the whole file) to \p sink as text, a
+ * report is prefixed with its local time(in the resolution of the coarse
+ * clock, i.e. a tick):
+ *   2026-10-14 08:30:00.123 Failed to connect: Connection refused
+ *
+ * \return
+ *   The error if \p data is not a binary log or truncated, the reports
+ *   before are rendered
+ */
+Error DecodeBinaryLog(StringSlice data, MessageSink &sink);
+
+namespace detail {
+
+extern std::atomic<bool> g_binlog_open;
+
+enum class BinlogArg : uint8_t {
+  kInt,
+  kUint,
+  kDouble,
+  kPointer,
+  kString,
+  kError,
+};
+
+/**
+ * A record formatted in the stack, then copied into the buffer of the
+ * thread by a single copy
+ */
+class BinlogRecord final : public MessageSink {
+ public:
+  static constexpr size_t kMaxSize = 4096;
+
+  explicit BinlogRecord(BinlogSite const &site) noexcept;
+
+  void Write(char const *data, size_t n) noexcept override;
+
+  void Put(long long value) noexcept;
+  void Put(unsigned long long value) noexcept;
+  void Put(double value) noexcept;
+  void Put(void const *value) noexcept;
+  void Put(char const *value) noexcept;
+  void Put(Error const &err) noexcept;
+
+  /**
+   * Copy the record into the buffer of the calling thread, or render it to
+   * the report sink if the binary log is closed
+   */
+  void Commit() noexcept;
+
+ private:
+  void PutFixed(BinlogArg arg, void const *value) noexcept;
+
+  BinlogSite const &site_;
+  size_t size_;
+  char buf_[kMaxSize];
+};
+
+template <typename T>
+KERROR_INLINE typename std::enable_if<std::is_integral<T>::value ||
+                                      std::is_enum<T>::value>::type
+PutBinlogArg(BinlogRecord &record, T value) noexcept
+{
+  if (std::is_signed<T>::value || std::is_enum<T>::value)
+    record.Put(static_cast<long long>(value));
+  else
+    record.Put(static_cast<unsigned long long>(value));
+}
+
+KERROR_INLINE void PutBinlogArg(BinlogRecord &record, double value) noexcept
+{
+  record.Put(value);
+}
+
+KERROR_INLINE void PutBinlogArg(BinlogRecord &record,
+                                char const *value) noexcept
+{
+  record.Put(value);
+}
+
+KERROR_INLINE void PutBinlogArg(BinlogRecord &record,
+                                void const *value) noexcept
+{
+  record.Put(value);
+}
+
+KERROR_INLINE void PutBinlogArgs(BinlogRecord &) noexcept {}
+
+template <typename T, typename... Args>
+KERROR_INLINE void PutBinlogArgs(BinlogRecord &record, T const &value,
+                                 Args const &...args) noexcept
+{
+  PutBinlogArg(record, value);
+  PutBinlogArgs(record, args...);
+}
+
+KERROR_NOINLINE void BinlogPError(BinlogSite const &site,
+                                  Error const &err) noexcept;
+
+template <typename... Args>
+KERROR_NOINLINE void BinlogPSysErrorf(BinlogSite const &site, char const *,
+                                      Args const &...args) noexcept
+{
+  // Saved before the arguments are written
+  long long const saved_errno = errno;
+  BinlogRecord record(site);
+  record.Put(saved_errno);
+  PutBinlogArgs(record, args...);
+  record.Commit();
+}
+
+} // namespace detail
+} // namespace kerror
+
+/**
+ * Like PError(\p prefix, \p err), \p prefix must be a string literal
+ */
+#define KERROR_BINLOG_PERROR(prefix, err)                                      \
+  do {                                                                         \
+    static ::kerror::BinlogSite kerror_binlog_site_(                           \
+        ::kerror::BinlogSite::kPError, __FILE__, __LINE__, (prefix));          \
+    ::kerror::detail::BinlogPError(kerror_binlog_site_, (err));                \
+  } while (0)
+
+/**
+ * Like PSysErrorf(fmt, ...), the format string must be a string literal.
+ * The arguments are integers, floating-point numbers, pointers and C
+ * strings. The strings are copied, so they don't need to outlive this.
+ */
+#define KERROR_BINLOG_PSYSERRORF(...)                                          \
+  do {                                                                         \
+    static ::kerror::BinlogSite kerror_binlog_site_(                           \
+        ::kerror::BinlogSite::kPSysErrorf, __FILE__, __LINE__,                 \
+        KERROR_FIRST(__VA_ARGS__));                                            \
+    ::kerror::detail::BinlogPSysErrorf(kerror_binlog_site_, __VA_ARGS__);      \
+  } while (0)
+
+#endif
@@ -0,0 +1,77 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Render the binary log written by binlog.h to text:
+//   g++ -O2 binlog_decoder.cc binlog.cc kerror.cc -o binlog_decoder -pthread
+//   ./binlog_decoder errors.klog [more.klog...]
+//
+// The messages of the error categories are rendered by the categories
+// registered in the decoder, the other categories are rendered as
+// "name:code". Link the translation units defining them to render them.
+
+#include "binlog.h"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace kerror;
+
+namespace {
+
+struct StdoutSink final : MessageSink {
+  void Write(char const *data, size_t n) override
+  {
+    fwrite(data, 1, n, stdout);
+  }
+};
+
+Error Decode(char const *path, MessageSink &sink)
+{
+  auto const fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return MakeSysError();
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    auto err = MakeSysError();
+    close(fd);
+    return err;
+  }
+  auto const size = static_cast<size_t>(st.st_size);
+  if (size == 0) {
+    close(fd);
+    return MakeStaticError("Not a binary log");
+  }
+
+  auto const data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return MakeSysError();
+  auto err =
+      DecodeBinaryLog(StringSlice(static_cast<char const *>(data), size), sink);
+  munmap(data, size);
+  return err;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file>...\n", argv[0]);
+    return 2;
+  }
+
+  StdoutSink sink;
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (auto err = Decode(argv[i], sink)) {
+      fflush(stdout);
+      fprintf(stderr, "%s: ", argv[i]);
+      PError("", err);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,145 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "format.h"
+
+#include <cstdio>
+
+using namespace kerror;
+using detail::FormatArg;
+
+namespace {
+
+// Enough for any double printed by %g
+constexpr size_t kMaxDoubleSize = 32;
+
+size_t CountDigits(unsigned long long v, unsigned base) noexcept
+{
+  size_t n = 1;
+  while (v >= base) {
+    v /= base;
+    ++n;
+  }
+  return n;
+}
+
+char *WriteUint(char *p, unsigned long long v, unsigned base) noexcept
+{
+  static char const kDigits[] = "0123456789abcdef";
+  auto end = p + CountDigits(v, base);
+  auto cur = end;
+  do {
+    *--cur = kDigits[v % base];
+    v /= base;
+  } while (v);
+  return end;
+}
+
+unsigned long long Abs(long long v) noexcept
+{
+  return v < 0 ? 0ULL - static_cast<unsigned long long>(v)
+               : static_cast<unsigned long long>(v);
+}
+
+/**
+ * \return
+ *   The exact size of the argument formatted by "{}" except double
+ *   which is an upper bound, the other specs don't format it longer
+ */
+size_t FormattedSize(FormatArg const &arg) noexcept
+{
+  switch (arg.kind) {
+    case FormatArg::kBool:
+      return arg.b ? 4 : 5;
+    case FormatArg::kChar:
+      return 1;
+    case FormatArg::kInt:
+      return CountDigits(Abs(arg.i), 10) + (arg.i < 0);
+    case FormatArg::kUint:
+      return CountDigits(arg.u, 10);
+    case FormatArg::kDouble:
+      return kMaxDoubleSize;
+    case FormatArg::kString:
+      return arg.str.size;
+    case FormatArg::kPointer:
+      return 2 + CountDigits(reinterpret_cast<uintptr_t>(arg.p), 16);
+  }
+  return 0;
+}
+
+char *WriteArg(char *p, FormatArg const &arg, char spec) noexcept
+{
+  unsigned const base = spec == 'x' ? 16 : 10;
+  switch (arg.kind) {
+    case FormatArg::kBool:
+      if (arg.b) {
+        memcpy(p, "true", 4);
+        return p + 4;
+      }
+      memcpy(p, "false", 5);
+      return p + 5;
+    case FormatArg::kChar:
+      *p = arg.c;
+      return p + 1;
+    case FormatArg::kInt:
+      if (arg.i < 0) *p++ = '-';
+      return WriteUint(p, Abs(arg.i), base);
+    case FormatArg::kUint:
+      return WriteUint(p, arg.u, base);
+    case FormatArg::kDouble:
+      // The buffer has the space of the terminator, see VFormat()
+      return p + snprintf(p, kMaxDoubleSize + 1, "%g", arg.d);
+    case FormatArg::kString:
+      memcpy(p, arg.str.data, arg.str.size);
+      return p + arg.str.size;
+    case FormatArg::kPointer:
+      memcpy(p, "0x", 2);
+      return WriteUint(p + 2, reinterpret_cast<uintptr_t>(arg.p), 16);
+  }
+  return p;
+}
+
+} // namespace
+
+std::string kerror::detail::VFormat(char const *fmt, size_t fmt_size,
+                                    FormatArg const *args, size_t n)
+{
+  // The placeholder is replaced by its argument or kept, and the escaped
+  // brace is shorter, so the size is bounded without parsing the format
+  size_t size = fmt_size;
+  for (size_t i = 0; i < n; ++i) {
+    size += FormattedSize(args[i]);
+  }
+
+  // +1 for the terminator written by snprintf()
+  std::string result(size + 1, '\0');
+  auto p = &result[0];
+  size_t index = 0;
+  for (auto cur = fmt, end = fmt + fmt_size; cur != end; ++cur) {
+    if (cur[0] == '{') {
+      char spec = 0;
+      size_t len = 0;
+      if (cur[1] == '}') {
+        len = 2;
+      } else if (cur[1] == ':' && cur[2] && cur[3] == '}') {
+        spec = cur[2];
+        len = 4;
+      }
+
+      if (len != 0) {
+        if (index < n) {
+          p = WriteArg(p, args[index], spec);
+        } else {
+          memcpy(p, cur, len);
+          p += len;
+        }
+        ++index;
+        cur += len - 1;
+        continue;
+      }
+    }
+    if ((cur[0] == '{' && cur[1] == '{') || (cur[0] == '}' && cur[1] == '}'))
+      ++cur;
+    *p++ = *cur;
+  }
+  result.resize(static_cast<size_t>(p - result.data()));
+  return result;
+}
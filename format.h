@@ -0,0 +1,414 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Type-safe formatting for error messages.
+//
+// The format string uses "{}" as placeholder, "{{" and "}}" are escaped
+// braces. A placeholder can specify the type of its argument:
+//   {:d} integer   {:x} integer in hex   {:s} string
+//   {:g} floating  {:c} char             {:p} pointer
+// The arguments are erased to FormatArg in the caller, then formatted by
+// one out-of-line function in a single pass, the result is never truncated.
+//
+// The KERROR_FORMAT*() macros check the placeholders against the number and
+// the types of the arguments in compile time(the format string must be a
+// string literal):
+//   auto err = KERROR_FORMAT_ERROR("Failed to read {:d} bytes of {}", n, path);
+
+#ifndef _KERROR_FORMAT_H__
+#define _KERROR_FORMAT_H__
+
+#include <cerrno>
+#include <cstring>
+
+#include "kerror.h"
+
+namespace kerror {
+namespace detail {
+
+/**
+ * Type erased argument
+ */
+struct FormatArg {
+  enum Kind : unsigned char {
+    kBool,
+    kChar,
+    kInt,
+    kUint,
+    kDouble,
+    kString,
+    kPointer,
+  };
+
+  Kind kind;
+  union {
+    bool b;
+    char c;
+    long long i;
+    unsigned long long u;
+    double d;
+    void const *p;
+    struct {
+      char const *data;
+      size_t size;
+    } str;
+  };
+};
+
+/**
+ * The kind is a part of the type, so the kinds of the arguments are known
+ * in compile time
+ */
+template <FormatArg::Kind K>
+struct FormatArgOf : FormatArg {
+  static constexpr Kind kKind = K;
+
+  FormatArgOf() noexcept { kind = K; }
+};
+
+KERROR_INLINE FormatArgOf<FormatArg::kBool> MakeFormatArg(bool v) noexcept
+{
+  FormatArgOf<FormatArg::kBool> arg;
+  arg.b = v;
+  return arg;
+}
+
+KERROR_INLINE FormatArgOf<FormatArg::kChar> MakeFormatArg(char v) noexcept
+{
+  FormatArgOf<FormatArg::kChar> arg;
+  arg.c = v;
+  return arg;
+}
+
+template <typename T>
+struct IsFormatInt
+  : std::integral_constant<bool, std::is_integral<T>::value &&
+                                     !std::is_same<T, bool>::value &&
+                                     !std::is_same<T, char>::value> {};
+
+template <typename T>
+KERROR_INLINE typename std::enable_if<IsFormatInt<T>::value &&
+                                          std::is_signed<T>::value,
+                                      FormatArgOf<FormatArg::kInt>>::type
+MakeFormatArg(T v) noexcept
+{
+  FormatArgOf<FormatArg::kInt> arg;
+  arg.i = v;
+  return arg;
+}
+
+template <typename T>
+KERROR_INLINE typename std::enable_if<IsFormatInt<T>::value &&
+                                          std::is_unsigned<T>::value,
+                                      FormatArgOf<FormatArg::kUint>>::type
+MakeFormatArg(T v) noexcept
+{
+  FormatArgOf<FormatArg::kUint> arg;
+  arg.u = v;
+  return arg;
+}
+
+template <typename T, typename U = typename std::underlying_type<T>::type>
+KERROR_INLINE auto MakeFormatArg(T v) noexcept -> typename std::enable_if<
+    std::is_enum<T>::value, decltype(MakeFormatArg(static_cast<U>(v)))>::type
+{
+  return MakeFormatArg(static_cast<U>(v));
+}
+
+template <typename T>
+KERROR_INLINE typename std::enable_if<std::is_floating_point<T>::value,
+                                      FormatArgOf<FormatArg::kDouble>>::type
+MakeFormatArg(T v) noexcept
+{
+  FormatArgOf<FormatArg::kDouble> arg;
+  arg.d = static_cast<double>(v);
+  return arg;
+}
+
+KERROR_INLINE FormatArgOf<FormatArg::kString>
+MakeFormatArg(StringSlice v) noexcept
+{
+  FormatArgOf<FormatArg::kString> arg;
+  arg.str.data = v.data();
+  arg.str.size = v.size();
+  return arg;
+}
+
+KERROR_INLINE FormatArgOf<FormatArg::kString>
+MakeFormatArg(char const *v) noexcept
+{
+  return MakeFormatArg(v ? StringSlice(v) : StringSlice("(null)"));
+}
+
+KERROR_INLINE FormatArgOf<FormatArg::kString> MakeFormatArg(char *v) noexcept
+{
+  return MakeFormatArg(static_cast<char const *>(v));
+}
+
+KERROR_INLINE FormatArgOf<FormatArg::kString>
+MakeFormatArg(std::string const &v) noexcept
+{
+  return MakeFormatArg(StringSlice(v));
+}
+
+template <typename T>
+KERROR_INLINE FormatArgOf<FormatArg::kPointer> MakeFormatArg(T *v) noexcept
+{
+  FormatArgOf<FormatArg::kPointer> arg;
+  arg.p = v;
+  return arg;
+}
+
+KERROR_INLINE FormatArgOf<FormatArg::kPointer>
+MakeFormatArg(std::nullptr_t) noexcept
+{
+  return MakeFormatArg(static_cast<void const *>(nullptr));
+}
+
+enum FormatCheckResult {
+  kFormatOk,
+  kFormatUnmatchedBrace,
+  kFormatUnknownSpec,
+  kFormatTooFewArgs,
+  kFormatTooManyArgs,
+  kFormatTypeMismatch,
+};
+
+// The kinds of the arguments are packed into an integer in compile time,
+// 3 bits per argument
+constexpr int kMaxCheckedFormatArgs = 21;
+
+template <FormatArg::Kind... Kinds>
+struct FormatKinds;
+
+template <>
+struct FormatKinds<> : std::integral_constant<unsigned long long, 0> {};
+
+template <FormatArg::Kind K, FormatArg::Kind... Kinds>
+struct FormatKinds<K, Kinds...>
+  : std::integral_constant<unsigned long long,
+                           static_cast<unsigned long long>(K) |
+                               FormatKinds<Kinds...>::value << 3> {
+  static_assert(sizeof...(Kinds) < kMaxCheckedFormatArgs,
+                "Too many arguments to check");
+};
+
+/**
+ * Only used in unevaluated context to count the arguments
+ */
+template <typename... Args>
+char (&CountFormatArgs(char const *fmt, Args const &...args))[sizeof...(Args) +
+                                                             1];
+
+/**
+ * Only used in unevaluated context to get the kinds of the arguments
+ */
+template <typename... Args>
+FormatKinds<decltype(MakeFormatArg(std::declval<Args const &>()))::kKind...>
+GetFormatKinds(char const *fmt, Args const &...args);
+
+constexpr bool IsFormatSpec(char spec) noexcept
+{
+  return spec == 'd' || spec == 'x' || spec == 's' || spec == 'g' ||
+         spec == 'c' || spec == 'p';
+}
+
+/**
+ * \return
+ *   true if the argument of \p kind can be formatted by \p spec
+ */
+constexpr bool MatchFormatSpec(char spec, unsigned kind) noexcept
+{
+  return spec == 'd' || spec == 'x'
+             ? kind == FormatArg::kInt || kind == FormatArg::kUint
+         : spec == 's' ? kind == FormatArg::kString
+         : spec == 'g' ? kind == FormatArg::kDouble
+         : spec == 'c' ? kind == FormatArg::kChar
+                       : kind == FormatArg::kPointer;
+}
+
+constexpr unsigned GetFormatKind(unsigned long long kinds, int i) noexcept
+{
+  return static_cast<unsigned>(kinds >> (3 * i) & 7);
+}
+
+/**
+ * Check the placeholder of \p spec(0 if no spec) against the \p i th
+ * argument
+ */
+constexpr int CheckPlaceholder(char spec, unsigned long long kinds, int n,
+                               int i) noexcept
+{
+  return i >= n ? kFormatTooFewArgs
+         : spec && !MatchFormatSpec(spec, GetFormatKind(kinds, i))
+             ? kFormatTypeMismatch
+             : kFormatOk;
+}
+
+/**
+ * Check \p fmt against the \p n arguments whose kinds are \p kinds
+ *
+ * \return
+ *   FormatCheckResult
+ */
+#if __cplusplus >= 201402L
+constexpr int CheckFormat(char const *fmt, unsigned long long kinds,
+                          int n) noexcept
+{
+  int i = 0;
+  while (*fmt) {
+    if (*fmt == '{') {
+      if (fmt[1] == '{') {
+        fmt += 2;
+        continue;
+      }
+
+      char spec = 0;
+      if (fmt[1] == ':' && fmt[2] && fmt[3] == '}') {
+        spec = fmt[2];
+        if (!IsFormatSpec(spec)) return kFormatUnknownSpec;
+        fmt += 4;
+      } else if (fmt[1] == '}') {
+        fmt += 2;
+      } else {
+        return kFormatUnmatchedBrace;
+      }
+      auto const result = CheckPlaceholder(spec, kinds, n, i++);
+      if (result != kFormatOk) return result;
+    } else if (*fmt == '}') {
+      if (fmt[1] != '}') return kFormatUnmatchedBrace;
+      fmt += 2;
+    } else {
+      ++fmt;
+    }
+  }
+  return i < n ? kFormatTooManyArgs : kFormatOk;
+}
+#else
+// C++11 constexpr function must be a return statement.
+// The recursion depth is limited by the compiler (512 by default in gcc).
+constexpr int CheckFormat(char const *fmt, unsigned long long kinds, int n,
+                          int i = 0) noexcept;
+
+constexpr int CheckNextPlaceholder(char const *next, char spec,
+                                   unsigned long long kinds, int n,
+                                   int i) noexcept
+{
+  return CheckPlaceholder(spec, kinds, n, i) != kFormatOk
+             ? CheckPlaceholder(spec, kinds, n, i)
+             : CheckFormat(next, kinds, n, i + 1);
+}
+
+constexpr int CheckFormat(char const *fmt, unsigned long long kinds, int n,
+                          int i) noexcept
+{
+  return *fmt == 0 ? (i < n ? kFormatTooManyArgs : kFormatOk)
+         : *fmt == '{'
+             ? (fmt[1] == '{' ? CheckFormat(fmt + 2, kinds, n, i)
+                : fmt[1] == '}'
+                    ? CheckNextPlaceholder(fmt + 2, 0, kinds, n, i)
+                : fmt[1] == ':' && fmt[2] && fmt[3] == '}'
+                    ? (IsFormatSpec(fmt[2])
+                           ? CheckNextPlaceholder(fmt + 4, fmt[2], kinds, n, i)
+                           : kFormatUnknownSpec)
+                    : kFormatUnmatchedBrace)
+         : *fmt == '}' ? (fmt[1] == '}' ? CheckFormat(fmt + 2, kinds, n, i)
+                                        : kFormatUnmatchedBrace)
+                       : CheckFormat(fmt + 1, kinds, n, i);
+}
+#endif
+
+template <int Result>
+struct FormatCheck {
+  static_assert(Result != kFormatUnmatchedBrace,
+                "Unmatched brace in the format string");
+  static_assert(Result != kFormatUnknownSpec,
+                "Unknown format spec, expect one of d, x, s, g, c and p");
+  static_assert(Result != kFormatTooFewArgs,
+                "More placeholders than the arguments");
+  static_assert(Result != kFormatTooManyArgs,
+                "More arguments than the placeholders");
+  static_assert(Result != kFormatTypeMismatch,
+                "The argument doesn't match the spec of its placeholder");
+};
+
+/**
+ * Format \p fmt of \p fmt_size bytes with \p args in a single pass
+ * Missing arguments are printed as the placeholders, redundant arguments
+ * are ignored, and the spec not matching its argument is ignored.
+ */
+std::string VFormat(char const *fmt, size_t fmt_size, FormatArg const *args,
+                    size_t n);
+
+} // namespace detail
+
+/**
+ * \brief Format \p fmt with the "{}" placeholders
+ *
+ * The arguments are formatted by type, the supported types are:
+ * bool, char, integer, enum, floating point, string(char const*,
+ * std::string, StringSlice) and pointer.
+ * Use the KERROR_FORMAT*() macros to check them in compile time.
+ */
+template <typename... Args>
+std::string Format(char const *fmt, Args const &...args)
+{
+  // Don't declare zero-size array
+  detail::FormatArg const list[] = {detail::MakeFormatArg(args)...,
+                                    detail::MakeFormatArg(false)};
+  // Folded for the string literal
+  return detail::VFormat(fmt, strlen(fmt), list, sizeof...(Args));
+}
+
+template <typename... Args>
+Error MakeFormatError(char const *fmt, Args const &...args)
+{
+  return MakeMsgError(Format(fmt, args...));
+}
+
+template <typename... Args>
+[[noreturn]] void PanicFormat(char const *fmt, Args const &...args) noexcept
+{
+  Panic(Format(fmt, args...).c_str());
+}
+
+template <typename... Args>
+void PSysErrorFormat(char const *fmt, Args const &...args) noexcept
+{
+  auto saved_errno = errno;
+  auto msg = Format(fmt, args...);
+  errno = saved_errno;
+  PSysError(msg.c_str());
+}
+
+} // namespace kerror
+
+/**
+ * The FormatCheckResult of the format string literal and the arguments
+ */
+#define KERROR_FORMAT_CHECK_RESULT(...)                                        \
+  ::kerror::detail::CheckFormat(                                               \
+      KERROR_FIRST(__VA_ARGS__),                                               \
+      decltype(::kerror::detail::GetFormatKinds(__VA_ARGS__))::value,          \
+      static_cast<int>(                                                        \
+          sizeof(::kerror::detail::CountFormatArgs(__VA_ARGS__)) - 1))
+
+/**
+ * Check the format string literal against the arguments in compile time
+ */
+#define KERROR_FORMAT_CHECK(...)                                               \
+  static_cast<void>(                                                           \
+      ::kerror::detail::FormatCheck<KERROR_FORMAT_CHECK_RESULT(__VA_ARGS__)>{})
+
+#define KERROR_FORMAT(...)                                                     \
+  (KERROR_FORMAT_CHECK(__VA_ARGS__), ::kerror::Format(__VA_ARGS__))
+
+#define KERROR_FORMAT_ERROR(...)                                               \
+  (KERROR_FORMAT_CHECK(__VA_ARGS__), ::kerror::MakeFormatError(__VA_ARGS__))
+
+#define KERROR_PANIC(...)                                                      \
+  (KERROR_FORMAT_CHECK(__VA_ARGS__), ::kerror::PanicFormat(__VA_ARGS__))
+
+#define KERROR_PSYS_ERROR(...)                                                 \
+  (KERROR_FORMAT_CHECK(__VA_ARGS__), ::kerror::PSysErrorFormat(__VA_ARGS__))
+
+#endif
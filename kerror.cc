@@ -3,8 +3,248 @@
 
 #include <cstring>
 
+#include <time.h>
+#include <unistd.h>
+
 using namespace kerror;
 
+SystemErrorCategory const kerror::detail::g_system_category;
+
+std::atomic<ErrorCategory const *>
+    kerror::detail::g_error_categories[kMaxErrorCategories] = {
+        {nullptr},
+        {&g_system_category},
+};
+
+kerror::ErrorCategory::ErrorCategory() noexcept
+  : id_(0)
+{
+  // 0 is invalid and 1 is reserved for SystemCategory()
+  for (uint16_t id = 2; id < detail::kMaxErrorCategories; ++id) {
+    ErrorCategory const *expected = nullptr;
+    if (detail::g_error_categories[id].compare_exchange_strong(
+            expected, this, std::memory_order_acq_rel))
+    {
+      id_ = id;
+      break;
+    }
+  }
+}
+
+kerror::ErrorCategory::~ErrorCategory()
+{
+  if (id_ > SystemErrorCategory::kId) {
+    detail::g_error_categories[id_].store(nullptr, std::memory_order_release);
+  }
+}
+
+auto kerror::detail::FindErrorCategory(StringSlice name) noexcept
+    -> ErrorCategory const *
+{
+  for (uint16_t id = 1; id < kMaxErrorCategories; ++id) {
+    auto category = GetErrorCategory(id);
+    if (!category) continue;
+    auto const category_name = StringSlice(category->GetName());
+    if (category_name.size() == name.size() &&
+        memcmp(category_name.data(), name.data(), name.size()) == 0)
+    {
+      return category;
+    }
+  }
+  return nullptr;
+}
+
+auto kerror::SystemErrorCategory::GetMessage(int code) const -> std::string
+{
+  char error_buf[256];
+  error_buf[0] = 0;
+  return strerror_r(code, error_buf, sizeof error_buf);
+}
+
+void kerror::SystemErrorCategory::WriteMessage(int code,
+                                               MessageSink &sink) const
+{
+  char error_buf[256];
+  error_buf[0] = 0;
+  auto const msg = strerror_r(code, error_buf, sizeof error_buf);
+  sink.Write(msg, strlen(msg));
+}
+
+bool kerror::Error::MaterializeCode() const noexcept
+{
+#if KERROR_PACK_ERROR_CODE
+  auto const category = GetErrorCategory(
+      static_cast<uint16_t>((bits_ >> kCategoryShift) & kCategoryMask));
+  auto const code =
+      static_cast<int>(static_cast<uint32_t>(bits_ >> kCodeShift));
+  assert(category);
+
+  if (detail::CanStoreInline<CodeErrorInfo>::value) {
+    new (inline_info())
+        detail::InlineErrorInfo<CodeErrorInfo>(*category, code);
+    bits_ |= kMaterializedBit;
+  } else {
+    // This is called by info() which is noexcept, e.g. when printing
+    auto info = new (std::nothrow) CodeErrorInfo(*category, code);
+    if (!info) return false;
+    bits_ = reinterpret_cast<Bits>(info) | kErrorBit | (bits_ & kCheckedBit);
+  }
+#endif
+  return true;
+}
+
+void kerror::IErrorInfo::ReleaseContext() noexcept
+{
+  auto context = context_;
+  context_ = nullptr;
+  // Iterate instead of recursion, the chain may be long
+  while (context) {
+    auto next = context->context_;
+    context->context_ = nullptr;
+    context->Destroy();
+    context = next;
+  }
+}
+
+namespace {
+
+/**
+ * Insert ": " between the non-empty pieces
+ */
+class SeparatedSink final : public kerror::MessageSink {
+ public:
+  explicit SeparatedSink(MessageSink &sink) noexcept
+    : sink_(sink)
+  {
+  }
+
+  void Write(char const *data, size_t n) override
+  {
+    if (n == 0) return;
+    if (pending_) {
+      sink_.Write(": ", 2);
+      pending_ = false;
+    }
+    written_ = true;
+    sink_.Write(data, n);
+  }
+
+  void Separate() noexcept { pending_ = written_; }
+
+ private:
+  MessageSink &sink_;
+  bool written_ = false;
+  bool pending_ = false;
+};
+
+} // namespace
+
+void kerror::IErrorInfo::WriteFullMessage(MessageSink &sink) const
+{
+  SeparatedSink separated(sink);
+  for (auto context = context_; context; context = context->context_) {
+    context->WriteMessage(separated);
+    separated.Separate();
+  }
+  WriteMessage(separated);
+}
+
+bool kerror::Error::TryCopy(Error *copy) const
+{
+  Error result;
+  if (!result.CopyFrom(*this)) return false;
+  *copy = std::move(result);
+  return true;
+}
+
+bool kerror::Error::CopyFrom(Error const &other)
+{
+  if (!other.has_payload()) {
+    bits_ = other.bits_ & ~kCheckedBit;
+    return true;
+  }
+
+  // The CodeErrorInfo is created by info() of the copy again if needed
+  if (other.is_packed_code()) {
+    bits_ = other.bits_ & ~(kCheckedBit | kMaterializedBit);
+    return true;
+  }
+
+  auto info = other.is_inline() ? other.inline_info() : other.pointer();
+  if (auto shared = info->Share()) {
+    bits_ = reinterpret_cast<Bits>(shared) | kErrorBit;
+    return true;
+  }
+
+  // The contexts are dropped, the cause is a no info error or shared
+  if (auto context = DynCast<ContextErrorInfo>(info)) {
+    return CopyFrom(context->cause());
+  }
+
+  if (auto code_info = DynCast<CodeErrorInfo>(info)) {
+    *this = Error(code_info->category(), code_info->code());
+    return true;
+  }
+
+  return false;
+}
+
+void kerror::Error::AttachContext(IErrorInfo *context)
+{
+  auto info = unchecked_info();
+  if (!info || (IsA<SharedErrorInfo>(info) && !IsA<ContextErrorInfo>(info))) {
+    auto const checked = bits_ & kCheckedBit;
+    try {
+      info = new ContextErrorInfo(std::move(*this));
+    }
+    catch (...) {
+      context->Destroy();
+      throw;
+    }
+    bits_ = reinterpret_cast<Bits>(info) | kErrorBit | checked;
+  }
+
+  context->context_ = info->context_;
+  info->context_ = context;
+}
+
+auto kerror::Error::AddContext(StringSlice context) -> Error &
+{
+  if (is_error()) AttachContext(detail::NewInfo<SliceMsgErrorInfo>(context));
+  return *this;
+}
+
+auto kerror::Error::AddContext(ErrorAllocator *alloc, StringSlice context)
+    -> Error &
+{
+  if (is_error()) AttachContext(detail::NewMsgInfoFrom(alloc, context));
+  return *this;
+}
+
+#if KERROR_HAS_PMR
+auto kerror::Error::AddContext(std::pmr::memory_resource *resource,
+                               StringSlice context) -> Error &
+{
+  if (is_error()) AttachContext(detail::NewMsgInfoFrom(resource, context));
+  return *this;
+}
+#endif
+
+auto kerror::MakeSharedMsgError(std::string msg) -> Error
+{
+  return MakeError<SharedMsgErrorInfo>(std::move(msg));
+}
+
+auto kerror::MakeMsgError(char const *msg) -> Error
+{
+  return MakeError<MsgErrorInfo>(msg);
+}
+
+auto kerror::MakeMsgError(std::string msg) -> Error
+{
+  return MakeError<MsgErrorInfo>(std::move(msg));
+}
+
 auto kerror::MakeMsgErrorf(char const *fmt, ...) -> Error
 {
   char buf[4096];
@@ -17,58 +257,312 @@ auto kerror::MakeMsgErrorf(char const *fmt, ...) -> Error
   return MakeMsgError(std::string(buf));
 }
 
+namespace {
+
+class StderrReportSink final : public kerror::ReportSink {
+ public:
+  void Write(char const *data, size_t n) noexcept override
+  {
+    auto const saved_errno = errno;
+    while (n > 0) {
+      auto const written = ::write(STDERR_FILENO, data, n);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      data += written;
+      n -= static_cast<size_t>(written);
+    }
+    errno = saved_errno;
+  }
+};
+
+StderrReportSink g_stderr_sink;
+// nullptr is g_stderr_sink, then it is constant initialized
+std::atomic<kerror::ReportSink *> g_report_sink{nullptr};
+
+char g_report_buffer[4096];
+std::atomic_flag g_report_buffer_busy = ATOMIC_FLAG_INIT;
+
+/**
+ * Report formatted in the static buffer and written to the report sink when
+ * it is destroyed. If the static buffer is busy(used by another thread or the
+ * interrupted code in signal handler), the local buffer is used instead of
+ * waiting for it.
+ *
+ * The report longer than the buffer is written in chunks, i.e. it is not
+ * written by a single write(2) and may be interleaved with other reports.
+ */
+class Report final : public kerror::MessageSink {
+ public:
+  Report() noexcept
+    : owner_(!g_report_buffer_busy.test_and_set(std::memory_order_acquire))
+    , buf_(owner_ ? g_report_buffer : local_buffer_)
+    , cap_(owner_ ? sizeof g_report_buffer : sizeof local_buffer_)
+    , size_(0)
+  {
+  }
+
+  ~Report() noexcept
+  {
+    Flush();
+    if (owner_) g_report_buffer_busy.clear(std::memory_order_release);
+  }
+
+  Report(Report const &) = delete;
+  Report &operator=(Report const &) = delete;
+
+  void Write(char const *data, size_t n) noexcept override
+  {
+    while (n > cap_ - size_) {
+      auto const len = cap_ - size_;
+      memcpy(buf_ + size_, data, len);
+      size_ = cap_;
+      Flush();
+      data += len;
+      n -= len;
+    }
+    memcpy(buf_ + size_, data, n);
+    size_ += n;
+  }
+
+  void Append(char const *str) noexcept { Write(str, strlen(str)); }
+
+  void Append(int n) noexcept
+  {
+    // Don't negate n, INT_MIN can't be negated
+    auto u = n < 0 ? 0u - static_cast<unsigned>(n) : static_cast<unsigned>(n);
+    if (n < 0) Append("-");
+    Append(static_cast<uint64_t>(u));
+  }
+
+  void Append(uint64_t u) noexcept
+  {
+    char digits[24];
+    auto p = digits + sizeof digits;
+    do {
+      *--p = static_cast<char>('0' + u % 10);
+      u /= 10;
+    } while (u);
+    Write(p, static_cast<size_t>(digits + sizeof digits - p));
+  }
+
+  void VAppendf(char const *fmt, va_list args) noexcept
+  {
+    va_list retry;
+    va_copy(retry, args);
+    auto n = vsnprintf(buf_ + size_, cap_ - size_, fmt, args);
+    if (n >= 0 && static_cast<size_t>(n) >= cap_ - size_ && size_ > 0) {
+      // Format again in the whole buffer
+      Flush();
+      n = vsnprintf(buf_, cap_, fmt, retry);
+    }
+    va_end(retry);
+    if (n < 0) return;
+
+    if (static_cast<size_t>(n) < cap_ - size_) {
+      size_ += static_cast<size_t>(n);
+      return;
+    }
+    // vsnprintf() can't be resumed, the null is replaced
+    size_ = cap_ - 1;
+    Append("...(truncated)");
+  }
+
+ private:
+  void Flush() noexcept
+  {
+    if (size_ > 0) kerror::GetReportSink().Write(buf_, size_);
+    size_ = 0;
+  }
+
+  bool owner_;
+  char local_buffer_[512];
+  char *buf_;
+  size_t cap_;
+  size_t size_;
+};
+
+} // namespace
+
+auto kerror::StderrSink() noexcept -> ReportSink &
+{
+  return g_stderr_sink;
+}
+
+auto kerror::SetReportSink(ReportSink *sink) noexcept -> ReportSink *
+{
+  auto old = g_report_sink.exchange(sink, std::memory_order_acq_rel);
+  return old ? old : &g_stderr_sink;
+}
+
+auto kerror::GetReportSink() noexcept -> ReportSink &
+{
+  auto sink = g_report_sink.load(std::memory_order_acquire);
+  return sink ? *sink : g_stderr_sink;
+}
+
+void kerror::Error::WriteMessage(MessageSink &sink) const
+{
+  bits_ |= kCheckedBit;
+  if (is_packed_code() && !(bits_ & kMaterializedBit)) {
+    if (auto category = this->category()) {
+      category->WriteMessage(code(), sink);
+    }
+    return;
+  }
+  if (auto info = unchecked_info()) info->WriteFullMessage(sink);
+}
+
 auto kerror::Panic(char const *msg) noexcept -> void
 {
-  fputs(msg, stderr);
-  fflush(stderr);
+  {
+    Report report;
+    report.Append(msg);
+  }
+  GetReportSink().Flush();
   abort();
 }
 
 auto kerror::Panicf(char const *fmt, ...) noexcept -> void
 {
-  va_list args;
-  va_start(args, fmt);
-  fprintf(stderr, fmt, args);
-  va_end(args);
-
-  fflush(stderr);
+  {
+    Report report;
+    va_list args;
+    va_start(args, fmt);
+    report.VAppendf(fmt, args);
+    va_end(args);
+  }
+  GetReportSink().Flush();
   abort();
 }
 
 void kerror::PError(char const *prefix, Error const &err) noexcept
 {
-  fprintf(stderr, "%s%s\n", prefix, err.info()->GetMessage().c_str());
+  Report report;
+  report.Append(prefix);
+  err.WriteMessage(report);
+  report.Append("\n");
+}
+
+constexpr uint64_t kerror::ReportLimiter::kNanosPerSecond;
+constexpr size_t kerror::SiteReportLimiter::kMaxKinds;
+
+auto kerror::ReportLimiter::NowNanos() noexcept -> uint64_t
+{
+  timespec ts;
+  // The coarse clock is read from vDSO without syscall, its resolution(a
+  // tick) is enough for rate limiting
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return static_cast<uint64_t>(ts.tv_sec) * kNanosPerSecond +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+auto kerror::GetErrorKind(Error const &err) noexcept -> uintptr_t
+{
+  if (auto category = err.category()) {
+    auto const kind =
+        reinterpret_cast<uintptr_t>(category) ^
+        (static_cast<uintptr_t>(static_cast<unsigned>(err.code())) *
+         0x9E3779B9u);
+    return kind ? kind : 1;
+  }
+  auto info = err.info();
+  return reinterpret_cast<uintptr_t>(info ? info->GetClassId()
+                                          : IErrorInfo::ClassId());
+}
+
+namespace {
+
+void PErrorSummarized(char const *prefix, Error const &err,
+                      uint64_t suppressed) noexcept
+{
+  Report report;
+  report.Append(prefix);
+  err.WriteMessage(report);
+  report.Append("\n");
+  if (suppressed > 0) {
+    report.Append("(Suppressed ");
+    report.Append(suppressed);
+    report.Append(" similar reports)\n");
+  }
+}
+
+} // namespace
+
+void kerror::PError(ReportLimiter &limiter, char const *prefix,
+                    Error const &err) noexcept
+{
+  if (!limiter.Acquire()) {
+    err.IgnoreCheck();
+    return;
+  }
+  PErrorSummarized(prefix, err, limiter.TakeSuppressed());
+}
+
+void kerror::PError(SiteReportLimiter &limiter, char const *prefix,
+                    Error const &err) noexcept
+{
+  auto const kind = GetErrorKind(err);
+  if (!limiter.Acquire(kind)) {
+    err.IgnoreCheck();
+    return;
+  }
+  PErrorSummarized(prefix, err, limiter.TakeSuppressed(kind));
 }
 
 void kerror::PErrorSys(char const *prefix, char const *sys_prefix,
                        Error const &err) noexcept
 {
   auto saved_errno = errno;
-  PError(prefix, err);
+  // The errno captured by MakeSysError() is more accurate
+  if (err.category() == &SystemCategory()) {
+    saved_errno = err.code();
+  }
 
-  char error_buf[4096];
-  error_buf[0] = 0;
-  const auto error_msg = strerror_r(saved_errno, error_buf, sizeof error_buf);
-  fprintf(stderr, "%s: %s(%d)\n", sys_prefix, error_msg, saved_errno);
+  {
+    Report report;
+    report.Append(prefix);
+    err.WriteMessage(report);
+    report.Append("\n");
+    report.Append(sys_prefix);
+    report.Append(": ");
+    SystemCategory().WriteMessage(saved_errno, report);
+    report.Append("(");
+    report.Append(saved_errno);
+    report.Append(")\n");
+  }
   errno = 0;
 }
 
 void kerror::PSysError(char const *msg) noexcept
 {
-  auto saved_errno = errno;
-  char error_buf[4096];
-  error_buf[0] = 0;
-  const auto error_msg = strerror_r(saved_errno, error_buf, sizeof error_buf);
-  fprintf(stderr, "%s\nSysError: %s(%d)\n", msg, error_msg, saved_errno);
+  auto const saved_errno = errno;
+  Report report;
+  report.Append(msg);
+  report.Append("\nSysError: ");
+  SystemCategory().WriteMessage(saved_errno, report);
+  report.Append("(");
+  report.Append(saved_errno);
+  report.Append(")\n");
 }
 
 void kerror::PSysErrorf(char const *fmt, ...) noexcept
 {
-  char buf[4096];
+  auto const saved_errno = errno;
+  Report report;
   va_list args;
   va_start(args, fmt);
-  vsnprintf(buf, sizeof buf, fmt, args);
+  report.VAppendf(fmt, args);
   va_end(args);
 
-  PSysError(buf);
+  report.Append("\nSysError: ");
+  SystemCategory().WriteMessage(saved_errno, report);
+  report.Append("(");
+  report.Append(saved_errno);
+  report.Append(")\n");
 }
@@ -7,24 +7,55 @@
 #ifndef _KERROR_H__
 #define _KERROR_H__
 
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <new>
 #include <string>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 
 #include "macro.h"
 
+#if KERROR_HAS_PMR
+#  include <memory_resource>
+#endif
+
 namespace kerror {
 
+namespace detail {
+
+/**
+ * strlen() can't be used in constant expression,
+ * the builtin is folded for string literal and calls strlen() otherwise.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+constexpr size_t Strlen(char const *str) noexcept
+{
+  return __builtin_strlen(str);
+}
+#else
+constexpr size_t Strlen(char const *str) noexcept
+{
+  return *str ? 1 + Strlen(str + 1) : 0;
+}
+#endif
+
+} // namespace detail
+
 struct StringSlice {
  public:
-  StringSlice(char const *data) noexcept
+  constexpr StringSlice(char const *data) noexcept
     : data_(data)
-    , len_(strlen(data))
+    , len_(detail::Strlen(data))
   {
   }
 
@@ -34,324 +65,2638 @@ struct StringSlice {
   {
   }
 
-  StringSlice(char const *data, size_t n) noexcept
+  constexpr StringSlice(char const *data, size_t n) noexcept
     : data_(data)
     , len_(n)
   {
   }
 
-  char const *data() const noexcept { return data_; }
-  size_t size() const noexcept { return len_; }
+  constexpr char const *data() const noexcept { return data_; }
+  constexpr size_t size() const noexcept { return len_; }
 
  private:
   char const *data_;
   size_t len_;
 };
 
-class IErrorInfo {
+/**
+ * Destination of error message, the message may be written in pieces.
+ * e.g. Fixed buffer, std::string, file.
+ */
+class MessageSink {
  public:
-  IErrorInfo() = default;
-  virtual ~IErrorInfo() = default;
+  MessageSink() = default;
+  virtual ~MessageSink() = default;
 
-  virtual std::string GetMessage() const { return {}; }
+  virtual void Write(char const *data, size_t n) = 0;
 };
 
-enum class IsErrorFlag {
-  OFF = 0,
-  ON = 1,
+/**
+ * Write the message to a caller-provided buffer without allocation.
+ * The message is truncated if the buffer is too small, but always
+ * terminated by null(unless the size of buffer is 0).
+ */
+class BufferSink final : public MessageSink {
+ public:
+  BufferSink(char *buf, size_t n) noexcept
+    : buf_(buf)
+    , cap_(n)
+    , size_(0)
+  {
+    if (n) buf[0] = 0;
+  }
+
+  void Write(char const *data, size_t n) noexcept override
+  {
+    if (size_ + 1 < cap_) {
+      auto const len = n < cap_ - 1 - size_ ? n : cap_ - 1 - size_;
+      memcpy(buf_ + size_, data, len);
+      buf_[size_ + len] = 0;
+    }
+    size_ += n;
+  }
+
+  /**
+   * \return
+   *   The length of the whole message, like snprintf(),
+   *   the message is truncated if it is not less than the buffer size
+   */
+  size_t size() const noexcept { return size_; }
+
+ private:
+  char *buf_;
+  size_t cap_;
+  size_t size_;
+};
+
+class StringSink final : public MessageSink {
+ public:
+  void Write(char const *data, size_t n) override { str_.append(data, n); }
+
+  std::string &str() noexcept { return str_; }
+
+ private:
+  std::string str_;
 };
 
+class Error;
+
+namespace detail {
+
+template <typename T>
+class InlineErrorInfo;
+
+} // namespace detail
+
 /**
- * Error with error code and information(i.e. typed errno)
+ * The low 3 bits of the info pointer are used by Error as tag,
+ * so the alignment must be 8 at least.
+ *
+ * The concrete info types should be derived from ErrorInfo<Derived, Base>,
+ * then they can be identified by IsA<T>() and DynCast<T>() without RTTI.
  */
-class Error {
+class alignas(8) IErrorInfo {
  public:
+  using ClassType = IErrorInfo;
+
+  IErrorInfo() noexcept = default;
+
+  virtual ~IErrorInfo() noexcept
+  {
+    if (KERROR_UNLIKELY(context_)) ReleaseContext();
+  }
+
   /**
-   * You should not call this function to create Error instead of calling
-   * MakeError().
-   *
-   * \Param error The error code you defined or libc provide
-   * \Param info Provide some information to debug or trace, etc.
+   * The context chain is owned by the info and never copied
    */
-  explicit Error(std::unique_ptr<IErrorInfo> info)
-    : info_(std::move(info))
-    , checked_(false)
-    , is_error_(true)
+  IErrorInfo(IErrorInfo const &) noexcept
+    : IErrorInfo()
+  {
+  }
+
+  IErrorInfo(IErrorInfo &&other) noexcept
+    : context_(other.context_)
   {
+    other.context_ = nullptr;
   }
 
+  IErrorInfo &operator=(IErrorInfo const &) noexcept { return *this; }
+
+  virtual std::string GetMessage() const { return {}; }
+
   /**
-   * Used for implementing MakeNoInfoError() and MakeSuccess()
-   *
-   * \param is_error
+   * Stream the message into \p sink.
+   * Override it to write the message without allocation, the default
+   * writes the result of GetMessage().
    */
-  Error(IsErrorFlag is_error = IsErrorFlag::OFF) noexcept
-    : info_(nullptr)
-    , checked_(false)
-    , is_error_(IsErrorFlag::ON == is_error)
+  virtual void WriteMessage(MessageSink &sink) const
   {
+    auto const msg = GetMessage();
+    sink.Write(msg.data(), msg.size());
   }
 
-  ~Error() noexcept { AbortIsChecked(); }
+  /**
+   * Like WriteMessage() but the contexts added by Error::AddContext() are
+   * written before the message, e.g.
+   * "while reading shard 3: open file: No such file"
+   */
+  void WriteFullMessage(MessageSink &sink) const;
 
   /**
-   * Make the other be checked to avoid abort
+   * \return
+   *   The length of the full message, see BufferSink
    */
-  Error(Error &&other) noexcept
-    : checked_(true) // Satisfy the move assign precondition
-    , is_error_(other.is_error_)
+  size_t WriteFullMessage(char *buf, size_t n) const
   {
-    // invariant: this != &other
-    *this = std::move(other);
+    BufferSink sink(buf, n);
+    WriteFullMessage(sink);
+    return sink.size();
   }
 
-  Error &operator=(Error &&other) noexcept
+  std::string GetFullMessage() const
   {
-    if (&other != this) {
-      // pre: The error has checked
-      AbortIsChecked();
-      checked_ = false;
-      is_error_ = other.is_error_;
-      info_ = std::move(other.info_);
-
-      // avoid abort
-      other.checked_ = true;
-    }
-    return *this;
+    StringSink sink;
+    WriteFullMessage(sink);
+    return std::move(sink.str());
   }
 
   /**
-   * \brief Ignore the error check(ie. Disable the forced error check)
+   * The address of a static variable per class is used as type id,
+   * so the comparison is a pointer comparison.
    */
-  void IgnoreCheck() noexcept { checked_ = true; }
+  static void const *ClassId() noexcept
+  {
+    static char id;
+    return &id;
+  }
 
-  operator bool() const noexcept
+  /**
+   * \return
+   *   The object of the class identified by \p class_id,
+   *   i.e. this if *this is an instance of the class(or the class derived
+   *   from it), or the info wrapped by this. nullptr otherwise.
+   */
+  virtual IErrorInfo const *CastTo(void const *class_id) const noexcept
   {
-    // If this is a success, user can don't extract the errno.
-    // otherwise, caller must call error_no() to check and handle error
-    // or call info() to get the information if caller don't handle it.
-    checked_ = (is_success());
-    return is_error();
+    return class_id == ClassId() ? this : nullptr;
   }
 
-  IErrorInfo *info() const noexcept
+  /**
+   * \return
+   *   The ClassId() of the most derived ErrorInfo<> class of this,
+   *   i.e. the dynamic type of the info
+   */
+  virtual void const *GetClassId() const noexcept { return ClassId(); }
+
+  bool IsA(void const *class_id) const noexcept
   {
-    checked_ = true;
-    return info_.get();
+    return CastTo(class_id) != nullptr;
   }
 
-  bool is_success() const noexcept { return !is_error_; }
-  bool is_error() const noexcept { return is_error_; }
+  /**
+   * \return
+   *   The newest context added by Error::AddContext(), the older ones are
+   *   linked by their context()
+   */
+  IErrorInfo const *context() const noexcept { return context_; }
 
  private:
-  void AbortIsChecked() noexcept
+  friend class Error;
+
+  template <typename T>
+  friend class detail::InlineErrorInfo;
+
+  /**
+   * Move the context chain to \p dst, no matter whether it is moved by the
+   * move constructor of the derived class(it may have no move constructor)
+   */
+  void MoveContextTo(IErrorInfo &dst) noexcept
   {
-    if (KERROR_UNLIKELY(!checked_ && is_error())) {
-      fprintf(stderr, "The error is don't checked by user");
-      fflush(stderr);
-      abort();
+    if (context_) {
+      dst.context_ = context_;
+      context_ = nullptr;
     }
   }
 
- protected:
-  std::unique_ptr<IErrorInfo> info_;
-  mutable bool checked_;
-  bool is_error_;
+  /**
+   * Release the info owned by an Error.
+   * The default matches the std::unique_ptr<IErrorInfo> constructor of Error.
+   */
+  virtual void Destroy() noexcept { delete this; }
+
+  /**
+   * Move *this into \p dst and destroy *this.
+   * Only called on infos stored in the inline buffer of Error.
+   */
+  virtual void RelocateTo(void *dst) noexcept
+  {
+    (void)dst;
+    assert(false && "The error info is not stored inline");
+  }
+
+  /**
+   * Share *this with the copy of Error.
+   *
+   * \return
+   *   The info owned by the copy, nullptr if the info can't be shared
+   */
+  virtual IErrorInfo *Share() const noexcept { return nullptr; }
+
+  void ReleaseContext() noexcept;
+
+  /**
+   * The newest context, the older one is linked by its context_.
+   * Each context is an info allocated in the heap or from an allocator.
+   */
+  IErrorInfo *context_ = nullptr;
 };
 
-template <typename T, typename... Args>
-Error MakeError(Args &&...args)
+/**
+ * CRTP base of error info that provides the type id of \p Derived.
+ * e.g.
+ * \code
+ *   class IoErrorInfo : public ErrorInfo<IoErrorInfo> { ... };
+ *   class EofErrorInfo : public ErrorInfo<EofErrorInfo, IoErrorInfo> { ... };
+ * \endcode
+ *
+ * \Param Base IErrorInfo or other class derived from ErrorInfo<>
+ */
+template <typename Derived, typename Base = IErrorInfo>
+class ErrorInfo : public Base {
+ public:
+  using ClassType = Derived;
+
+  using Base::Base;
+  ErrorInfo() = default;
+
+  static void const *ClassId() noexcept
+  {
+    static char id;
+    return &id;
+  }
+
+  IErrorInfo const *CastTo(void const *class_id) const noexcept override
+  {
+    return class_id == ClassId() ? this : Base::CastTo(class_id);
+  }
+
+  void const *GetClassId() const noexcept override { return ClassId(); }
+};
+
+/**
+ * \return
+ *   true if \p info is an instance of T(or derived from T)
+ */
+template <typename T>
+KERROR_INLINE bool IsA(IErrorInfo const *info) noexcept
 {
-  return Error(std::unique_ptr<T>(std::forward<Args>(args)...));
+  static_assert(std::is_same<typename T::ClassType, T>::value,
+                "T must be derived from ErrorInfo<T, Base>");
+  return info && info->IsA(T::ClassId());
 }
 
 /**
- * In some cases, no info error as indicator is useful,
- * such error can don't bring information.
+ * Like dynamic_cast<T*>(info) but RTTI is not required
  */
-KERROR_INLINE Error MakeNoInfoError() noexcept
+template <typename T>
+KERROR_INLINE T const *DynCast(IErrorInfo const *info) noexcept
 {
-  return Error(IsErrorFlag::ON);
+  static_assert(std::is_same<typename T::ClassType, T>::value,
+                "T must be derived from ErrorInfo<T, Base>");
+  return info ? static_cast<T const *>(info->CastTo(T::ClassId())) : nullptr;
 }
 
-KERROR_INLINE Error MakeSuccess() noexcept { return Error(IsErrorFlag::OFF); }
+template <typename T>
+KERROR_INLINE T *DynCast(IErrorInfo *info) noexcept
+{
+  return const_cast<T *>(DynCast<T>(static_cast<IErrorInfo const *>(info)));
+}
 
-class MsgErrorInfo : public IErrorInfo {
+/**
+ * Immutable error info shared by the copies of Error with an atomic
+ * reference count, i.e. copying the Error is a refcount increment.
+ * e.g.
+ * \code
+ *   class QueueFullErrorInfo
+ *     : public ErrorInfo<QueueFullErrorInfo, SharedErrorInfo> { ... };
+ * \endcode
+ *
+ * It is never stored in the inline buffer of Error, and can't be allocated
+ * from ErrorAllocator.
+ */
+class SharedErrorInfo : public ErrorInfo<SharedErrorInfo> {
  public:
-  MsgErrorInfo(char const *str)
-    : IErrorInfo()
-    , msg_(str, strlen(str))
+  SharedErrorInfo() noexcept
+    : refs_(1)
   {
   }
 
-  MsgErrorInfo(std::string str)
-    : IErrorInfo()
-    , msg_(std::move(str))
+  SharedErrorInfo(SharedErrorInfo const &) = delete;
+  SharedErrorInfo &operator=(SharedErrorInfo const &) = delete;
+
+ private:
+  friend class SharedError;
+
+  // The info owned by SharedError is not counted
+  static constexpr intptr_t kImmortal = -1;
+
+  IErrorInfo *Share() const noexcept final
   {
+    if (refs_.load(std::memory_order_relaxed) != kImmortal) {
+      refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return const_cast<SharedErrorInfo *>(this);
   }
 
-  MsgErrorInfo(MsgErrorInfo &&) = default;
-  MsgErrorInfo(MsgErrorInfo const &) = default;
+  void Destroy() noexcept final
+  {
+    if (refs_.load(std::memory_order_relaxed) == kImmortal) return;
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+  }
 
-  MsgErrorInfo &operator=(MsgErrorInfo &&) = default;
-  MsgErrorInfo &operator=(MsgErrorInfo const &) = default;
+  mutable std::atomic<intptr_t> refs_;
+};
+
+/**
+ * Minimal allocator interface used to allocate error infos,
+ * e.g. from a per-request arena.
+ *
+ * In C++17, std::pmr::memory_resource is also accepted wherever
+ * ErrorAllocator is accepted.
+ */
+class ErrorAllocator {
+ public:
+  ErrorAllocator() = default;
+  virtual ~ErrorAllocator() = default;
 
   /**
-   * \warning
-   *   This function should be called only once.
-   *   The message is moved!
    * \return
+   *   Memory of \p size bytes aligned to \p align
+   *   nullptr is considered as failure, then std::bad_alloc is thrown
    */
-  std::string GetMessage() const override
-  {
-    return std::move(const_cast<MsgErrorInfo *>(this)->msg_);
-  }
+  virtual void *Allocate(size_t size, size_t align) = 0;
 
- private:
-  std::string msg_;
+  /**
+   * Release the memory returned by Allocate().
+   * e.g. Monotonic arena can do nothing.
+   */
+  virtual void Deallocate(void *p, size_t size, size_t align) noexcept = 0;
+};
+
+enum class IsErrorFlag {
+  OFF = 0,
+  ON = 1,
 };
 
-Error MakeMsgErrorf(char const *fmt, ...);
+#ifdef KERROR_COMPACT_ERROR
+#  if defined(KERROR_INLINE_INFO_SIZE) && KERROR_INLINE_INFO_SIZE != 0
+#    error "KERROR_COMPACT_ERROR requires no inline buffer"
+#  endif
+#  undef KERROR_INLINE_INFO_SIZE
+#  define KERROR_INLINE_INFO_SIZE 0
+#endif
 
-KERROR_INLINE Error MakeMsgError(char const *msg)
-{
-  return Error(std::unique_ptr<IErrorInfo>(new MsgErrorInfo(msg)));
-}
-KERROR_INLINE Error MakeMsgError(std::string msg)
-{
-  return Error(std::unique_ptr<IErrorInfo>(new MsgErrorInfo(std::move(msg))));
-}
+#ifndef KERROR_INLINE_INFO_SIZE
+/**
+ * Size of the buffer in Error that stores small error info objects,
+ * this avoid a heap allocation for most built-in error info types.
+ * Define it to 0(or define KERROR_COMPACT_ERROR) to disable the inline
+ * storage, then Error is as large as a pointer.
+ */
+#  define KERROR_INLINE_INFO_SIZE 48
+#endif
 
-namespace detail {
+static_assert(KERROR_INLINE_INFO_SIZE % sizeof(void *) == 0,
+              "KERROR_INLINE_INFO_SIZE must be a multiple of pointer size");
+static_assert(KERROR_INLINE_INFO_SIZE == 0 ||
+                  KERROR_INLINE_INFO_SIZE >= 4 * sizeof(void *),
+              "The inline buffer must hold the built-in error infos");
 
-template <typename T,
-          typename std::enable_if<!std::is_trivially_destructible<T>::value,
-                                  int>::type = 0>
-void destroy_(T &obj)
-{
-  obj.~T();
-}
+#ifndef KERROR_INFO_FREE_LIST_SIZE
+/**
+ * The number of released infos cached by each thread for each size of the
+ * infos allocated in the heap, then creating an error in a loop doesn't go
+ * through malloc. Define it to 0 to disable the free lists.
+ */
+#  define KERROR_INFO_FREE_LIST_SIZE 32
+#endif
 
-template <typename T, typename = typename std::enable_if<
-                          std::is_trivially_destructible<T>::value>::type>
-void destroy_(T &obj) noexcept
-{
-}
+namespace detail {
 
-} // namespace detail
+template <typename T>
+struct InPlaceInfo {
+};
 
+/**
+ * Wrapper of the error info stored in the inline buffer of Error.
+ * Since it is derived from T, the dynamic type is still preserved.
+ */
 template <typename T>
-struct ErrorOr {
+class InlineErrorInfo final : public T {
  public:
-  ErrorOr(Error error)
-    : error_(std::move(error))
+  template <typename... Args>
+  explicit InlineErrorInfo(Args &&...args)
+    : T(std::forward<Args>(args)...)
   {
-    is_error_ = true;
   }
 
-  ErrorOr(T obj)
-    : obj_(std::move(obj))
-  {
-    is_error_ = false;
-  }
+ private:
+  void Destroy() noexcept override { this->~InlineErrorInfo(); }
 
-  ~ErrorOr()
+  void RelocateTo(void *dst) noexcept override
   {
-    if (is_error_) {
-      detail::destroy_(error_);
-    } else {
-      detail::destroy_(obj_);
-    }
+    auto relocated = new (dst) InlineErrorInfo(std::move(*this));
+    this->MoveContextTo(*relocated);
+    this->~InlineErrorInfo();
   }
+};
 
-  ErrorOr(ErrorOr const &other)
-    : is_error_(other.is_error_)
+/**
+ * Wrapper of the error info allocated by an ErrorAllocator or
+ * std::pmr::memory_resource, the info is released through it.
+ *
+ * \Param R ErrorAllocator or std::pmr::memory_resource
+ */
+template <typename T, typename R>
+class AllocatedErrorInfo final : public T {
+ public:
+  template <typename... Args>
+  explicit AllocatedErrorInfo(R *resource, size_t size, Args &&...args)
+    : T(std::forward<Args>(args)...)
+    , resource_(resource)
+    , size_(size)
   {
-    if (other.is_error) {
-      new (&obj_) T(other.obj_);
-    } else {
-      new (&error_) Error(other.error_);
-    }
   }
 
-  ErrorOr(ErrorOr &&other) noexcept(noexcept(std::move(other.obj_)))
-    : is_error_(other.is_error_)
-  {
-    if (other.is_error_) {
-      new (&obj_) T(std::move(other.obj_));
-    } else {
-      new (&error_) Error(std::move(other.error_));
-    }
-  }
+ private:
+  void Destroy() noexcept override;
 
-  ErrorOr &operator=(ErrorOr const &other)
-  {
-    if (&other == this) return *this;
+  R *resource_;
+  size_t size_; // May be greater than sizeof(*this)
+};
 
-    if (other.is_error_ == is_error_) {
-      if (is_error_) {
-        error_ = other.error_;
-      } else {
-        obj_ = other.obj_;
+KERROR_INLINE void *AllocateFrom(ErrorAllocator *alloc, size_t size,
+                                 size_t align)
+{
+  auto p = alloc->Allocate(size, align);
+  if (KERROR_UNLIKELY(!p)) throw std::bad_alloc();
+  return p;
+}
+
+KERROR_INLINE void DeallocateFrom(ErrorAllocator *alloc, void *p, size_t size,
+                                  size_t align) noexcept
+{
+  alloc->Deallocate(p, size, align);
+}
+
+#if KERROR_HAS_PMR
+KERROR_INLINE void *AllocateFrom(std::pmr::memory_resource *resource,
+                                 size_t size, size_t align)
+{
+  return resource->allocate(size, align);
+}
+
+KERROR_INLINE void DeallocateFrom(std::pmr::memory_resource *resource,
+                                  void *p, size_t size, size_t align) noexcept
+{
+  resource->deallocate(p, size, align);
+}
+#endif
+
+template <typename T, typename R>
+void AllocatedErrorInfo<T, R>::Destroy() noexcept
+{
+  auto resource = resource_;
+  auto size = size_;
+  this->~AllocatedErrorInfo();
+  DeallocateFrom(resource, this, size, alignof(AllocatedErrorInfo));
+}
+
+/**
+ * Map the allocator type to the base type accepted by kerror.
+ * i.e. ErrorAllocator or std::pmr::memory_resource
+ */
+template <typename R, typename = void>
+struct ResourceBase {
+};
+
+template <typename R>
+struct ResourceBase<R, typename std::enable_if<
+                           std::is_base_of<ErrorAllocator, R>::value>::type> {
+  using type = ErrorAllocator;
+};
+
+#if KERROR_HAS_PMR
+template <typename R>
+struct ResourceBase<R, typename std::enable_if<std::is_base_of<
+                           std::pmr::memory_resource, R>::value>::type> {
+  using type = std::pmr::memory_resource;
+};
+#endif
+
+template <typename R, typename = void>
+struct IsResource : std::false_type {
+};
+
+template <typename R>
+struct IsResource<R *, typename std::enable_if<std::is_class<
+                           typename ResourceBase<R>::type>::value>::type>
+  : std::true_type {
+};
+
+template <typename... Args>
+struct FirstIsResource : std::false_type {
+};
+
+template <typename Arg, typename... Args>
+struct FirstIsResource<Arg, Args...>
+  : IsResource<typename std::decay<Arg>::type> {
+};
+
+// InlineErrorInfo<T> has no data member, and it should not be instantiated
+// for T that can't be stored inline.
+template <typename T>
+struct CanStoreInline
+  : std::integral_constant<
+        bool, sizeof(T) <= KERROR_INLINE_INFO_SIZE &&
+                  alignof(T) <= alignof(IErrorInfo) &&
+                  std::is_nothrow_move_constructible<T>::value &&
+                  !std::is_base_of<SharedErrorInfo, T>::value &&
+                  !KERROR_IS_FINAL(T)> {};
+
+struct FreeBlock {
+  FreeBlock *next;
+  // Links the batches in the depot
+  FreeBlock *next_batch;
+};
+
+/**
+ * Bounded thread-local free list of the heap blocks of \p Size bytes.
+ *
+ * The block is released to the free list of the destroying thread, so the
+ * error destroyed by another thread doesn't free to the malloc arena of
+ * the creating thread. If the list is full, the whole list is moved to the
+ * shared depot as a batch, and the thread whose list is empty takes a batch
+ * from the depot, so the blocks flow back from the consumer threads when
+ * the errors are created and destroyed by different threads. The depot is
+ * locked once per batch, and the blocks beyond the depot are freed, as well
+ * as the list of the exited thread.
+ */
+template <size_t Size>
+class InfoFreeList {
+ public:
+  KERROR_INLINE static void *Allocate()
+  {
+    auto &local = local_;
+    auto block = local.head;
+    if (KERROR_UNLIKELY(!block)) return Refill();
+    local.head = block->next;
+    --local.count;
+    return block;
+  }
+
+  KERROR_INLINE static void Deallocate(void *p) noexcept
+  {
+    auto &local = local_;
+    // The list is empty or full, i.e. count - 1 wraps around if empty
+    if (KERROR_UNLIKELY(local.count - 1 >= KERROR_INFO_FREE_LIST_SIZE - 1))
+      Prepare();
+    auto block = static_cast<FreeBlock *>(p);
+    block->next = local.head;
+    local.head = block;
+    ++local.count;
+  }
+
+ private:
+  static constexpr size_t kMaxDepotBatches = 16;
+
+  struct Local {
+    FreeBlock *head;
+    size_t count;
+  };
+
+  struct Depot {
+    std::atomic<bool> locked;
+    FreeBlock *batches;
+    size_t count;
+
+    void Lock() noexcept
+    {
+      while (locked.exchange(true, std::memory_order_acquire)) {
+      }
+    }
+
+    void Unlock() noexcept { locked.store(false, std::memory_order_release); }
+  };
+
+  struct Releaser {
+    ~Releaser() noexcept
+    {
+      if (local_.head) Spill();
+    }
+  };
+
+  /**
+   * Register the releaser of the list, the thread may only release the
+   * infos created by the other threads
+   */
+  static void RegisterReleaser() noexcept
+  {
+    static thread_local Releaser releaser;
+    (void)releaser;
+  }
+
+  KERROR_COLD KERROR_NOINLINE static void Prepare() noexcept
+  {
+    if (local_.count == 0)
+      RegisterReleaser();
+    else
+      Spill();
+  }
+
+  KERROR_COLD KERROR_NOINLINE static void *Refill()
+  {
+    RegisterReleaser();
+
+    depot_.Lock();
+    auto batch = depot_.batches;
+    if (batch) {
+      depot_.batches = batch->next_batch;
+      --depot_.count;
+    }
+    depot_.Unlock();
+
+    if (!batch) return ::operator new(Size);
+    // The batch is a full list
+    local_.head = batch->next;
+    local_.count = KERROR_INFO_FREE_LIST_SIZE - 1;
+    return batch;
+  }
+
+  KERROR_COLD KERROR_NOINLINE static void Spill() noexcept
+  {
+    auto batch = local_.head;
+    // The list of an exited thread may be not full, they aren't batches
+    bool const full = local_.count == KERROR_INFO_FREE_LIST_SIZE;
+    local_.head = nullptr;
+    local_.count = 0;
+
+    if (full) {
+      depot_.Lock();
+      if (depot_.count < kMaxDepotBatches) {
+        batch->next_batch = depot_.batches;
+        depot_.batches = batch;
+        ++depot_.count;
+        batch = nullptr;
+      }
+      depot_.Unlock();
+    }
+
+    while (batch) {
+      auto next = batch->next;
+      ::operator delete(batch);
+      batch = next;
+    }
+  }
+
+  static thread_local Local local_;
+  static Depot depot_;
+};
+
+template <size_t Size>
+constexpr size_t InfoFreeList<Size>::kMaxDepotBatches;
+
+// Constant-initialized and trivial, so they are accessed without the TLS
+// wrapper and never destroyed
+template <size_t Size>
+thread_local typename InfoFreeList<Size>::Local InfoFreeList<Size>::local_ = {
+    nullptr, 0};
+
+template <size_t Size>
+typename InfoFreeList<Size>::Depot InfoFreeList<Size>::depot_ = {
+    {false}, nullptr, 0};
+
+/**
+ * Wrapper of the error info allocated from InfoFreeList, the block is
+ * released to the free list of the destroying thread.
+ * The size is rounded up to the pointer size, so the infos of the similar
+ * size share the list.
+ */
+template <typename T>
+class PooledErrorInfo final : public T {
+ public:
+  using FreeList = InfoFreeList<(sizeof(T) + sizeof(void *) - 1) /
+                                sizeof(void *) * sizeof(void *)>;
+
+  template <typename... Args>
+  explicit PooledErrorInfo(Args &&...args)
+    : T(std::forward<Args>(args)...)
+  {
+  }
+
+ private:
+  void Destroy() noexcept override
+  {
+    this->~PooledErrorInfo();
+    FreeList::Deallocate(this);
+  }
+};
+
+template <typename T>
+struct CanPool
+  : std::integral_constant<
+        bool, KERROR_INFO_FREE_LIST_SIZE != 0 &&
+                  alignof(T) <= alignof(std::max_align_t) &&
+                  !std::is_base_of<SharedErrorInfo, T>::value &&
+                  !KERROR_IS_FINAL(T)> {};
+
+template <typename T, typename... Args>
+KERROR_INLINE IErrorInfo *AllocateHeapInfo(std::false_type, Args &&...args)
+{
+  return new T(std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+KERROR_INLINE IErrorInfo *AllocateHeapInfo(std::true_type, Args &&...args)
+{
+  using Info = PooledErrorInfo<T>;
+  static_assert(sizeof(Info) == sizeof(T), "No data member is added");
+
+  auto p = Info::FreeList::Allocate();
+  try {
+    return new (p) Info(std::forward<Args>(args)...);
+  }
+  catch (...) {
+    Info::FreeList::Deallocate(p);
+    throw;
+  }
+}
+
+/**
+ * Allocate the info from the free list if possible, it can be released by
+ * IErrorInfo::Destroy() or delete
+ */
+template <typename T, typename... Args>
+KERROR_INLINE IErrorInfo *NewHeapInfo(Args &&...args)
+{
+  return AllocateHeapInfo<T>(CanPool<T>{}, std::forward<Args>(args)...);
+}
+
+} // namespace detail
+
+/**
+ * Like std::error_category, a category describes a space of error codes.
+ * e.g. SystemCategory() for errno.
+ *
+ * The category is registered in construction and assigned a small id,
+ * so that an error code can be stored in Error with the id instead of the
+ * category pointer.
+ * The categories are usually defined as global objects:
+ * \code
+ *   struct MyCategory : ErrorCategory {
+ *     char const *GetName() const noexcept override { return "my"; }
+ *     std::string GetMessage(int code) const override { ... }
+ *   };
+ *   MyCategory const kMyCategory;
+ *   auto err = MakeCodeError(kMyCategory, 1);
+ * \endcode
+ */
+class ErrorCategory {
+ public:
+  ErrorCategory() noexcept;
+  virtual ~ErrorCategory();
+
+  ErrorCategory(ErrorCategory const &) = delete;
+  ErrorCategory &operator=(ErrorCategory const &) = delete;
+
+  virtual char const *GetName() const noexcept = 0;
+  virtual std::string GetMessage(int code) const = 0;
+
+  /**
+   * Override it to write the message without allocation
+   */
+  virtual void WriteMessage(int code, MessageSink &sink) const
+  {
+    auto const msg = GetMessage(code);
+    sink.Write(msg.data(), msg.size());
+  }
+
+  /**
+   * \return
+   *   0 if the category can't be registered since too many categories
+   */
+  uint16_t id() const noexcept { return id_; }
+
+ protected:
+  /**
+   * Used for built-in categories whose ids are reserved
+   */
+  constexpr explicit ErrorCategory(uint16_t id) noexcept
+    : id_(id)
+  {
+  }
+
+ private:
+  uint16_t id_;
+};
+
+/**
+ * Category of errno
+ */
+class SystemErrorCategory final : public ErrorCategory {
+ public:
+  static constexpr uint16_t kId = 1;
+
+  constexpr SystemErrorCategory() noexcept
+    : ErrorCategory(kId)
+  {
+  }
+
+  char const *GetName() const noexcept override { return "system"; }
+  std::string GetMessage(int code) const override;
+  void WriteMessage(int code, MessageSink &sink) const override;
+};
+
+namespace detail {
+
+constexpr size_t kMaxErrorCategories = 256;
+
+extern SystemErrorCategory const g_system_category;
+extern std::atomic<ErrorCategory const *>
+    g_error_categories[kMaxErrorCategories];
+
+} // namespace detail
+
+KERROR_INLINE ErrorCategory const &SystemCategory() noexcept
+{
+  return detail::g_system_category;
+}
+
+/**
+ * \return
+ *   nullptr if \p id is not registered
+ */
+KERROR_INLINE ErrorCategory const *GetErrorCategory(uint16_t id) noexcept
+{
+  return id < detail::kMaxErrorCategories
+             ? detail::g_error_categories[id].load(std::memory_order_acquire)
+             : nullptr;
+}
+
+namespace detail {
+
+/**
+ * \return
+ *   The registered category named \p name, nullptr if not found.
+ *   Used by the decoders, since the ids are allocated per process.
+ */
+ErrorCategory const *FindErrorCategory(StringSlice name) noexcept;
+
+} // namespace detail
+
+/**
+ * Error info of error code, it is created only if info() is called
+ * on the error made by MakeCodeError() or MakeSysError().
+ */
+class CodeErrorInfo : public ErrorInfo<CodeErrorInfo> {
+ public:
+  CodeErrorInfo(ErrorCategory const &category, int code) noexcept
+    : category_(&category)
+    , code_(code)
+  {
+  }
+
+  std::string GetMessage() const override
+  {
+    return category_->GetMessage(code_);
+  }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    category_->WriteMessage(code_, sink);
+  }
+
+  ErrorCategory const &category() const noexcept { return *category_; }
+  int code() const noexcept { return code_; }
+
+ private:
+  ErrorCategory const *category_;
+  int code_;
+};
+
+/**
+ * The Error without inline buffer is a word and can be relocated by
+ * memcpy, so it can be passed in registers.
+ */
+#if KERROR_INLINE_INFO_SIZE
+#  define KERROR_ERROR_ABI
+#else
+#  define KERROR_ERROR_ABI KERROR_TRIVIAL_ABI
+#endif
+
+/**
+ * Error with error code and information(i.e. typed errno)
+ *
+ * The state is packed into one word:
+ * | info pointer | inline(2) | checked(1) | error(0) |
+ * Error info is aligned to 8 at least, so the low 3 bits are available.
+ * The checked bit is always 0 if KERROR_FORCE_CHECK is 0.
+ * - Success: 0
+ * - No info error: only the error bit
+ * - Inline info: the info is located in storage_ instead of the pointer
+ * - Error code(64-bit only): The inline bit with the code and category id
+ *   | code(32~63) | category id(16~31) | materialized(3) | 1 | checked | 1 |
+ *   The CodeErrorInfo is created by info() only, if there is inline buffer,
+ *   it is created in it and the materialized bit is set, otherwise, the
+ *   error is turned to a pointer to it.
+ *
+ * If KERROR_COMPACT_ERROR is defined, the inline buffer is disabled and
+ * sizeof(Error) == sizeof(void*).
+ */
+class KERROR_ERROR_ABI Error {
+  using Bits = uintptr_t;
+
+  static constexpr Bits kErrorBit = 1;
+#if KERROR_FORCE_CHECK
+  static constexpr Bits kCheckedBit = 2;
+#else
+  // The checked state is removed, then all updates to it are no-op.
+  static constexpr Bits kCheckedBit = 0;
+#endif
+  static constexpr Bits kInlineBit = 4;
+  static constexpr Bits kTagMask = 7;
+  static constexpr Bits kMaterializedBit = 8;
+#if KERROR_PACK_ERROR_CODE
+  static constexpr int kCategoryShift = 16;
+  static constexpr Bits kCategoryMask = 0xffff;
+  static constexpr int kCodeShift = 32;
+#endif
+
+ public:
+  /**
+   * You should not call this function to create Error instead of calling
+   * MakeError().
+   *
+   * \Param error The error code you defined or libc provide
+   * \Param info Provide some information to debug or trace, etc.
+   */
+  explicit Error(std::unique_ptr<IErrorInfo> info)
+    : Error(info.release())
+  {
+  }
+
+  /**
+   * Take the ownership of \p info.
+   * The info is released by the IErrorInfo::Destroy() hook.
+   */
+  explicit Error(IErrorInfo *info) noexcept
+    : bits_(reinterpret_cast<Bits>(info) | kErrorBit)
+  {
+    assert((reinterpret_cast<Bits>(info) & kTagMask) == 0);
+  }
+
+  /**
+   * Construct the error info of type \p T in place.
+   * If T is small enough, it is stored in the inline buffer,
+   * otherwise, allocated in the heap.
+   *
+   * You should call MakeError<T>() instead of calling this directly.
+   */
+  template <typename T, typename... Args>
+  explicit Error(detail::InPlaceInfo<T>, Args &&...args)
+  {
+    bits_ =
+        CreateInfo<T>(detail::CanStoreInline<T>{}, std::forward<Args>(args)...);
+  }
+
+  /**
+   * Error code of \p category.
+   * The code is stored in Error without allocation on 64-bit platforms.
+   *
+   * You should call MakeCodeError() instead of calling this directly.
+   */
+  Error(ErrorCategory const &category, int code)
+  {
+#if KERROR_PACK_ERROR_CODE
+    if (KERROR_LIKELY(category.id() != 0)) {
+      bits_ = (static_cast<Bits>(static_cast<uint32_t>(code)) << kCodeShift) |
+              (static_cast<Bits>(category.id()) << kCategoryShift) |
+              kInlineBit | kErrorBit;
+      return;
+    }
+#endif
+    bits_ = CreateInfo<CodeErrorInfo>(detail::CanStoreInline<CodeErrorInfo>{},
+                                      category, code);
+  }
+
+  /**
+   * Used for implementing MakeNoInfoError() and MakeSuccess()
+   *
+   * \param is_error
+   */
+  Error(IsErrorFlag is_error = IsErrorFlag::OFF) noexcept
+    : bits_(IsErrorFlag::ON == is_error ? kErrorBit : 0)
+  {
+  }
+
+  ~Error() noexcept
+  {
+    AbortIsChecked();
+    // For success, this is folded and nothing is left.
+    if (KERROR_UNLIKELY(has_payload())) DestroyInfo();
+  }
+
+  /**
+   * Copying can fail for most error infos, call TryCopy() explicitly
+   */
+  Error(Error const &) = delete;
+  Error &operator=(Error const &) = delete;
+
+  /**
+   * Make the other be checked to avoid abort
+   */
+  Error(Error &&other) noexcept
+    : bits_(kCheckedBit) // Satisfy the move assign precondition
+  {
+    // invariant: this != &other
+    *this = std::move(other);
+  }
+
+  Error &operator=(Error &&other) noexcept
+  {
+    if (&other != this) {
+      // pre: The error has checked
+      AbortIsChecked();
+      DestroyInfo();
+      StealInfo(other);
+    }
+    return *this;
+  }
+
+  /**
+   * Copy the error to \p copy, the copy is unchecked, just like a new error.
+   * Only the success, no info error, error code and SharedErrorInfo can be
+   * copied(i.e. copying them is cheap), the contexts added by AddContext()
+   * are not copied.
+   *
+   * \Param copy A success or checked error, it is replaced by the copy
+   * \return
+   *   false if the info can't be copied, \p copy is unchanged
+   */
+  bool TryCopy(Error *copy) const;
+
+  /**
+   * \brief Ignore the error check(ie. Disable the forced error check)
+   */
+  void IgnoreCheck() const noexcept { bits_ |= kCheckedBit; }
+
+  operator bool() const noexcept
+  {
+#if KERROR_FORCE_CHECK
+    // If this is a success, user can don't extract the errno.
+    // otherwise, caller must call error_no() to check and handle error
+    // or call info() to get the information if caller don't handle it.
+    if (is_success())
+      bits_ |= kCheckedBit;
+    else
+      bits_ &= ~kCheckedBit;
+#endif
+    return is_error();
+  }
+
+  IErrorInfo *info() const noexcept
+  {
+    bits_ |= kCheckedBit;
+    return unchecked_info();
+  }
+
+  /**
+   * \return
+   *   The category of error code, nullptr if this is not an error code
+   */
+  ErrorCategory const *category() const noexcept
+  {
+    bits_ |= kCheckedBit;
+#if KERROR_PACK_ERROR_CODE
+    if (is_packed_code()) {
+      return GetErrorCategory(
+          static_cast<uint16_t>((bits_ >> kCategoryShift) & kCategoryMask));
+    }
+#endif
+    auto info = code_info();
+    return info ? &info->category() : nullptr;
+  }
+
+  /**
+   * \return
+   *   The error code, 0 if this is not an error code
+   */
+  int code() const noexcept
+  {
+    bits_ |= kCheckedBit;
+#if KERROR_PACK_ERROR_CODE
+    if (is_packed_code()) {
+      return static_cast<int>(static_cast<uint32_t>(bits_ >> kCodeShift));
+    }
+#endif
+    auto info = code_info();
+    return info ? info->code() : 0;
+  }
+
+  /**
+   * \brief Add a context to the error, e.g. "while reading shard 3"
+   *
+   * The context is linked to the info in O(1) without touching the message,
+   * the message is assembled by IErrorInfo::GetFullMessage() when printing.
+   * The no info error and the error of SharedErrorInfo are wrapped into
+   * ContextErrorInfo first, IsA<T>() and DynCast<T>() see through it.
+   * No-op if this is a success.
+   *
+   * \Param context String literal(or has static storage), not copied
+   * \return *this
+   */
+  Error &AddContext(StringSlice context);
+
+  /**
+   * The context is copied and allocated from \p alloc with the node
+   */
+  Error &AddContext(ErrorAllocator *alloc, StringSlice context);
+#if KERROR_HAS_PMR
+  Error &AddContext(std::pmr::memory_resource *resource, StringSlice context);
+#endif
+
+  /**
+   * The context is formatted lazily like MakeLazyMsgErrorf()
+   */
+  template <typename... Args>
+  Error &AddContextf(char const *fmt, Args &&...args);
+
+  /**
+   * Write the full message of the error to \p sink.
+   * Unlike info()->WriteFullMessage(), the error code is not materialized,
+   * so there is no allocation for the built-in infos.
+   */
+  void WriteMessage(MessageSink &sink) const;
+
+  bool is_success() const noexcept { return !is_error(); }
+  bool is_error() const noexcept { return bits_ & kErrorBit; }
+
+  /**
+   * \return
+   *   true if the error info is stored in the inline buffer
+   */
+  bool is_inline() const noexcept
+  {
+    return KERROR_INLINE_INFO_SIZE && (bits_ & kInlineBit) &&
+           (!is_packed_code() || (bits_ & kMaterializedBit));
+  }
+
+  /**
+   * \return
+   *   true if the error info is allocated out of the Error, i.e. it is too
+   *   large to be stored inline or allocated by the allocator
+   */
+  bool is_allocated() const noexcept
+  {
+    return !(bits_ & kInlineBit) && pointer();
+  }
+
+ private:
+  bool checked() const noexcept { return bits_ & kCheckedBit; }
+
+  /**
+   * \return
+   *   true if the error code is stored in bits_
+   */
+  bool is_packed_code() const noexcept
+  {
+#if KERROR_PACK_ERROR_CODE
+    return (bits_ & kInlineBit) && ((bits_ >> kCategoryShift) & kCategoryMask);
+#else
+    return false;
+#endif
+  }
+
+  /**
+   * Fast check used by destructor, there may be no info to release
+   */
+  bool has_payload() const noexcept
+  {
+    return bits_ & ~(kErrorBit | kCheckedBit);
+  }
+
+  IErrorInfo *unchecked_info() const noexcept
+  {
+    if (KERROR_UNLIKELY(is_packed_code() && !(bits_ & kMaterializedBit))) {
+      if (!MaterializeCode()) return nullptr;
+    }
+    return is_inline() ? inline_info() : pointer();
+  }
+
+  CodeErrorInfo const *code_info() const noexcept
+  {
+    if (is_inline()) return DynCast<CodeErrorInfo>(inline_info());
+    return !(bits_ & kInlineBit) ? DynCast<CodeErrorInfo>(pointer()) : nullptr;
+  }
+
+  /**
+   * Create the CodeErrorInfo of the packed error code for info()
+   *
+   * \return
+   *   false if out of memory, then the code is kept packed without info,
+   *   code() and category() still work
+   */
+  bool MaterializeCode() const noexcept;
+
+  // pre: This has no info
+  bool CopyFrom(Error const &other);
+
+  // pre: This is an error
+  void AttachContext(IErrorInfo *context);
+
+  IErrorInfo *pointer() const noexcept
+  {
+    return reinterpret_cast<IErrorInfo *>(bits_ & ~kTagMask);
+  }
+
+  void AbortIsChecked() noexcept
+  {
+#if KERROR_FORCE_CHECK
+    if (KERROR_UNLIKELY(!checked() && is_error())) {
+      fprintf(stderr, "The error is don't checked by user");
+      fflush(stderr);
+      abort();
+    }
+#endif
+  }
+
+  template <typename T, typename... Args>
+  Bits CreateInfo(std::true_type, Args &&...args)
+  {
+    new (inline_info())
+        detail::InlineErrorInfo<T>(std::forward<Args>(args)...);
+    return kErrorBit | kInlineBit;
+  }
+
+  template <typename T, typename... Args>
+  Bits CreateInfo(std::false_type, Args &&...args)
+  {
+    return reinterpret_cast<Bits>(
+               detail::NewHeapInfo<T>(std::forward<Args>(args)...)) |
+           kErrorBit;
+  }
+
+  void DestroyInfo() noexcept
+  {
+    if (is_inline()) {
+      inline_info()->Destroy();
+    } else if (!(bits_ & kInlineBit) && pointer()) {
+      pointer()->Destroy();
+    }
+    bits_ = kCheckedBit;
+  }
+
+  // pre: This has no info
+  void StealInfo(Error &other) noexcept
+  {
+    if (other.is_inline()) {
+      other.inline_info()->RelocateTo(inline_info());
+    }
+    bits_ = other.bits_ & ~kCheckedBit;
+
+    // avoid abort
+    other.bits_ = kCheckedBit;
+  }
+
+  IErrorInfo *inline_info() const noexcept
+  {
+#if KERROR_INLINE_INFO_SIZE
+    return reinterpret_cast<IErrorInfo *>(storage_);
+#else
+    return nullptr;
+#endif
+  }
+
+ protected:
+  mutable Bits bits_;
+#if KERROR_INLINE_INFO_SIZE
+  // The CodeErrorInfo may be created in const member functions
+  alignas(IErrorInfo) mutable unsigned char storage_[KERROR_INLINE_INFO_SIZE];
+#endif
+};
+
+static_assert(sizeof(Error) == sizeof(void *) + KERROR_INLINE_INFO_SIZE,
+              "Error should be as large as a pointer plus the inline buffer");
+#if !KERROR_INLINE_INFO_SIZE
+static_assert(sizeof(Error) == sizeof(void *),
+              "The compact Error should be as large as a pointer");
+#endif
+
+namespace detail {
+
+/**
+ * The construction of info is outlined, then the caller only contains
+ * a call instruction in the error path.
+ */
+template <typename T, typename... Args>
+KERROR_COLD KERROR_NOINLINE Error MakeErrorCold(Args &&...args)
+{
+  return Error(InPlaceInfo<T>{}, std::forward<Args>(args)...);
+}
+
+/**
+ * The info is released by IErrorInfo::Destroy(),
+ * so it can be owned by Error or be a context.
+ */
+template <typename T, typename... Args>
+KERROR_COLD KERROR_NOINLINE IErrorInfo *NewInfo(Args &&...args)
+{
+  return NewHeapInfo<T>(std::forward<Args>(args)...);
+}
+
+template <typename T, typename R, typename... Args>
+KERROR_COLD KERROR_NOINLINE IErrorInfo *NewInfoFrom(R *resource,
+                                                    Args &&...args)
+{
+  static_assert(!std::is_base_of<SharedErrorInfo, T>::value,
+                "SharedErrorInfo is released by itself");
+  using Info = AllocatedErrorInfo<T, R>;
+
+  auto p = AllocateFrom(resource, sizeof(Info), alignof(Info));
+  try {
+    return new (p) Info(resource, sizeof(Info), std::forward<Args>(args)...);
+  }
+  catch (...) {
+    DeallocateFrom(resource, p, sizeof(Info), alignof(Info));
+    throw;
+  }
+}
+
+} // namespace detail
+
+template <typename T, typename... Args>
+KERROR_INLINE
+    typename std::enable_if<!detail::FirstIsResource<Args...>::value,
+                            Error>::type
+    MakeError(Args &&...args)
+{
+  return detail::MakeErrorCold<T>(std::forward<Args>(args)...);
+}
+
+/**
+ * Like MakeError<T>(args...) but the info is allocated from \p resource.
+ * and released through it when the Error is destroyed.
+ *
+ * \Param resource ErrorAllocator or std::pmr::memory_resource(C++17)
+ *                 It must outlive the returned Error.
+ */
+template <typename T, typename R, typename... Args>
+KERROR_INLINE
+    typename std::enable_if<detail::IsResource<R *>::value, Error>::type
+    MakeError(R *resource, Args &&...args)
+{
+  using Base = typename detail::ResourceBase<R>::type;
+  return Error(detail::NewInfoFrom<T>(static_cast<Base *>(resource),
+                                      std::forward<Args>(args)...));
+}
+
+/**
+ * In some cases, no info error as indicator is useful,
+ * such error can don't bring information.
+ */
+KERROR_INLINE Error MakeNoInfoError() noexcept
+{
+  return Error(IsErrorFlag::ON);
+}
+
+KERROR_INLINE Error MakeSuccess() noexcept { return Error(IsErrorFlag::OFF); }
+
+/**
+ * Make an error with error code of \p category.
+ * No allocation, the message is looked up when printing the error.
+ */
+KERROR_INLINE Error MakeCodeError(ErrorCategory const &category, int code)
+{
+  return Error(category, code);
+}
+
+/**
+ * Make an error with errno, which is captured here instead of printing.
+ */
+KERROR_INLINE Error MakeSysError(int code = errno)
+{
+  return Error(SystemCategory(), code);
+}
+
+/**
+ * \brief Error domain of an enum
+ *
+ * Specialize it to make the enum an error domain, the codes are stored in
+ * Error as the codes of the category of the domain:
+ * \code
+ *   enum class DbError { kTimeout = 1, kConflict };
+ *
+ *   template <>
+ *   struct kerror::ErrorDomainTraits<DbError> {
+ *     static constexpr char const *kName = "db";
+ *     static constexpr ErrorDomainEntry<DbError> kMessages[] = {
+ *         {DbError::kTimeout, "Timeout"},
+ *         {DbError::kConflict, "Conflict"},
+ *     };
+ *   };
+ *   // Before C++17, kMessages must be defined in a translation unit
+ *   constexpr ErrorDomainEntry<DbError>
+ *       kerror::ErrorDomainTraits<DbError>::kMessages[];
+ *
+ *   auto err = MakeCodeError(DbError::kTimeout);
+ *   switch (ErrorCodeOf<DbError>(err)) { ... }
+ * \endcode
+ */
+template <typename E>
+struct ErrorDomainTraits;
+
+template <typename E>
+struct ErrorDomainEntry {
+  E code;
+  char const *message;
+};
+
+namespace detail {
+
+template <typename E, size_t N>
+constexpr char const *FindDomainMessage(ErrorDomainEntry<E> const (&table)[N],
+                                        E code, size_t i = 0) noexcept
+{
+  return i == N                 ? nullptr
+         : table[i].code == code ? table[i].message
+                                 : FindDomainMessage(table, code, i + 1);
+}
+
+} // namespace detail
+
+/**
+ * Look up the message table of the domain, can be used in constant
+ * expression
+ *
+ * \return
+ *   nullptr if \p code is not in the table
+ */
+template <typename E>
+constexpr char const *GetErrorDomainMessage(E code) noexcept
+{
+  return detail::FindDomainMessage(ErrorDomainTraits<E>::kMessages, code);
+}
+
+/**
+ * The category of the error domain \p E, registered in the first use
+ */
+template <typename E>
+class ErrorDomainCategory final : public ErrorCategory {
+ public:
+  static_assert(std::is_enum<E>::value, "The error domain must be an enum");
+
+  char const *GetName() const noexcept override
+  {
+    return ErrorDomainTraits<E>::kName;
+  }
+
+  std::string GetMessage(int code) const override
+  {
+    StringSink sink;
+    WriteMessage(code, sink);
+    return sink.str();
+  }
+
+  void WriteMessage(int code, MessageSink &sink) const override
+  {
+    if (auto msg = GetErrorDomainMessage(static_cast<E>(code))) {
+      sink.Write(msg, strlen(msg));
+      return;
+    }
+    char buf[32];
+    auto const n = snprintf(buf, sizeof buf, "Unknown error %d", code);
+    sink.Write(buf, static_cast<size_t>(n));
+  }
+
+  static ErrorDomainCategory const &Get() noexcept
+  {
+    static ErrorDomainCategory category;
+    return category;
+  }
+
+ private:
+  ErrorDomainCategory() = default;
+};
+
+/**
+ * Make an error with the code of the error domain \p E.
+ * It is packed into Error like other error codes, no allocation.
+ */
+template <typename E, typename = typename std::enable_if<
+                          std::is_enum<E>::value>::type>
+KERROR_INLINE Error MakeCodeError(E code)
+{
+  return Error(ErrorDomainCategory<E>::Get(), static_cast<int>(code));
+}
+
+/**
+ * \return
+ *   true if \p err is an error code of the error domain \p E
+ */
+template <typename E>
+KERROR_INLINE bool IsErrorOf(Error const &err) noexcept
+{
+  return err.category() == &ErrorDomainCategory<E>::Get();
+}
+
+/**
+ * The code can be switched on directly, no virtual call(except the error
+ * code can't be packed, see Error::category()).
+ *
+ * \return
+ *   The code if \p err is an error code of the error domain \p E,
+ *   otherwise E{}
+ */
+template <typename E>
+KERROR_INLINE E ErrorCodeOf(Error const &err) noexcept
+{
+  return IsErrorOf<E>(err) ? static_cast<E>(err.code()) : E{};
+}
+
+class MsgErrorInfo : public ErrorInfo<MsgErrorInfo> {
+ public:
+  MsgErrorInfo(char const *str)
+    : msg_(str, strlen(str))
+  {
+  }
+
+  MsgErrorInfo(std::string str)
+    : msg_(std::move(str))
+  {
+  }
+
+  MsgErrorInfo(MsgErrorInfo &&) = default;
+  MsgErrorInfo(MsgErrorInfo const &) = default;
+
+  MsgErrorInfo &operator=(MsgErrorInfo &&) = default;
+  MsgErrorInfo &operator=(MsgErrorInfo const &) = default;
+
+  std::string GetMessage() const override { return msg_; }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    sink.Write(msg_.data(), msg_.size());
+  }
+
+  std::string const &message() const noexcept { return msg_; }
+
+ private:
+  std::string msg_;
+};
+
+/**
+ * The message refers to a string that outlives the info.
+ * e.g. A string literal or the memory allocated with the info.
+ */
+class SliceMsgErrorInfo : public ErrorInfo<SliceMsgErrorInfo> {
+ public:
+  explicit constexpr SliceMsgErrorInfo(StringSlice msg) noexcept
+    : msg_(msg)
+  {
+  }
+
+  std::string GetMessage() const override
+  {
+    return std::string(msg_.data(), msg_.size());
+  }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    sink.Write(msg_.data(), msg_.size());
+  }
+
+  StringSlice message() const noexcept { return msg_; }
+
+ private:
+  StringSlice msg_;
+};
+
+class SharedMsgErrorInfo
+  : public ErrorInfo<SharedMsgErrorInfo, SharedErrorInfo> {
+ public:
+  explicit SharedMsgErrorInfo(std::string msg) noexcept
+    : msg_(std::move(msg))
+  {
+  }
+
+  std::string GetMessage() const override { return msg_; }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    sink.Write(msg_.data(), msg_.size());
+  }
+
+  std::string const &message() const noexcept { return msg_; }
+
+ private:
+  std::string const msg_;
+};
+
+/**
+ * Preallocated error that is returned repeatedly,
+ * e.g. "queue full" or "deadline exceeded" under overload.
+ * \code
+ *   static SharedError const kQueueFull(MakeSharedMsgError("queue full"));
+ *   return kQueueFull.get();
+ * \endcode
+ * The SharedErrorInfo owned by it is not reference counted, so get() only
+ * copies the pointer without atomic operation.
+ *
+ * \warning
+ *   The copies must not outlive the SharedError
+ */
+class SharedError {
+ public:
+  /**
+   * \Param error Copyable error(see Error::TryCopy())
+   */
+  explicit SharedError(Error error) noexcept
+    : error_(std::move(error))
+    , info_(nullptr)
+  {
+#ifndef NDEBUG
+    Error copy;
+    auto const copyable = error_.TryCopy(&copy);
+    assert(copyable && "The error must be copyable");
+    copy.IgnoreCheck();
+#endif
+    error_.IgnoreCheck();
+    if (error_ && !error_.category()) {
+      info_ = DynCast<SharedErrorInfo>(error_.info());
+      if (info_) info_->refs_.store(SharedErrorInfo::kImmortal);
+    }
+  }
+
+  ~SharedError() noexcept
+  {
+    // Released by error_
+    if (info_) info_->refs_.store(1);
+  }
+
+  SharedError(SharedError const &) = delete;
+  SharedError &operator=(SharedError const &) = delete;
+
+  Error get() const
+  {
+    Error copy;
+    (void)error_.TryCopy(&copy);
+    return copy;
+  }
+
+ private:
+  Error error_;
+  SharedErrorInfo *info_;
+};
+
+/**
+ * The message is shared by the copies of the Error
+ */
+KERROR_COLD Error MakeSharedMsgError(std::string msg);
+
+/**
+ * Wrapper of the error that can't hold the contexts by itself,
+ * i.e. the no info error and the error of SharedErrorInfo.
+ */
+class ContextErrorInfo : public ErrorInfo<ContextErrorInfo> {
+ public:
+  explicit ContextErrorInfo(Error cause) noexcept
+    : cause_(std::move(cause))
+  {
+    cause_.IgnoreCheck();
+  }
+
+  std::string GetMessage() const override
+  {
+    auto info = cause_.info();
+    return info ? info->GetFullMessage() : std::string();
+  }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    auto info = cause_.info();
+    if (info) info->WriteFullMessage(sink);
+  }
+
+  IErrorInfo const *CastTo(void const *class_id) const noexcept override
+  {
+    if (auto self = ErrorInfo::CastTo(class_id)) return self;
+    auto info = cause_.info();
+    return info ? info->CastTo(class_id) : nullptr;
+  }
+
+  void const *GetClassId() const noexcept override
+  {
+    auto info = cause_.info();
+    return info ? info->GetClassId() : IErrorInfo::ClassId();
+  }
+
+  Error const &cause() const noexcept { return cause_; }
+
+ private:
+  Error cause_;
+};
+
+namespace detail {
+
+template <typename R>
+KERROR_COLD KERROR_NOINLINE IErrorInfo *NewMsgInfoFrom(R *resource,
+                                                       StringSlice msg)
+{
+  using Info = AllocatedErrorInfo<SliceMsgErrorInfo, R>;
+
+  // The message is stored following the info,
+  // so only one allocation is required.
+  auto const size = sizeof(Info) + msg.size() + 1;
+  auto p = static_cast<char *>(AllocateFrom(resource, size, alignof(Info)));
+  auto str = p + sizeof(Info);
+  memcpy(str, msg.data(), msg.size());
+  str[msg.size()] = 0;
+  return new (p) Info(resource, size, StringSlice(str, msg.size()));
+}
+
+} // namespace detail
+
+KERROR_COLD Error MakeMsgErrorf(char const *fmt, ...);
+
+/**
+ * The std::string is constructed in kerror.cc instead of the caller
+ */
+KERROR_COLD Error MakeMsgError(char const *msg);
+KERROR_COLD Error MakeMsgError(std::string msg);
+
+/**
+ * The info and the copy of \p msg are allocated from \p alloc together
+ */
+KERROR_INLINE Error MakeMsgError(ErrorAllocator *alloc, StringSlice msg)
+{
+  return Error(detail::NewMsgInfoFrom(alloc, msg));
+}
+
+#if KERROR_HAS_PMR
+KERROR_INLINE Error MakeMsgError(std::pmr::memory_resource *resource,
+                                 StringSlice msg)
+{
+  return Error(detail::NewMsgInfoFrom(resource, msg));
+}
+#endif
+
+/**
+ * Make an error whose message is referenced by \p msg.
+ * Only the pointer and length are stored in the inline buffer of Error,
+ * i.e. No allocation and copy.
+ *
+ * \warning
+ *   The string is not copied, it must outlive the Error
+ */
+KERROR_INLINE Error MakeSliceError(StringSlice msg)
+{
+  static_assert(!KERROR_INLINE_INFO_SIZE ||
+                    detail::CanStoreInline<SliceMsgErrorInfo>::value,
+                "SliceMsgErrorInfo must fit in the inline buffer");
+  return MakeError<SliceMsgErrorInfo>(msg);
+}
+
+/**
+ * Make an error whose message is a const char array, like MakeSliceError().
+ * The length of array is computed in compile time.
+ * Only the const arrays are accepted, so the temporary strings(e.g.
+ * std::string) and the mutable buffers are rejected in compile time, use
+ * MakeSliceError() for the other strings outliving the Error.
+ * \warning The array is not copied, a const array with automatic storage
+ * (e.g. a local `char const buf[] = "..."`) is accepted but must outlive the
+ * Error. Use KERROR_STATIC_ERROR() to accept the string literals only.
+ */
+template <size_t N>
+KERROR_INLINE Error MakeStaticError(char const (&msg)[N])
+{
+  return MakeSliceError(StringSlice(msg, detail::Strlen(msg)));
+}
+
+template <size_t N>
+Error MakeStaticError(char (&msg)[N]) = delete;
+
+/**
+ * Like MakeStaticError() but \p literal must be a string literal, which has
+ * static storage, otherwise it doesn't compile.
+ */
+#define KERROR_STATIC_ERROR(literal) ::kerror::MakeStaticError("" literal)
+
+namespace detail {
+
+template <size_t... Is>
+struct IndexSequence {
+};
+
+template <size_t N, size_t... Is>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Is...> {
+};
+
+template <size_t... Is>
+struct MakeIndexSequence<0, Is...> : IndexSequence<Is...> {
+};
+
+/**
+ * The type of the argument captured by LazyMsgErrorInfo.
+ * std::string is captured by value(and passed to printf by c_str()),
+ * other arguments must be accepted by printf.
+ */
+template <typename T>
+struct LazyArg {
+  using type = typename std::decay<T>::type;
+
+  static_assert(std::is_arithmetic<type>::value ||
+                    std::is_pointer<type>::value ||
+                    std::is_same<type, std::string>::value,
+                "The argument can't be formatted by printf");
+};
+
+template <typename T>
+KERROR_INLINE T const &ToPrintfArg(T const &arg) noexcept
+{
+  return arg;
+}
+
+KERROR_INLINE char const *ToPrintfArg(std::string const &arg) noexcept
+{
+  return arg.c_str();
+}
+
+/**
+ * Tag to construct LazyMsgErrorInfo without the arguments
+ */
+struct ArgsNotSampled {
+};
+
+} // namespace detail
+
+/**
+ * Capture the format string and arguments, format them only when the
+ * message is requested at the first time. Then the result is cached.
+ *
+ * \warning
+ *   The format string and the pointer arguments(e.g. char const*) are
+ *   captured as is, they must outlive the info.
+ */
+template <typename... Args>
+class LazyMsgErrorInfo : public ErrorInfo<LazyMsgErrorInfo<Args...>> {
+ public:
+  explicit LazyMsgErrorInfo(char const *fmt, Args... args)
+    : fmt_(fmt)
+    , args_(std::move(args)...)
+  {
+  }
+
+  /**
+   * The arguments are not captured, the message is the format string
+   * marked by " [args not sampled]", see KERROR_SAMPLED_ERRORF().
+   */
+  LazyMsgErrorInfo(detail::ArgsNotSampled, char const *fmt)
+    : fmt_(fmt)
+    , args_()
+    , sampled_(false)
+  {
+  }
+
+  LazyMsgErrorInfo(LazyMsgErrorInfo &&) = default;
+
+  std::string GetMessage() const override
+  {
+    if (!msg_) {
+      Format(detail::MakeIndexSequence<sizeof...(Args)>{});
+    }
+    return msg_.get();
+  }
+
+  void WriteMessage(MessageSink &sink) const override
+  {
+    if (!msg_) {
+      Format(detail::MakeIndexSequence<sizeof...(Args)>{});
+    }
+    sink.Write(msg_.get(), strlen(msg_.get()));
+  }
+
+  char const *format() const noexcept { return fmt_; }
+
+  /**
+   * \return
+   *   false if the arguments are not captured
+   */
+  bool sampled() const noexcept { return sampled_; }
+
+ private:
+  template <size_t... Is>
+  void Format(detail::IndexSequence<Is...>) const
+  {
+    if (!sampled_) {
+      static char const kMark[] = " [args not sampled]";
+      auto const len = strlen(fmt_);
+      msg_.reset(new char[len + sizeof kMark]);
+      memcpy(msg_.get(), fmt_, len);
+      memcpy(msg_.get() + len, kMark, sizeof kMark);
+      return;
+    }
+    auto const n =
+        snprintf(nullptr, 0, fmt_, detail::ToPrintfArg(std::get<Is>(args_))...);
+    if (n < 0) {
+      msg_.reset(new char[1]{});
+      return;
+    }
+    msg_.reset(new char[n + 1]);
+    snprintf(msg_.get(), n + 1, fmt_,
+             detail::ToPrintfArg(std::get<Is>(args_))...);
+  }
+
+  char const *fmt_;
+  std::tuple<Args...> args_;
+  bool sampled_ = true;
+  mutable std::unique_ptr<char[]> msg_;
+};
+
+/**
+ * Like MakeMsgErrorf() but the message is formatted lazily.
+ * It is useful when the error is usually handled without reading the
+ * message, e.g. retry on timeout.
+ */
+template <typename... Args>
+Error MakeLazyMsgErrorf(char const *fmt, Args &&...args)
+{
+  return MakeError<LazyMsgErrorInfo<typename detail::LazyArg<Args>::type...>>(
+      fmt, std::forward<Args>(args)...);
+}
+
+namespace detail {
+
+// Only for the type of the info in unevaluated context
+template <typename... Args>
+LazyMsgErrorInfo<typename LazyArg<Args>::type...>
+LazyMsgInfoOf(char const *fmt, Args &&...args);
+
+template <typename Info>
+KERROR_COLD Error MakeNotSampledError(char const *fmt)
+{
+  return MakeError<Info>(ArgsNotSampled{}, fmt);
+}
+
+} // namespace detail
+
+template <typename... Args>
+Error &Error::AddContextf(char const *fmt, Args &&...args)
+{
+  if (is_error()) {
+    AttachContext(detail::NewInfo<
+                  LazyMsgErrorInfo<typename detail::LazyArg<Args>::type...>>(
+        fmt, std::forward<Args>(args)...));
+  }
+  return *this;
+}
+
+namespace detail {
+
+template <typename T,
+          typename std::enable_if<!std::is_trivially_destructible<T>::value,
+                                  int>::type = 0>
+void destroy_(T &obj)
+{
+  obj.~T();
+}
+
+template <typename T, typename = typename std::enable_if<
+                          std::is_trivially_destructible<T>::value>::type>
+void destroy_(T &) noexcept
+{
+}
+
+} // namespace detail
+
+/**
+ * Tag to construct the object of ErrorOr<T> in place
+ */
+struct InPlace {
+};
+
+constexpr InPlace kInPlace{};
+
+namespace detail {
+
+/**
+ * The small trivially copyable objects are stored beside the Error instead
+ * of in a union with it, then ErrorOr<T> has the same triviality as Error
+ * (e.g. trivial ABI in compact mode) without the is_error_ flag, and the
+ * size is the same since the flag is padded to a word.
+ */
+template <typename T>
+struct IsSeparateErrorOr
+  : std::integral_constant<
+        bool, std::is_trivially_copyable<T>::value &&
+                  std::is_trivially_default_constructible<T>::value &&
+                  sizeof(T) <= sizeof(void *)> {
+};
+
+/**
+ * Storage of ErrorOr<T>, the object and the Error are in a union
+ */
+template <typename T, bool = IsSeparateErrorOr<T>::value>
+class ErrorOrStorage {
+ protected:
+  explicit ErrorOrStorage(Error &&error) noexcept
+    : error_(std::move(error))
+    , is_error_(true)
+  {
+  }
+
+  template <typename... Args>
+  explicit ErrorOrStorage(InPlace, Args &&...args)
+    : obj_(std::forward<Args>(args)...)
+    , is_error_(false)
+  {
+  }
+
+  ~ErrorOrStorage() { Destroy(); }
+
+  ErrorOrStorage(ErrorOrStorage &&other) noexcept(
+      std::is_nothrow_move_constructible<T>::value)
+    : is_error_(other.is_error_)
+  {
+    if (other.is_error_) {
+      new (&error_) Error(std::move(other.error_));
+    } else {
+      new (&obj_) T(std::move(other.obj_));
+    }
+  }
+
+  ErrorOrStorage &operator=(ErrorOrStorage &&other) noexcept(
+      std::is_nothrow_move_constructible<T>::value &&
+      std::is_nothrow_move_assignable<T>::value)
+  {
+    if (&other == this) return *this;
+
+    if (other.is_error_ == is_error_) {
+      if (is_error_) {
+        error_ = std::move(other.error_);
+      } else {
+        obj_ = std::move(other.obj_);
       }
     } else {
-      is_error_ = !other.is_error_;
+      Destroy();
+      is_error_ = other.is_error_;
       if (other.is_error_) {
-        error_ = other.error_;
+        new (&error_) Error(std::move(other.error_));
       } else {
-        obj_ = other.obj;
+        ConstructObj(std::move(other.obj_));
       }
     }
     return *this;
   }
 
-  ErrorOr &operator=(ErrorOr &&other)
+  bool is_error() const noexcept
+  {
+    return is_error_ && !error_.is_success();
+  }
+
+  void AssignError(Error &&error) noexcept
+  {
+    if (is_error_) {
+      error_ = std::move(error);
+    } else {
+      destroy_(obj_);
+      new (&error_) Error(std::move(error));
+      is_error_ = true;
+    }
+  }
+
+  template <typename... Args>
+  void Emplace(Args &&...args)
+  {
+    Destroy();
+    ConstructObj(std::forward<Args>(args)...);
+  }
+
+  union {
+    Error error_;
+    T obj_;
+  };
+
+ private:
+  void Destroy() noexcept
+  {
+    if (is_error_) {
+      destroy_(error_);
+    } else {
+      destroy_(obj_);
+    }
+  }
+
+  // pre: Nothing is constructed
+  template <typename... Args>
+  void ConstructObj(Args &&...args)
+  {
+    ConstructObjImpl(std::is_nothrow_constructible<T, Args &&...>{},
+                     std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void ConstructObjImpl(std::true_type, Args &&...args) noexcept
+  {
+    new (&obj_) T(std::forward<Args>(args)...);
+    is_error_ = false;
+  }
+
+  template <typename... Args>
+  void ConstructObjImpl(std::false_type, Args &&...args)
+  {
+    try {
+      new (&obj_) T(std::forward<Args>(args)...);
+      is_error_ = false;
+    }
+    catch (...) {
+      // Keep the invariant, this is a success but has no object
+      new (&error_) Error();
+      is_error_ = true;
+      throw;
+    }
+  }
+
+  bool is_error_;
+};
+
+/**
+ * The object is beside the Error, which is a success if this holds the
+ * object. The special members are defaulted, i.e. as trivial as Error's.
+ */
+template <typename T>
+class KERROR_ERROR_ABI ErrorOrStorage<T, true> {
+ protected:
+  explicit ErrorOrStorage(Error &&error) noexcept
+    : error_(std::move(error))
+    , obj_()
+  {
+  }
+
+  template <typename... Args>
+  explicit ErrorOrStorage(InPlace, Args &&...args)
+    : obj_(std::forward<Args>(args)...)
+  {
+  }
+
+  ErrorOrStorage(ErrorOrStorage &&) = default;
+  ErrorOrStorage &operator=(ErrorOrStorage &&) = default;
+
+  bool is_error() const noexcept { return error_.is_error(); }
+
+  void AssignError(Error &&error) noexcept { error_ = std::move(error); }
+
+  template <typename... Args>
+  void Emplace(Args &&...args)
+  {
+    obj_ = T(std::forward<Args>(args)...);
+    error_ = Error();
+  }
+
+  Error error_;
+  T obj_;
+};
+
+} // namespace detail
+
+/**
+ * The object of T or the Error
+ * It is stored as detail::ErrorOrStorage<T>, the special members are
+ * trivial(for calls) if the ones of T and Error are.
+ */
+template <typename T>
+struct KERROR_ERROR_ABI ErrorOr : private detail::ErrorOrStorage<T> {
+ private:
+  using Storage = detail::ErrorOrStorage<T>;
+  using Storage::error_;
+  using Storage::obj_;
+
+ public:
+  ErrorOr(Error &&error) noexcept
+    : Storage(std::move(error))
+  {
+  }
+
+  ErrorOr(T &&obj) noexcept(std::is_nothrow_move_constructible<T>::value)
+    : Storage(kInPlace, std::move(obj))
+  {
+  }
+
+  ErrorOr(T const &obj)
+    : Storage(kInPlace, obj)
+  {
+  }
+
+  /**
+   * Construct the object in place, no move is required.
+   * e.g.
+   * \code
+   *   ErrorOr<A> Create() {
+   *     Error err;
+   *     ErrorOr<A> res(kInPlace, &err);
+   *     if (err) res = std::move(err);
+   *     return res; // NRVO
+   *   }
+   * \endcode
+   */
+  template <typename... Args>
+  explicit ErrorOr(InPlace, Args &&...args)
+    : Storage(kInPlace, std::forward<Args>(args)...)
+  {
+  }
+
+  ErrorOr(ErrorOr &&) = default;
+  ErrorOr &operator=(ErrorOr &&) = default;
+
+  ErrorOr(ErrorOr const &) = delete;
+  ErrorOr &operator=(ErrorOr const &) = delete;
+
+  /**
+   * Replace the object or error with \p error
+   */
+  ErrorOr &operator=(Error &&error) noexcept
+  {
+    this->AssignError(std::move(error));
+    return *this;
+  }
+
+  /**
+   * Replace the object or error with the object constructed in place
+   * \warning The error must be checked
+   */
+  template <typename... Args>
+  T &emplace(Args &&...args)
+  {
+    this->Emplace(std::forward<Args>(args)...);
+    return obj_;
+  }
+
+  operator bool() const noexcept { return this->is_error(); }
+
+  IErrorInfo *info() const noexcept { return error_.info(); }
+
+  T &operator*() noexcept { return obj_; }
+  T const &operator*() const noexcept { return obj_; }
+
+  T *operator->() noexcept { return &obj_; }
+  T const *operator->() const noexcept { return &obj_; }
+
+  Error const &error() const noexcept { return error_; }
+  Error &error() noexcept { return error_; }
+};
+
+/**
+ * The Error is a success if this holds a pointer, like the other small
+ * trivially copyable T(see detail::IsSeparateErrorOr).
+ *
+ * This is sizeof(Error) plus a pointer, i.e. 64 bytes with the default
+ * inline buffer. It is returned in registers only if both hold:
+ * - KERROR_COMPACT_ERROR(or KERROR_INLINE_INFO_SIZE is 0), then this is
+ *   two words
+ * - KERROR_TRIVIAL_ABI is supported(clang only), since the destructor is
+ *   not trivial
+ * Otherwise it is returned through memory like ErrorOr<T>.
+ */
+template <typename T>
+struct KERROR_ERROR_ABI ErrorOr<T *> {
+ public:
+  ErrorOr(Error error) noexcept
+    : error_(std::move(error))
+    , obj_(nullptr)
+  {
+  }
+
+  ErrorOr(T *obj) noexcept
+    : obj_(obj)
+  {
+  }
+
+  ErrorOr(ErrorOr &&other) noexcept
+    : error_(std::move(other.error_))
+    , obj_(other.obj_)
+  {
+  }
+
+  ErrorOr &operator=(ErrorOr &&other) noexcept
+  {
+    error_ = std::move(other.error_);
+    obj_ = other.obj_;
+    return *this;
+  }
+
+  ErrorOr(ErrorOr const &) = delete;
+  ErrorOr &operator=(ErrorOr const &) = delete;
+
+  operator bool() const noexcept { return error_.is_error(); }
+
+  IErrorInfo *info() const noexcept { return error_.info(); }
+
+  T *&operator*() noexcept { return obj_; }
+  T *const &operator*() const noexcept { return obj_; }
+
+  T **operator->() noexcept { return &obj_; }
+  T *const *operator->() const noexcept { return &obj_; }
+
+  Error const &error() const noexcept { return error_; }
+  Error &error() noexcept { return error_; }
+
+ private:
+  Error error_;
+  T *obj_;
+};
+
+/**
+ * The reference is stored as a pointer
+ */
+template <typename T>
+struct KERROR_ERROR_ABI ErrorOr<T &> {
+ public:
+  ErrorOr(Error error) noexcept
+    : impl_(std::move(error))
   {
-    if (&other == this) return *this;
+  }
 
-    if (other.is_error_ == is_error_) {
-      if (is_error_) {
-        error_ = std::move(other.error_);
-      } else {
-        obj_ = std::move(other.obj_);
-      }
-    } else {
-      is_error_ = !other.is_error_;
-      if (other.is_error_) {
-        error_ = std::move(other.error_);
-      } else {
-        obj_ = std::move(other.obj);
-      }
-    }
-    return *this;
+  ErrorOr(T &obj) noexcept
+    : impl_(&obj)
+  {
   }
 
-  operator bool() const noexcept { return is_error_ && !error_.is_success(); }
+  operator bool() const noexcept { return static_cast<bool>(impl_); }
 
-  IErrorInfo *info() const noexcept { return error_.info(); }
+  IErrorInfo *info() const noexcept { return impl_.info(); }
 
-  T &operator*() noexcept { return obj_; }
+  T &operator*() const noexcept { return **impl_; }
+  T *operator->() const noexcept { return *impl_; }
+
+  Error const &error() const noexcept { return impl_.error(); }
+  Error &error() noexcept { return impl_.error(); }
+
+ private:
+  ErrorOr<T *> impl_;
+};
+
+/**
+ * Same as Error, only for generic code(e.g. ErrorOr<decltype(f())>)
+ */
+template <>
+struct KERROR_ERROR_ABI ErrorOr<void> {
+ public:
+  ErrorOr() noexcept = default;
 
-  T const &operator*() const noexcept
+  ErrorOr(Error error) noexcept
+    : error_(std::move(error))
   {
-    return *const_cast<ErrorOr<T> *>(this);
   }
 
-  T *operator->() noexcept { return &obj_; }
-  T const *operator->() const noexcept { return &obj_; }
+  operator bool() const noexcept { return error_.is_error(); }
+
+  IErrorInfo *info() const noexcept { return error_.info(); }
 
   Error const &error() const noexcept { return error_; }
   Error &error() noexcept { return error_; }
 
  private:
-  union {
-    Error error_;
-    T obj_;
-  };
+  Error error_;
+};
 
-  bool is_error_;
+/**
+ * \brief Return the error to the caller if \p expr is an error
+ *
+ * \Param expr Expression of Error or ErrorOr<void>
+ * The function must return Error or ErrorOr<U>.
+ */
+#define KERROR_TRY(expr)                                                       \
+  do {                                                                         \
+    auto kerror_try_error_ = (expr);                                           \
+    if (KERROR_UNLIKELY(kerror_try_error_)) {                                  \
+      return ::kerror::detail::TakeError(kerror_try_error_);                   \
+    }                                                                          \
+  } while (0)
+
+/**
+ * \brief Move the object of ErrorOr<T> to \p lhs or return the error to the
+ *        caller
+ *
+ * e.g.
+ * \code
+ *   KERROR_ASSIGN_OR_RETURN(auto file, OpenFile(path));
+ *   KERROR_ASSIGN_OR_RETURN(size, file.Size());
+ * \endcode
+ *
+ * \warning
+ *   This is expanded to multiple statements, don't use it in if-else
+ *   without braces
+ */
+#define KERROR_ASSIGN_OR_RETURN(lhs, expr)                                     \
+  KERROR_ASSIGN_OR_RETURN_IMPL_(KERROR_UNIQUE_NAME(kerror_result_), lhs, expr)
+
+#define KERROR_ASSIGN_OR_RETURN_IMPL_(result, lhs, expr)                       \
+  auto result = (expr);                                                        \
+  if (KERROR_UNLIKELY(result)) {                                               \
+    return std::move(result.error());                                          \
+  }                                                                            \
+  lhs = ::kerror::detail::TakeValue(result)
+
+namespace detail {
+
+KERROR_INLINE Error &&TakeError(Error &error) noexcept
+{
+  return std::move(error);
+}
+
+template <typename T>
+KERROR_INLINE Error &&TakeError(ErrorOr<T> &result) noexcept
+{
+  return std::move(result.error());
+}
+
+template <typename T>
+KERROR_INLINE T &&TakeValue(ErrorOr<T> &result) noexcept
+{
+  return std::move(*result);
+}
+
+/**
+ * The referent is owned by others, don't move from it
+ */
+template <typename T>
+KERROR_INLINE T &TakeValue(ErrorOr<T &> &result) noexcept
+{
+  return *result;
+}
+
+} // namespace detail
+
+namespace detail {
+
+/**
+ * Deduce the info type from the parameter of handler,
+ * the handler can be a function(pointer) or a non-generic lambda.
+ */
+template <typename F>
+struct HandlerTraits : HandlerTraits<decltype(&F::operator())> {
+};
+
+template <typename R, typename A>
+struct HandlerTraits<R (*)(A)> {
+  static_assert(std::is_lvalue_reference<A>::value,
+                "The handler must accept the info by reference");
+  using Info = typename std::remove_cv<
+      typename std::remove_reference<A>::type>::type;
+};
+
+template <typename R, typename A>
+struct HandlerTraits<R(A)> : HandlerTraits<R (*)(A)> {
+};
+
+template <typename C, typename R, typename A>
+struct HandlerTraits<R (C::*)(A)> : HandlerTraits<R (*)(A)> {
+};
+
+template <typename C, typename R, typename A>
+struct HandlerTraits<R (C::*)(A) const> : HandlerTraits<R (*)(A)> {
+};
+
+// The handler returns void: the error is handled.
+template <typename H, typename T>
+Error InvokeHandler(std::true_type, H &handler, T &info)
+{
+  handler(info);
+  return MakeSuccess();
+}
+
+// The handler returns Error: the error is replaced with it.
+template <typename H, typename T>
+Error InvokeHandler(std::false_type, H &handler, T &info)
+{
+  return handler(info);
+}
+
+KERROR_INLINE Error HandleErrorsImpl(Error &err, IErrorInfo *)
+{
+  return std::move(err);
+}
+
+template <typename H, typename... Hs>
+Error HandleErrorsImpl(Error &err, IErrorInfo *info, H &&handler,
+                       Hs &&...handlers)
+{
+  using Info = typename HandlerTraits<typename std::decay<H>::type>::Info;
+  static_assert(std::is_base_of<IErrorInfo, Info>::value,
+                "The handler must accept a class derived from IErrorInfo");
+
+  if (auto p = DynCast<Info>(info)) {
+    using Result = decltype(handler(*p));
+    return InvokeHandler(std::is_void<Result>{}, handler, *p);
+  }
+  return HandleErrorsImpl(err, info, std::forward<Hs>(handlers)...);
+}
+
+} // namespace detail
+
+/**
+ * \brief Dispatch the error info to the first handler accepting its type
+ *
+ * e.g.
+ * \code
+ *   auto rest = HandleErrors(
+ *       std::move(err),
+ *       [](CodeErrorInfo const &info) { ... },
+ *       [](MsgErrorInfo const &info) -> Error { return ...; });
+ * \endcode
+ * The candidates are tried in order, each is a IsA<T>() check, no RTTI
+ * and string comparison. Use IErrorInfo const& to handle all infos.
+ *
+ * \Param handlers Return void if the error is handled, or return Error
+ *                 to replace the error
+ * \return
+ *   Success if the error is handled or \p err is a success
+ *   The error returned by the handler
+ *   \p err if no handler accepts it(including the no info error)
+ */
+template <typename... Handlers>
+Error HandleErrors(Error err, Handlers &&...handlers)
+{
+  if (!err) return err;
+  auto info = err.info();
+  if (!info) return err;
+  return detail::HandleErrorsImpl(err, info,
+                                  std::forward<Handlers>(handlers)...);
+}
+
+/**
+ * Destination of the reports of Panic(), PError(), etc.
+ * Each Write() is a complete report(one or more lines).
+ *
+ * The default sink writes to stderr by write(2), see SetReportSink().
+ */
+class ReportSink {
+ public:
+  ReportSink() = default;
+  virtual ~ReportSink() = default;
+
+  ReportSink(ReportSink const &) = delete;
+  ReportSink &operator=(ReportSink const &) = delete;
+
+  /**
+   * Called by the reporting threads concurrently(maybe in signal handler),
+   * so it must be thread-safe and should not block.
+   */
+  virtual void Write(char const *data, size_t n) noexcept = 0;
+
+  /**
+   * Wait for the written reports to be emitted.
+   * Called by Panic() before abort.
+   */
+  virtual void Flush() noexcept {}
 };
 
+/**
+ * \return
+ *   The sink that writes to stderr by write(2) directly
+ */
+ReportSink &StderrSink() noexcept;
+
+/**
+ * Replace the report sink.
+ *
+ * \Param sink nullptr to restore StderrSink()
+ *             It must outlive its use
+ * \return
+ *   The previous sink
+ */
+ReportSink *SetReportSink(ReportSink *sink) noexcept;
+
+ReportSink &GetReportSink() noexcept;
+
+/*
+ * The reporting functions below format the report into a preallocated
+ * static buffer(a buffer on the stack if it is being used by another
+ * thread) and emit it by a single ReportSink::Write(), the default sink
+ * writes it by a single write(2) to stderr, so the reports are not
+ * interleaved, and don't lock or allocate.
+ *
+ * Panic(), PError() and PErrorSys() are async-signal-safe if the info
+ * writes the message without allocation(e.g. the built-in infos with
+ * static messages), then they can be called in the SIGSEGV handler.
+ * The functions with the format string use vsnprintf(), which is not
+ * guaranteed to be async-signal-safe.
+ *
+ * The report longer than the buffer(4096 bytes, 512 bytes on the stack) is
+ * written by several ReportSink::Write() in chunks, so it may be
+ * interleaved. The output of the format string longer than the buffer is
+ * truncated and marked by "...(truncated)", since vsnprintf() can't resume.
+ */
+
 /**
  * \brief Print a message to stderr and abort program
  *
@@ -359,7 +2704,7 @@ struct ErrorOr {
  *
  * \Param msg A descrition for fatal error
  */
-void Panic(char const *msg) noexcept;
+[[noreturn]] KERROR_COLD void Panic(char const *msg) noexcept;
 
 /**
  * \brief Like Panic() but support C style format string
@@ -367,23 +2712,299 @@ void Panic(char const *msg) noexcept;
  * \Param fmt A string contains formatted sign
  * \Param ... Arguments to fill the @p fmt
  */
-void Panicf(char const *fmt, ...) noexcept;
+[[noreturn]] KERROR_COLD void Panicf(char const *fmt, ...) noexcept;
 
-void PError(char const *prefix, Error const &err) noexcept;
+/**
+ * Print \p prefix and the full message of \p err
+ */
+KERROR_COLD void PError(char const *prefix, Error const &err) noexcept;
 
 KERROR_INLINE void PError(Error const &err) noexcept { PError("Reason", err); }
 
-void PErrorSys(char const *prefix, char const *sys_prefix,
-               Error const &err) noexcept;
+KERROR_COLD void PErrorSys(char const *prefix, char const *sys_prefix,
+                             Error const &err) noexcept;
 
 KERROR_INLINE void PErrorSys(Error const &err) noexcept
 {
   PErrorSys("Reason", "SysReason", err);
 }
 
-void PSysError(char const *msg) noexcept;
-void PSysErrorf(char const *fmt, ...) noexcept;
+KERROR_COLD void PSysError(char const *msg) noexcept;
+KERROR_COLD void PSysErrorf(char const *fmt, ...) noexcept;
+
+/**
+ * \brief Rate limit of the reports
+ *
+ * A token bucket of \p burst tokens refilled by \p per_second tokens per
+ * second, implemented as GCRA(the time when the bucket is full again is
+ * stored instead of the tokens), so the state is a single atomic word.
+ *
+ * A suppressed report only reads the coarse clock and increments the
+ * counter, then the count is summarized by the next allowed report.
+ * The constructor is constexpr, so the static limiter of a call site is
+ * constant initialized(no guard), see SiteReportLimiter.
+ */
+class ReportLimiter {
+ public:
+  constexpr ReportLimiter(uint32_t per_second, uint32_t burst) noexcept
+    : interval_(kNanosPerSecond / (per_second ? per_second : 1))
+    , tolerance_((burst ? burst - 1 : 0) *
+                 (kNanosPerSecond / (per_second ? per_second : 1)))
+  {
+  }
+
+  ReportLimiter(ReportLimiter const &) = delete;
+  ReportLimiter &operator=(ReportLimiter const &) = delete;
+
+  /**
+   * \return
+   *   true if a token is taken, otherwise the report is counted as
+   *   suppressed
+   */
+  bool Acquire() noexcept { return Acquire(NowNanos()); }
+
+  /**
+   * \Param now_ns The monotonic time in nanoseconds
+   */
+  bool Acquire(uint64_t now_ns) noexcept { return Acquire(bucket_, now_ns); }
+
+  /**
+   * \return
+   *   The number of the suppressed reports since the last call
+   */
+  uint64_t TakeSuppressed() noexcept { return bucket_.TakeSuppressed(); }
+
+ private:
+  friend class SiteReportLimiter;
+
+  static constexpr uint64_t kNanosPerSecond = 1000000000;
+
+  /**
+   * The state of a bucket, the rate is given by the limiter
+   */
+  struct Bucket {
+    uint64_t TakeSuppressed() noexcept
+    {
+      return suppressed.exchange(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> full_at{0};
+    std::atomic<uint64_t> suppressed{0};
+  };
+
+  static uint64_t NowNanos() noexcept;
+
+  bool Acquire(Bucket &bucket, uint64_t now_ns) const noexcept
+  {
+    auto full_at = bucket.full_at.load(std::memory_order_relaxed);
+    for (;;) {
+      auto const base = full_at > now_ns ? full_at : now_ns;
+      if (base - now_ns > tolerance_) {
+        bucket.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      if (bucket.full_at.compare_exchange_weak(full_at, base + interval_,
+                                               std::memory_order_relaxed))
+      {
+        return true;
+      }
+    }
+  }
+
+  uint64_t interval_;
+  uint64_t tolerance_;
+  Bucket bucket_;
+};
+
+/**
+ * \return
+ *   The kind of \p err, i.e. the category and the code of an error code,
+ *   or the dynamic type of the info(IErrorInfo::GetClassId()), never 0.
+ *   Different kinds rarely have the same value, which only merges their
+ *   rate limits.
+ */
+uintptr_t GetErrorKind(Error const &err) noexcept;
+
+/**
+ * \brief Rate limit of the reports of a call site per error kind
+ *
+ * Each kind(see GetErrorKind()) of the site has its own bucket of
+ * ReportLimiter(per_second, burst), so a noisy kind doesn't suppress the
+ * other kinds. The buckets of the first kMaxKinds kinds are claimed in a
+ * lock-free open addressing table, the later kinds share an extra bucket.
+ */
+class SiteReportLimiter {
+ public:
+  static constexpr size_t kMaxKinds = 8;
+
+  constexpr SiteReportLimiter(uint32_t per_second, uint32_t burst) noexcept
+    : limiter_(per_second, burst)
+  {
+  }
+
+  SiteReportLimiter(SiteReportLimiter const &) = delete;
+  SiteReportLimiter &operator=(SiteReportLimiter const &) = delete;
+
+  /**
+   * \Param kind Non-zero, see GetErrorKind()
+   * \return
+   *   true if a token of \p kind is taken, otherwise the report is counted
+   *   as suppressed
+   */
+  bool Acquire(uintptr_t kind) noexcept
+  {
+    return Acquire(kind, ReportLimiter::NowNanos());
+  }
+
+  /**
+   * \Param now_ns The monotonic time in nanoseconds
+   */
+  bool Acquire(uintptr_t kind, uint64_t now_ns) noexcept
+  {
+    return limiter_.Acquire(GetBucket(kind), now_ns);
+  }
+
+  /**
+   * \return
+   *   The number of the suppressed reports of \p kind since the last call
+   */
+  uint64_t TakeSuppressed(uintptr_t kind) noexcept
+  {
+    return GetBucket(kind).TakeSuppressed();
+  }
+
+ private:
+  static constexpr int kKindBits = 3;
+  static_assert(kMaxKinds == 1 << kKindBits, "kMaxKinds is a power of 2");
+
+  struct Slot {
+    std::atomic<uintptr_t> kind{0};
+    ReportLimiter::Bucket bucket;
+  };
+
+  ReportLimiter::Bucket &GetBucket(uintptr_t kind) noexcept
+  {
+    // Fibonacci hashing, the low bits of the addresses are mostly zero
+    auto const start = static_cast<size_t>(
+        (static_cast<uint64_t>(kind) * 0x9E3779B97F4A7C15ull) >>
+        (64 - kKindBits));
+    for (size_t i = 0; i < kMaxKinds; ++i) {
+      auto &slot = slots_[(start + i) % kMaxKinds];
+      auto slot_kind = slot.kind.load(std::memory_order_relaxed);
+      if (slot_kind == 0) {
+        // Lost the race if another kind claims it
+        slot.kind.compare_exchange_strong(slot_kind, kind,
+                                          std::memory_order_relaxed);
+        if (slot_kind == 0) return slot.bucket;
+      }
+      if (slot_kind == kind) return slot.bucket;
+    }
+    return limiter_.bucket_;
+  }
+
+  ReportLimiter limiter_;
+  Slot slots_[kMaxKinds];
+};
+
+/**
+ * \brief Per-site sampling of the expensive parts of creating errors
+ *
+ * The errors of a site failing at high frequency are created in full
+ * (formatted message, context, backtrace, etc.) only if they are sampled,
+ * the others degrade to the cheap representation, e.g. the static message
+ * or the error code, see KERROR_SAMPLED().
+ */
+class ErrorSampler {
+ public:
+  enum Policy {
+    // One of every n errors, the first is sampled
+    kOneIn,
+    // At most n errors per second(in bursts of n at most)
+    kPerSecond,
+  };
+
+  constexpr ErrorSampler(Policy policy, uint32_t n) noexcept
+    : policy_(policy)
+    , n_(n ? n : 1)
+    , count_(0)
+    , limiter_(n, n)
+  {
+  }
+
+  ErrorSampler(ErrorSampler const &) = delete;
+  ErrorSampler &operator=(ErrorSampler const &) = delete;
+
+  bool Sample() noexcept
+  {
+    if (policy_ == kOneIn) {
+      return count_.fetch_add(1, std::memory_order_relaxed) % n_ == 0;
+    }
+    return limiter_.Acquire();
+  }
+
+ private:
+  Policy policy_;
+  uint32_t n_;
+  std::atomic<uint32_t> count_;
+  ReportLimiter limiter_;
+};
+
+/**
+ * PError() if \p limiter allows it, the suppressed reports before are
+ * summarized in an extra line of the report:
+ *   (Suppressed 42 similar reports)
+ * \p err is marked as checked even if the report is suppressed.
+ */
+KERROR_COLD void PError(ReportLimiter &limiter, char const *prefix,
+                        Error const &err) noexcept;
+
+/**
+ * PError() if \p limiter allows the kind of \p err, the suppressed
+ * reports are summarized per kind like the above.
+ */
+KERROR_COLD void PError(SiteReportLimiter &limiter, char const *prefix,
+                        Error const &err) noexcept;
 
 } // namespace kerror
 
+/**
+ * \brief PError() at most \p burst times in a burst and \p per_second
+ *        times per second in the long run for each error kind of this
+ *        call site
+ */
+#define KERROR_PERROR_LIMITED(per_second, burst, prefix, err)                  \
+  do {                                                                         \
+    static ::kerror::SiteReportLimiter kerror_limiter_((per_second), (burst)); \
+    ::kerror::PError(kerror_limiter_, (prefix), (err));                        \
+  } while (0)
+
+/**
+ * \return
+ *   true if this error of the call site is sampled by
+ *   ErrorSampler(ErrorSampler::policy, n), they must be constants.
+ *   e.g.
+ *   if (KERROR_SAMPLED(kOneIn, 100)) err.AddContextf("offset %zu", offset);
+ */
+#define KERROR_SAMPLED(policy, n)                                              \
+  ([]() -> ::kerror::ErrorSampler & {                                          \
+    static ::kerror::ErrorSampler kerror_sampler_(                             \
+        ::kerror::ErrorSampler::policy, (n));                                  \
+    return kerror_sampler_;                                                    \
+  }()                                                                          \
+       .Sample())
+
+/**
+ * MakeLazyMsgErrorf(fmt, ...) if sampled, otherwise the arguments are not
+ * evaluated or captured, and the message is the raw format string marked by
+ * " [args not sampled]" so that it isn't mistaken for a formatted message.
+ * Both are the same LazyMsgErrorInfo<...>, so IsA<>(), HandleErrors() and
+ * GetErrorKind() don't depend on the sampling.
+ */
+#define KERROR_SAMPLED_ERRORF(policy, n, ...)                                  \
+  (KERROR_SAMPLED(policy, n)                                                   \
+       ? ::kerror::MakeLazyMsgErrorf(__VA_ARGS__)                              \
+       : ::kerror::detail::MakeNotSampledError<decltype(                       \
+             ::kerror::detail::LazyMsgInfoOf(__VA_ARGS__))>(                   \
+             KERROR_FIRST(__VA_ARGS__)))
+
 #endif
@@ -2,6 +2,8 @@
 #ifndef _KERROR_MACRO_H__
 #define _KERROR_MACRO_H__
 
+#include <cstdint>
+
 #if defined(__GNUC__) || defined(__clang__)
 #define KERROR_LIKELY(cond) __builtin_expect(!!(cond), 1)
 #define KERROR_UNLIKELY(cond) __builtin_expect(!!(cond), 0)
@@ -20,4 +22,82 @@
 
 #define KERROR_INLINE inline KERROR_ALWAYS_INLINE
 
+/**
+ * The error paths are rarely executed, put them out of the hot code
+ * to reduce the I-cache footprint of the caller.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define KERROR_NOINLINE __attribute__((noinline))
+#define KERROR_COLD __attribute__((cold))
+#elif defined(_MSC_VER)
+#define KERROR_NOINLINE __declspec(noinline)
+#define KERROR_COLD
+#else
+#define KERROR_NOINLINE
+#define KERROR_COLD
+#endif
+
+/**
+ * Allow the class with non-trivial destructor or move constructor to be
+ * passed in registers(Only supported by clang).
+ */
+#if defined(__clang__) && defined(__has_cpp_attribute)
+#  if __has_cpp_attribute(clang::trivial_abi)
+#    define KERROR_TRIVIAL_ABI [[clang::trivial_abi]]
+#  endif
+#endif
+#ifndef KERROR_TRIVIAL_ABI
+#  define KERROR_TRIVIAL_ABI
+#endif
+
+#define KERROR_CONCAT_(x, y) x##y
+#define KERROR_CONCAT(x, y)  KERROR_CONCAT_(x, y)
+
+// The unique name in the translation unit, __LINE__ is not unique if the
+// macro is used twice in a line(e.g. expanded by another macro)
+#ifdef __COUNTER__
+#  define KERROR_UNIQUE_NAME(prefix) KERROR_CONCAT(prefix, __COUNTER__)
+#else
+#  define KERROR_UNIQUE_NAME(prefix) KERROR_CONCAT(prefix, __LINE__)
+#endif
+
+// The first of the variadic arguments, which must not be empty
+#define KERROR_FIRST_(first, ...) first
+#define KERROR_FIRST(...)         KERROR_FIRST_(__VA_ARGS__, 0)
+
+// std::is_final is provided since C++14,
+// but the builtin is supported by all major compilers.
+#define KERROR_IS_FINAL(T) __is_final(T)
+
+/**
+ * If KERROR_FORCE_CHECK is 0, the forced error check of Error is removed
+ * (including its state), it is the default if NDEBUG is defined.
+ *
+ * \warning
+ *   All translation units must agree on it.
+ */
+#ifndef KERROR_FORCE_CHECK
+#  ifdef NDEBUG
+#    define KERROR_FORCE_CHECK 0
+#  else
+#    define KERROR_FORCE_CHECK 1
+#  endif
+#endif
+
+// Error code can be stored in Error with the pointer size word
+#if UINTPTR_MAX > 0xffffffffu
+#  define KERROR_PACK_ERROR_CODE 1
+#else
+#  define KERROR_PACK_ERROR_CODE 0
+#endif
+
+#if defined(__has_include)
+#  if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#    define KERROR_HAS_PMR 1
+#  endif
+#endif
+#ifndef KERROR_HAS_PMR
+#  define KERROR_HAS_PMR 0
+#endif
+
 #endif
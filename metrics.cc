@@ -0,0 +1,210 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "metrics.h"
+
+using namespace kerror;
+
+namespace {
+
+constexpr uint32_t kChunkSize = 256;
+constexpr uint32_t kMaxChunks = 64;
+constexpr uint32_t kMaxSites = kChunkSize * kMaxChunks;
+
+/**
+ * The counters of kChunkSize sites in a shard, allocated in the first use
+ */
+struct Chunk {
+  std::atomic<uint64_t> counts[kChunkSize][ErrorSite::kNumCounters];
+};
+
+/**
+ * The counters of a thread, only written by the owner thread.
+ * The shard is reused by other threads after the owner exits, instead of
+ * being freed, then the counts of the exited threads are not lost.
+ */
+struct Shard {
+  std::atomic<Chunk *> chunks[kMaxChunks];
+  std::atomic<bool> in_use;
+  Shard *next;
+};
+
+std::atomic<ErrorSite *> g_sites{nullptr};
+std::atomic<uint32_t> g_site_count{0};
+std::atomic<Shard *> g_shards{nullptr};
+
+// Trivial, so it is accessed without the TLS wrapper
+thread_local Shard *t_shard = nullptr;
+
+struct ShardReleaser {
+  ~ShardReleaser() noexcept
+  {
+    t_shard->in_use.store(false, std::memory_order_release);
+    // If error is counted in the destructors of thread_local variables
+    // destroyed later, a shard is acquired and never released, it is fine.
+    t_shard = nullptr;
+  }
+};
+
+KERROR_COLD KERROR_NOINLINE Shard *AcquireShard() noexcept
+{
+  Shard *shard = nullptr;
+  for (auto p = g_shards.load(std::memory_order_acquire); p; p = p->next) {
+    bool expected = false;
+    if (p->in_use.compare_exchange_strong(expected, true,
+                                          std::memory_order_acquire))
+    {
+      shard = p;
+      break;
+    }
+  }
+
+  if (!shard) {
+    shard = new (std::nothrow) Shard();
+    if (!shard) return nullptr;
+    shard->in_use.store(true, std::memory_order_relaxed);
+    shard->next = g_shards.load(std::memory_order_relaxed);
+    while (!g_shards.compare_exchange_weak(shard->next, shard,
+                                           std::memory_order_release))
+    {
+    }
+  }
+
+  t_shard = shard;
+  static thread_local ShardReleaser releaser;
+  (void)releaser;
+  return shard;
+}
+
+KERROR_COLD KERROR_NOINLINE Chunk *AllocateChunk(std::atomic<Chunk *> &slot)
+{
+  auto chunk = new (std::nothrow) Chunk();
+  // Published to SnapshotSiteMetrics()
+  slot.store(chunk, std::memory_order_release);
+  return chunk;
+}
+
+/**
+ * Escape the label value of the Prometheus text format
+ */
+void WriteLabel(MessageSink &sink, char const *name, char const *value)
+{
+  sink.Write(name, strlen(name));
+  sink.Write("=\"", 2);
+  for (auto p = value; *p; ++p) {
+    switch (*p) {
+      case '\\':
+        sink.Write("\\\\", 2);
+        break;
+      case '"':
+        sink.Write("\\\"", 2);
+        break;
+      case '\n':
+        sink.Write("\\n", 2);
+        break;
+      default:
+        sink.Write(p, 1);
+    }
+  }
+  sink.Write("\"", 1);
+}
+
+} // namespace
+
+kerror::ErrorSite::ErrorSite(char const *file, int line,
+                             char const *function) noexcept
+  : file_(file)
+  , function_(function)
+  , line_(line)
+  , id_(g_site_count.fetch_add(1, std::memory_order_relaxed))
+  , next_(g_sites.load(std::memory_order_relaxed))
+{
+  while (!g_sites.compare_exchange_weak(next_, this,
+                                        std::memory_order_release))
+  {
+  }
+}
+
+void kerror::ErrorSite::Count(Counter counter) noexcept
+{
+  if (KERROR_UNLIKELY(id_ >= kMaxSites)) return;
+
+  auto shard = t_shard;
+  if (KERROR_UNLIKELY(!shard)) {
+    shard = AcquireShard();
+    if (!shard) return;
+  }
+
+  auto &slot = shard->chunks[id_ / kChunkSize];
+  // Only this thread writes the slot
+  auto chunk = slot.load(std::memory_order_relaxed);
+  if (KERROR_UNLIKELY(!chunk)) {
+    chunk = AllocateChunk(slot);
+    if (!chunk) return;
+  }
+
+  // Single writer, no read-modify-write is required
+  auto &count = chunk->counts[id_ % kChunkSize][counter];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+}
+
+auto kerror::SnapshotSiteMetrics() -> std::vector<SiteMetrics>
+{
+  auto const sites = g_sites.load(std::memory_order_acquire);
+  auto const count = g_site_count.load(std::memory_order_relaxed);
+  auto const n = count < kMaxSites ? count : kMaxSites;
+  std::vector<SiteMetrics> metrics(n, SiteMetrics{});
+  for (ErrorSite const *site = sites; site; site = site->next()) {
+    if (site->id() < n) metrics[site->id()].site = site;
+  }
+
+  for (auto shard = g_shards.load(std::memory_order_acquire); shard;
+       shard = shard->next)
+  {
+    for (uint32_t i = 0; i * kChunkSize < n; ++i) {
+      auto chunk = shard->chunks[i].load(std::memory_order_acquire);
+      if (!chunk) continue;
+      for (uint32_t j = 0; j < kChunkSize && i * kChunkSize + j < n; ++j) {
+        auto &counts = metrics[i * kChunkSize + j].counts;
+        for (int k = 0; k < ErrorSite::kNumCounters; ++k) {
+          counts[k] += chunk->counts[j][k].load(std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  // The sites being registered are not linked yet
+  size_t size = 0;
+  for (auto const &m : metrics) {
+    if (m.site) metrics[size++] = m;
+  }
+  metrics.resize(size);
+  return metrics;
+}
+
+void kerror::WriteSiteMetrics(MessageSink &sink)
+{
+  static char const *const kNames[ErrorSite::kNumCounters] = {
+      "kerror_errors_total",
+      "kerror_allocated_infos_total",
+  };
+
+  auto const metrics = SnapshotSiteMetrics();
+  for (int k = 0; k < ErrorSite::kNumCounters; ++k) {
+    auto const name = StringSlice(kNames[k]);
+    sink.Write("# TYPE ", 7);
+    sink.Write(name.data(), name.size());
+    sink.Write(" counter\n", 9);
+    for (auto const &m : metrics) {
+      sink.Write(name.data(), name.size());
+      sink.Write("{", 1);
+      WriteLabel(sink, "file", m.site->file());
+      sink.Write(",", 1);
+      auto const line = std::to_string(m.site->line());
+      WriteLabel(sink, "line", line.c_str());
+      sink.Write(",", 1);
+      WriteLabel(sink, "function", m.site->function());
+      auto const count = "} " + std::to_string(m.counts[k]) + "\n";
+      sink.Write(count.data(), count.size());
+    }
+  }
+}
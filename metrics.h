@@ -0,0 +1,123 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Per-call-site error metrics.
+//
+// The errors created by KERROR_SITE_ERROR() are counted for the call site
+// (file, line and function), then the hot sites can be found:
+//   return KERROR_SITE_ERROR(MakeMsgError("Failed to connect"));
+//
+// The counters are sharded per thread, so the counting threads don't share
+// cache lines. The counters are collected by SnapshotSiteMetrics() or
+// written in the Prometheus text format by WriteSiteMetrics().
+
+#ifndef _KERROR_METRICS_H__
+#define _KERROR_METRICS_H__
+
+#include <vector>
+
+#include "kerror.h"
+
+namespace kerror {
+
+/**
+ * A call site registered in its first use, the sites are never unregistered.
+ * Use KERROR_SITE instead of constructing it.
+ */
+class ErrorSite {
+ public:
+  enum Counter {
+    // The errors created
+    kCreated,
+    // The infos allocated out of the Error, see Error::is_allocated()
+    kAllocated,
+    kNumCounters,
+  };
+
+  /**
+   * \Param file, function String literals
+   */
+  ErrorSite(char const *file, int line, char const *function) noexcept;
+
+  ErrorSite(ErrorSite const &) = delete;
+  ErrorSite &operator=(ErrorSite const &) = delete;
+
+  /**
+   * Only touch the counters of the calling thread.
+   * No-op if there are too many sites.
+   */
+  void Count(Counter counter) noexcept;
+
+  char const *file() const noexcept { return file_; }
+  int line() const noexcept { return line_; }
+  char const *function() const noexcept { return function_; }
+
+  /**
+   * Dense id in registration order
+   */
+  uint32_t id() const noexcept { return id_; }
+
+  /**
+   * \return
+   *   The site registered before this, nullptr if this is the first
+   */
+  ErrorSite const *next() const noexcept { return next_; }
+
+ private:
+  char const *file_;
+  char const *function_;
+  int line_;
+  uint32_t id_;
+  ErrorSite *next_;
+};
+
+struct SiteMetrics {
+  ErrorSite const *site;
+  uint64_t counts[ErrorSite::kNumCounters];
+};
+
+/**
+ * \return
+ *   The counters of all sites summed over the threads(including the exited
+ *   ones), ordered by the site id.
+ *   The counters are read concurrently, so they are not a consistent
+ *   snapshot across the sites.
+ */
+std::vector<SiteMetrics> SnapshotSiteMetrics();
+
+/**
+ * Write the snapshot in the Prometheus text format:
+ *   kerror_errors_total{file="a.cc",line="10",function="Read"} 42
+ *   kerror_allocated_infos_total{file="a.cc",line="10",function="Read"} 0
+ */
+void WriteSiteMetrics(MessageSink &sink);
+
+/**
+ * Count \p err for \p site if it is an error
+ */
+KERROR_INLINE Error TrackError(ErrorSite &site, Error err) noexcept
+{
+  if (err.is_error()) {
+    site.Count(ErrorSite::kCreated);
+    if (err.is_allocated()) site.Count(ErrorSite::kAllocated);
+  }
+  return err;
+}
+
+} // namespace kerror
+
+/**
+ * The ErrorSite of the current call site.
+ * __func__ is passed since it is "operator()" in the lambda.
+ */
+#define KERROR_SITE                                                            \
+  ([](char const *kerror_function_) -> ::kerror::ErrorSite & {                 \
+    static ::kerror::ErrorSite site(__FILE__, __LINE__, kerror_function_);     \
+    return site;                                                               \
+  }(__func__))
+
+/**
+ * Evaluate the error expression and count it for the call site
+ */
+#define KERROR_SITE_ERROR(err) ::kerror::TrackError(KERROR_SITE, (err))
+
+#endif
@@ -0,0 +1,81 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "multi_error.h"
+
+using namespace kerror;
+
+void kerror::MultiErrorInfo::WriteMessage(MessageSink &sink) const
+{
+  auto const total = size_ + dropped_;
+  auto const count = std::to_string(total);
+  sink.Write(count.data(), count.size());
+  auto const head = StringSlice(total == 1 ? " error: " : " errors: ");
+  sink.Write(head.data(), head.size());
+  for (size_t i = 0; i < size_; ++i) {
+    if (i > 0) sink.Write("; ", 2);
+    errors_[i].WriteMessage(sink);
+  }
+
+  if (dropped_ > 0) {
+    auto const dropped = std::to_string(dropped_);
+    sink.Write(" (", 2);
+    sink.Write(dropped.data(), dropped.size());
+    auto const tail = StringSlice(dropped_ == 1 ? " more error is dropped)"
+                                                : " more errors are dropped)");
+    sink.Write(tail.data(), tail.size());
+  }
+}
+
+kerror::ErrorList::ErrorList(size_t capacity)
+  : errors_(new Error[capacity])
+  , ready_(new std::atomic<bool>[capacity]())
+  , capacity_(capacity)
+  , next_(0)
+  , dropped_(0)
+{
+}
+
+bool kerror::ErrorList::Append(Error err) noexcept
+{
+  if (!err) return true;
+
+  auto const i = next_.fetch_add(1, std::memory_order_relaxed);
+  if (KERROR_UNLIKELY(i >= capacity_)) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    err.IgnoreCheck();
+    return false;
+  }
+  errors_[i] = std::move(err);
+  // Checked by the reader of the MultiErrorInfo
+  errors_[i].IgnoreCheck();
+  ready_[i].store(true, std::memory_order_release);
+  return true;
+}
+
+auto kerror::ErrorList::ToError() -> Error
+{
+  auto const claimed = next_.load(std::memory_order_acquire);
+  auto size = claimed < capacity_ ? claimed : capacity_;
+  auto dropped = dropped_.load(std::memory_order_relaxed);
+  if (size == 0 && dropped == 0) return MakeSuccess();
+
+  // The slot claimed but not written is counted as dropped
+  size_t n = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (!ready_[i].load(std::memory_order_acquire)) {
+      ++dropped;
+      continue;
+    }
+    if (n != i) {
+      errors_[n] = std::move(errors_[i]);
+      errors_[n].IgnoreCheck();
+    }
+    ++n;
+  }
+
+  auto err = MakeError<MultiErrorInfo>(std::move(errors_), n, dropped);
+  ready_.reset();
+  capacity_ = 0;
+  next_.store(0, std::memory_order_relaxed);
+  dropped_.store(0, std::memory_order_relaxed);
+  return err;
+}
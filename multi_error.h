@@ -0,0 +1,197 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Aggregate the errors of the parallel operations into one Error.
+//
+// The workers append their errors into the preallocated slots of ErrorList
+// concurrently without lock, then the errors are reported as a single Error
+// of MultiErrorInfo:
+//   ErrorList list(shards.size());
+//   ParallelFor(shards, [&](Shard &shard) { list.Append(Process(shard)); });
+//   auto err = list.ToError();
+//   if (auto multi = DynCast<MultiErrorInfo>(err.info())) {
+//     for (auto const &e : *multi) ...
+//   }
+//
+// If only the first error matters, ErrorLatch keeps it and lets the other
+// workers stop early:
+//   ErrorLatch latch;
+//   ParallelFor(shards, [&](Shard &shard) {
+//     while (!latch.cancelled() && shard.HasNext())
+//       if (auto err = Process(shard.Next())) latch.Publish(std::move(err));
+//   });
+//   return latch.Take();
+
+#ifndef _KERROR_MULTI_ERROR_H__
+#define _KERROR_MULTI_ERROR_H__
+
+#include "kerror.h"
+
+namespace kerror {
+
+/**
+ * The errors collected by ErrorList, the message is:
+ *   3 errors: a; b; c (2 more errors are dropped)
+ */
+class MultiErrorInfo : public ErrorInfo<MultiErrorInfo> {
+ public:
+  MultiErrorInfo(std::unique_ptr<Error[]> errors, size_t size,
+                 size_t dropped) noexcept
+    : errors_(std::move(errors))
+    , size_(size)
+    , dropped_(dropped)
+  {
+  }
+
+  std::string GetMessage() const override
+  {
+    StringSink sink;
+    WriteMessage(sink);
+    return sink.str();
+  }
+
+  void WriteMessage(MessageSink &sink) const override;
+
+  Error const *begin() const noexcept { return errors_.get(); }
+  Error const *end() const noexcept { return errors_.get() + size_; }
+  Error const &operator[](size_t i) const noexcept { return errors_[i]; }
+  size_t size() const noexcept { return size_; }
+
+  /**
+   * \return
+   *   The number of errors dropped since the slots are used up
+   */
+  size_t dropped() const noexcept { return dropped_; }
+
+ private:
+  std::unique_ptr<Error[]> errors_;
+  size_t size_;
+  size_t dropped_;
+};
+
+class ErrorList {
+ public:
+  /**
+   * \Param capacity The number of errors that can be stored, the errors
+   *                 appended after the slots are used up are only counted
+   */
+  explicit ErrorList(size_t capacity);
+
+  ErrorList(ErrorList const &) = delete;
+  ErrorList &operator=(ErrorList const &) = delete;
+
+  /**
+   * Lock-free, a slot is claimed by an atomic increment.
+   * No-op if \p err is a success.
+   *
+   * \return
+   *   false if \p err is dropped since the slots are used up
+   */
+  bool Append(Error err) noexcept;
+
+  /**
+   * \return
+   *   Success if no error is appended, otherwise an error of MultiErrorInfo
+   *   The list is empty with no slot after this.
+   *
+   * \warning
+   *   The appending must be finished, e.g. the workers are joined
+   */
+  Error ToError();
+
+  size_t capacity() const noexcept { return capacity_; }
+
+ private:
+  std::unique_ptr<Error[]> errors_;
+  std::unique_ptr<std::atomic<bool>[]> ready_;
+  size_t capacity_;
+  std::atomic<size_t> next_;
+  std::atomic<size_t> dropped_;
+};
+
+/**
+ * \brief The first error published by the workers wins
+ *
+ * The first error is claimed by a single CAS, and the cancelled flag is set
+ * for the workers polling it, which is isolated in its own cache line, so
+ * polling doesn't contend with the publishing.
+ */
+class ErrorLatch {
+ public:
+  ErrorLatch() noexcept
+    : cancelled_(false)
+    , state_(kEmpty)
+  {
+  }
+
+  ErrorLatch(ErrorLatch const &) = delete;
+  ErrorLatch &operator=(ErrorLatch const &) = delete;
+
+  /**
+   * Store \p err if it is the first error and cancel the others.
+   * No-op if \p err is a success.
+   *
+   * \return
+   *   true if \p err is stored, otherwise it is dropped
+   */
+  bool Publish(Error err) noexcept
+  {
+    if (!err) return false;
+
+    auto expected = kEmpty;
+    if (!state_.compare_exchange_strong(expected, kWriting,
+                                        std::memory_order_acquire))
+    {
+      err.IgnoreCheck();
+      return false;
+    }
+    cancelled_.store(true, std::memory_order_relaxed);
+    error_ = std::move(err);
+    state_.store(kReady, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Cancel the workers without error
+   */
+  void Cancel() noexcept { cancelled_.store(true, std::memory_order_relaxed); }
+
+  /**
+   * Cheap enough to be polled in the loop of the workers
+   */
+  bool cancelled() const noexcept
+  {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * \return
+   *   The first error, or success if no error is published.
+   *   The error must be checked like others, and the error not taken is
+   *   treated as unchecked when the latch is destroyed.
+   *
+   * \warning
+   *   The workers must be joined
+   */
+  Error Take() noexcept
+  {
+    auto const state = state_.load(std::memory_order_acquire);
+    assert(state != kWriting);
+    if (state != kReady) return MakeSuccess();
+    return std::move(error_);
+  }
+
+ private:
+  enum State { kEmpty, kWriting, kReady };
+
+  // Padding instead of alignas(64) like AsyncReportSink
+  char pad0_[64];
+  std::atomic<bool> cancelled_;
+  char pad1_[64];
+
+  std::atomic<State> state_;
+  Error error_;
+};
+
+} // namespace kerror
+
+#endif
@@ -1,19 +1,35 @@
 #include "kerror.h"
+#include "format.h"
+#include "async_sink.h"
+#include "backtrace.h"
+#include "metrics.h"
+#include "multi_error.h"
+#include "batch.h"
+#include "binlog.h"
+#include "wire.h"
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <csignal>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace kerror;
 
 struct A {
+  static int moves;
+
   static ErrorOr<A> Create(int x)
   {
     Error err;
-    A a(x, &err);
+    ErrorOr<A> res(kInPlace, x, &err);
     if (err) {
-      fflush(stdout);
-      return err;
+      res = std::move(err);
     }
-    return a;
+    return res;
   }
 
   A(int x, Error *error)
@@ -26,11 +42,1534 @@ struct A {
     x_ = x;
   }
 
+  A(A &&other) noexcept
+    : x_(other.x_)
+  {
+    ++moves;
+  }
+
   int x_;
 };
 
+int A::moves = 0;
+
 Error f() { return MakeMsgError("out of range"); }
 
+struct LargeErrorInfo : ErrorInfo<LargeErrorInfo> {
+  char buf[128];
+
+  std::string GetMessage() const override { return "large"; }
+};
+
+void TestInlineInfo()
+{
+  constexpr bool kInline = detail::CanStoreInline<MsgErrorInfo>::value;
+  auto err = MakeMsgError("inline");
+  assert(err.is_inline() == kInline);
+
+  // Relocated in move
+  Error moved(std::move(err));
+  assert(moved.is_inline() == kInline);
+  assert(IsA<MsgErrorInfo>(moved.info()));
+  assert(moved.info()->GetMessage() == "inline");
+
+  auto large = MakeError<LargeErrorInfo>();
+  assert(!large.is_inline());
+  assert(large.info()->GetMessage() == "large");
+}
+
+struct CountingAllocator : ErrorAllocator {
+  int allocated = 0;
+
+  void *Allocate(size_t size, size_t) override
+  {
+    ++allocated;
+    return malloc(size);
+  }
+
+  void Deallocate(void *p, size_t, size_t) noexcept override
+  {
+    --allocated;
+    free(p);
+  }
+};
+
+void TestAllocator()
+{
+  CountingAllocator alloc;
+  {
+    auto err = MakeError<LargeErrorInfo>(&alloc);
+    assert(alloc.allocated == 1);
+    assert(IsA<LargeErrorInfo>(err.info()));
+
+    auto err2 = MakeMsgError(&alloc, "arena message");
+    assert(alloc.allocated == 2);
+    assert(err2.info()->GetMessage() == "arena message");
+  }
+  assert(alloc.allocated == 0);
+
+#if KERROR_HAS_PMR
+  char buf[256];
+  std::pmr::monotonic_buffer_resource arena(buf, sizeof buf,
+                                            std::pmr::null_memory_resource());
+  auto err = MakeMsgError(&arena, "pmr message");
+  assert(err.info()->GetMessage() == "pmr message");
+#endif
+}
+
+void TestInfoFreeList()
+{
+#if KERROR_INFO_FREE_LIST_SIZE
+  // The info released is reused by the next error of the same size
+  void const *released;
+  {
+    auto err = MakeError<LargeErrorInfo>();
+    released = err.info();
+  }
+  auto err = MakeError<LargeErrorInfo>();
+  assert(err.info() == released && err.is_allocated());
+  assert(IsA<LargeErrorInfo>(err.info()));
+
+  // The infos destroyed by another thread flow back through the depot
+  constexpr int kCount = 4 * KERROR_INFO_FREE_LIST_SIZE;
+  std::vector<Error> errors;
+  std::vector<void const *> addresses;
+  errors.reserve(kCount);
+  for (int i = 0; i < kCount; ++i) {
+    errors.push_back(MakeError<LargeErrorInfo>());
+    addresses.push_back(errors.back().info());
+  }
+  std::sort(addresses.begin(), addresses.end());
+  std::thread([&errors] { errors.clear(); }).join();
+
+  int reused = 0;
+  for (int i = 0; i < kCount; ++i) {
+    errors.push_back(MakeError<LargeErrorInfo>());
+    reused += std::binary_search(addresses.begin(), addresses.end(),
+                                 errors.back().info());
+  }
+  // The thread only released the infos, its list is still moved to the
+  // depot when it exits(otherwise leaked, reported by LeakSanitizer)
+  assert(reused == kCount);
+#endif
+}
+
+template <typename T, typename = void>
+struct CanMakeStaticError : std::false_type {
+};
+
+template <typename T>
+struct CanMakeStaticError<T,
+                          decltype(void(MakeStaticError(std::declval<T>())))>
+  : std::true_type {
+};
+
+void TestStaticError()
+{
+  static constexpr StringSlice kMsg("out of range");
+  static_assert(kMsg.size() == 12, "The length is computed in compile time");
+  // Only the string literals, the strings that may dangle are rejected
+  static_assert(CanMakeStaticError<char const (&)[13]>::value, "");
+  static_assert(!CanMakeStaticError<std::string>::value, "");
+  static_assert(!CanMakeStaticError<std::string const &>::value, "");
+  static_assert(!CanMakeStaticError<char const *>::value, "");
+  static_assert(!CanMakeStaticError<char (&)[13]>::value, "");
+  static_assert(!CanMakeStaticError<StringSlice>::value, "");
+
+  auto err = MakeStaticError("out of range");
+  assert(err.is_inline() == detail::CanStoreInline<SliceMsgErrorInfo>::value);
+  auto info = DynCast<SliceMsgErrorInfo>(err.info());
+  assert(info);
+  assert(info->message().size() == kMsg.size());
+  assert(info->GetMessage() == "out of range");
+
+  auto literal = KERROR_STATIC_ERROR("out of range");
+  assert(IsA<SliceMsgErrorInfo>(literal.info()));
+  assert(literal.info()->GetMessage() == "out of range");
+
+  static char const kPadded[32] = "out of range";
+  auto padded = MakeStaticError(kPadded);
+  assert(padded.info()->GetMessage() == "out of range");
+
+  std::string const msg = "out of range";
+  auto slice = MakeSliceError(msg);
+  assert(IsA<SliceMsgErrorInfo>(slice.info()));
+  assert(slice.info()->GetMessage() == msg);
+}
+
+// Only the nothrow new is replaced, it fails if g_fail_nothrow_new is set
+bool g_fail_nothrow_new = false;
+
+void *operator new(size_t size, std::nothrow_t const &) noexcept
+{
+  if (g_fail_nothrow_new) return nullptr;
+  try {
+    return ::operator new(size);
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+void TestCompactError()
+{
+#ifdef KERROR_COMPACT_ERROR
+  static_assert(sizeof(Error) == sizeof(void *), "Error should be compact");
+#endif
+  auto err = MakeNoInfoError();
+  assert(err.is_error());
+  assert(!err.info());
+
+  auto err2 = MakeMsgError("moved");
+  Error err3(std::move(err2));
+  assert(err2.is_success());
+  assert(err3 && err3.info()->GetMessage() == "moved");
+}
+
+void TestCheckPolicy()
+{
+#if !KERROR_FORCE_CHECK
+  // Don't abort
+  auto err = MakeNoInfoError();
+  (void)err;
+#endif
+  auto success = MakeSuccess();
+  assert(!success);
+}
+
+void TestLazyMsgError()
+{
+  auto err = MakeLazyMsgErrorf("Timeout after %d ms, retry %d", 100, 3);
+  constexpr bool kInline =
+      detail::CanStoreInline<LazyMsgErrorInfo<int, int>>::value;
+  assert(err.is_inline() == kInline);
+  assert(err.info()->GetMessage() == "Timeout after 100 ms, retry 3");
+  // Cached
+  assert(err.info()->GetMessage() == "Timeout after 100 ms, retry 3");
+
+  // std::string is captured by value
+  std::string path = "/tmp/x";
+  auto err2 = MakeLazyMsgErrorf("Failed to open %s", path);
+  path.clear();
+  assert(err2.info()->GetMessage() == "Failed to open /tmp/x");
+}
+
+enum Color { kRed = 2 };
+
+void TestFormat()
+{
+  std::string name = "shard";
+  assert(KERROR_FORMAT("{} {} {{{}}} {}", name, -42, 'x', true) ==
+         "shard -42 {x} true");
+  assert(Format("{} {} {}", 1.5, kRed, 18446744073709551615ULL) ==
+         "1.5 2 18446744073709551615");
+  assert(Format("{} {}", 1) == "1 {}");
+
+  std::string long_str(10000, 'a');
+  assert(Format("{}!", long_str).size() == 10001);
+
+  auto err = KERROR_FORMAT_ERROR("Failed to read {} bytes", 10);
+  assert(err.info()->GetMessage() == "Failed to read 10 bytes");
+
+  // The specs check the types of the arguments
+  assert(KERROR_FORMAT("{:d} {:x} {:s} {:g} {:c} {:p}", -3, 255u, name, 0.5,
+                       'c', nullptr) == "-3 ff shard 0.5 c 0x0");
+  assert(Format("{:x} {:x}", 1.5) == "1.5 {:x}");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{:d}", 1) == detail::kFormatOk,
+                "");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{:s}", 1) ==
+                    detail::kFormatTypeMismatch,
+                "");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{:d}", name) ==
+                    detail::kFormatTypeMismatch,
+                "");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{:q}", 1) ==
+                    detail::kFormatUnknownSpec,
+                "");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{} {}", 1) ==
+                    detail::kFormatTooFewArgs,
+                "");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{}", 1, 2) ==
+                    detail::kFormatTooManyArgs,
+                "");
+  static_assert(KERROR_FORMAT_CHECK_RESULT("{", 1) ==
+                    detail::kFormatUnmatchedBrace,
+                "");
+}
+
+struct HttpCategory : ErrorCategory {
+  char const *GetName() const noexcept override { return "http"; }
+
+  std::string GetMessage(int code) const override
+  {
+    return code == 404 ? "Not Found" : "Unknown";
+  }
+};
+
+HttpCategory const kHttpCategory;
+
+void TestCodeError()
+{
+  assert(kHttpCategory.id() > SystemErrorCategory::kId);
+  assert(GetErrorCategory(kHttpCategory.id()) == &kHttpCategory);
+
+  auto err = MakeSysError(ENOENT);
+  errno = 0;
+  assert(err.category() == &SystemCategory());
+  assert(err.code() == ENOENT);
+  assert(!err.is_inline());
+  assert(err.info()->GetMessage() == strerror(ENOENT));
+  // Still available after info() is created
+  assert(err.code() == ENOENT);
+  assert(err.category() == &SystemCategory());
+
+  Error moved(std::move(err));
+  assert(moved.code() == ENOENT);
+  assert(moved.info()->GetMessage() == strerror(ENOENT));
+
+  auto err2 = MakeCodeError(kHttpCategory, 404);
+  assert(err2.category() == &kHttpCategory);
+  assert(err2.info()->GetMessage() == "Not Found");
+
+#if KERROR_PACK_ERROR_CODE && !KERROR_INLINE_INFO_SIZE
+  // The code is kept packed without info if out of memory
+  auto code = MakeCodeError(kHttpCategory, 404);
+  g_fail_nothrow_new = true;
+  auto const code_info = code.info();
+  (void)code_info;
+  g_fail_nothrow_new = false;
+  assert(!code_info && code.code() == 404);
+  assert(code.category() == &kHttpCategory);
+  StringSink sink;
+  code.WriteMessage(sink);
+  assert(sink.str() == "Not Found");
+  assert(code.info() && code.info()->GetMessage() == "Not Found");
+#endif
+
+  assert(MakeSuccess().category() == nullptr);
+  assert(MakeMsgError("x").code() == 0);
+}
+
+void TestErrorOrSpecializations()
+{
+  int x = 1;
+  ErrorOr<int *> p = &x;
+  assert(!p && *p == &x);
+  ErrorOr<int *> moved_p(std::move(p));
+  assert(!moved_p && *moved_p == &x);
+
+  ErrorOr<int *> p2 = MakeNoInfoError();
+  assert(p2 && !p2.info());
+
+  ErrorOr<int &> r = x;
+  assert(!r);
+  *r = 2;
+  assert(x == 2);
+
+  ErrorOr<void> v;
+  assert(!v);
+  ErrorOr<void> v2 = MakeMsgError("void");
+  assert(v2 && v2.info()->GetMessage() == "void");
+
+  ErrorOr<std::string> str = std::string("value");
+  ErrorOr<std::string> str2 = MakeMsgError("str");
+  str2.error().IgnoreCheck();
+  str2 = std::move(str);
+  assert(!str2 && *str2 == "value");
+#ifdef KERROR_COMPACT_ERROR
+  static_assert(sizeof(ErrorOr<int *>) == 2 * sizeof(void *),
+                "ErrorOr<T*> don't need flag");
+#else
+  static_assert(sizeof(ErrorOr<int *>) == sizeof(Error) + sizeof(int *),
+                "ErrorOr<T*> don't need flag");
+#endif
+
+  // The small trivial objects are stored beside the Error, so ErrorOr<T>
+  // is as trivial as Error(which owns its info, so not trivial itself)
+  static_assert(detail::IsSeparateErrorOr<int>::value, "");
+  static_assert(!detail::IsSeparateErrorOr<std::string>::value, "");
+  static_assert(std::is_trivially_destructible<ErrorOr<int>>::value ==
+                    std::is_trivially_destructible<Error>::value,
+                "");
+  static_assert(std::is_trivially_move_constructible<ErrorOr<int>>::value ==
+                    std::is_trivially_move_constructible<Error>::value,
+                "");
+  static_assert(sizeof(ErrorOr<int>) == sizeof(ErrorOr<int *>), "");
+
+  ErrorOr<int> n = 1;
+  assert(!n && *n == 1);
+  n = MakeMsgError("int");
+  assert(n && n.info()->GetMessage() == "int");
+  n.error().IgnoreCheck();
+  assert(n.emplace(2) == 2 && !n);
+  ErrorOr<int> moved_n(std::move(n));
+  assert(!moved_n && *moved_n == 2);
+  ErrorOr<int> none = MakeSuccess();
+  assert(!none);
+}
+
+Error Check(int x)
+{
+  if (x < 0) return MakeMsgError("negative");
+  return MakeSuccess();
+}
+
+ErrorOr<std::string> Repeat(int x)
+{
+  KERROR_TRY(Check(x));
+  return std::string(x, 'a');
+}
+
+ErrorOr<size_t> RepeatSize(int x)
+{
+  KERROR_ASSIGN_OR_RETURN(auto str, Repeat(x));
+  return str.size();
+}
+
+ErrorOr<std::string &> Get(std::string &str) { return str; }
+
+// Expanded twice in a line
+#define ASSIGN_BOTH_OR_RETURN(a, x, b, y)                                      \
+  KERROR_ASSIGN_OR_RETURN(a, x);                                               \
+  KERROR_ASSIGN_OR_RETURN(b, y)
+
+ErrorOr<size_t> CopySizes(std::string &x, std::string &y)
+{
+  ASSIGN_BOTH_OR_RETURN(std::string a, Get(x), std::string b, Get(y));
+  return a.size() + b.size();
+}
+
+void TestPropagation()
+{
+  auto res = RepeatSize(3);
+  assert(!res && *res == 3);
+
+  // The referent of ErrorOr<T &> is copied instead of moved
+  std::string x = "referent";
+  std::string y = "intact";
+  auto copied = CopySizes(x, y);
+  assert(!copied && *copied == 14);
+  assert(x == "referent" && y == "intact");
+
+  auto res2 = RepeatSize(-1);
+  assert(res2 && res2.info()->GetMessage() == "negative");
+}
+
+class IoErrorInfo : public ErrorInfo<IoErrorInfo> {
+ public:
+  std::string GetMessage() const override { return "io"; }
+};
+
+class EofErrorInfo : public ErrorInfo<EofErrorInfo, IoErrorInfo> {
+ public:
+  std::string GetMessage() const override { return "eof"; }
+};
+
+int handled_msg = 0;
+
+void HandleMsg(MsgErrorInfo const &) { ++handled_msg; }
+
+void TestTypeId()
+{
+  auto err = MakeError<EofErrorInfo>();
+  auto info = err.info();
+  assert(IsA<EofErrorInfo>(info));
+  assert(IsA<IoErrorInfo>(info));
+  assert(IsA<IErrorInfo>(info));
+  assert(!IsA<MsgErrorInfo>(info));
+  assert(!IsA<IoErrorInfo>(nullptr));
+  assert(DynCast<IoErrorInfo>(info)->GetMessage() == "eof");
+  assert(!DynCast<CodeErrorInfo>(info));
+  assert(IoErrorInfo::ClassId() != EofErrorInfo::ClassId());
+
+  // The first handler accepting the type is called
+  int handled = 0;
+  auto rest = HandleErrors(
+      std::move(err), [&](MsgErrorInfo &) { handled = 2; },
+      [&](IoErrorInfo const &info) { handled = info.GetMessage() == "eof"; },
+      [&](EofErrorInfo const &) { handled = 3; });
+  assert(!rest && handled == 1);
+
+  // The packed error code is materialized to CodeErrorInfo
+  rest = HandleErrors(MakeSysError(ENOENT), HandleMsg,
+                      [](CodeErrorInfo const &info) -> Error {
+                        return MakeMsgError(info.GetMessage());
+                      });
+  assert(rest && IsA<MsgErrorInfo>(rest.info()));
+  rest = HandleErrors(std::move(rest), HandleMsg);
+  assert(!rest && handled_msg == 1);
+
+  // Unhandled
+  rest = HandleErrors(MakeNoInfoError(), [](IErrorInfo const &) {});
+  assert(rest && !rest.info());
+  rest = HandleErrors(MakeStaticError("static"), HandleMsg);
+  assert(rest && IsA<SliceMsgErrorInfo>(rest.info()));
+  rest = HandleErrors(MakeSuccess(), HandleMsg);
+  assert(!rest && handled_msg == 1);
+}
+
+struct QueueFullErrorInfo
+  : ErrorInfo<QueueFullErrorInfo, SharedErrorInfo> {
+  static int alive;
+
+  QueueFullErrorInfo() { ++alive; }
+  ~QueueFullErrorInfo() override { --alive; }
+
+  std::string GetMessage() const override { return "queue full"; }
+};
+
+int QueueFullErrorInfo::alive = 0;
+
+void TestSharedError()
+{
+  {
+    auto err = MakeError<QueueFullErrorInfo>();
+    assert(!err.is_inline());
+    Error copy;
+    auto copied = err.TryCopy(&copy);
+    Error copy2;
+    auto copied2 = copy.TryCopy(&copy2);
+    assert(copied && copied2);
+    assert(copy.info() == err.info() && copy2.info() == err.info());
+    assert(IsA<QueueFullErrorInfo>(copy2.info()));
+
+    // Released by the last copy
+    err = MakeSuccess();
+    copy = MakeSuccess();
+    assert(QueueFullErrorInfo::alive == 1);
+    assert(copy2.info()->GetMessage() == "queue full");
+  }
+  assert(QueueFullErrorInfo::alive == 0);
+
+  {
+    SharedError const queue_full(MakeSharedMsgError("queue full"));
+    auto err = queue_full.get();
+    auto err2 = queue_full.get();
+    assert(err && err.info() == err2.info());
+    assert(DynCast<SharedMsgErrorInfo>(err2.info())->message() == "queue full");
+
+    SharedError const queue_full2(MakeError<QueueFullErrorInfo>());
+    assert(QueueFullErrorInfo::alive == 1);
+    auto err3 = queue_full2.get();
+    assert(err3 && err3.info()->GetMessage() == "queue full");
+  }
+  assert(QueueFullErrorInfo::alive == 0);
+
+  // The error code and no info error are copied by value
+  auto code = MakeSysError(ENOENT);
+  assert(code.info());
+  Error code_copy;
+  auto copied = code.TryCopy(&code_copy);
+  assert(copied);
+  assert(code_copy.category() == &SystemCategory());
+  assert(code_copy.code() == ENOENT);
+
+  auto no_info = MakeNoInfoError();
+  Error no_info_copy;
+  copied = no_info.TryCopy(&no_info_copy);
+  assert(copied);
+  assert(no_info && no_info_copy && !no_info_copy.info());
+  no_info.IgnoreCheck();
+
+  // The shared cause of the contexts is copied without the contexts
+  auto with_context = MakeSharedMsgError("shared");
+  with_context.AddContext("context");
+  Error cause;
+  copied = with_context.TryCopy(&cause);
+  assert(copied);
+  assert(cause.info()->GetFullMessage() == "shared");
+  assert(with_context.info()->GetFullMessage() == "context: shared");
+
+  // Copying fails instead of aborting
+  auto msg = MakeMsgError("message");
+  Error msg_copy;
+  copied = msg.TryCopy(&msg_copy);
+  assert(!copied && !msg_copy);
+  msg.IgnoreCheck();
+
+  static_assert(!std::is_copy_constructible<Error>::value,
+                "Copying is explicit");
+  static_assert(!std::is_copy_constructible<ErrorOr<int>>::value,
+                "Copying is explicit");
+}
+
+// The user-declared destructor suppresses the implicit move constructor,
+// so it is relocated by the copy constructor
+struct NoMoveErrorInfo : ErrorInfo<NoMoveErrorInfo> {
+  ~NoMoveErrorInfo() override {}
+
+  std::string GetMessage() const override { return "no move"; }
+};
+
+void TestContext()
+{
+  auto err = MakeStaticError("No such file");
+  err.AddContext("open file").AddContextf("while reading shard %d", 3);
+  assert(IsA<SliceMsgErrorInfo>(err.info()));
+  assert(err.info()->GetMessage() == "No such file");
+  assert(err.info()->GetFullMessage() ==
+         "while reading shard 3: open file: No such file");
+
+  // Relocated with the info
+  Error moved(std::move(err));
+  assert(moved.info()->GetFullMessage() ==
+         "while reading shard 3: open file: No such file");
+
+  auto no_move = MakeError<NoMoveErrorInfo>();
+  no_move.AddContext("context");
+  Error no_move_moved(std::move(no_move));
+  assert(no_move_moved.is_inline() ==
+         detail::CanStoreInline<NoMoveErrorInfo>::value);
+  assert(no_move_moved.info()->GetFullMessage() == "context: no move");
+
+  CountingAllocator alloc;
+  {
+    std::string shard = "shard 4";
+    auto code = MakeSysError(ENOENT);
+    code.AddContext(&alloc, shard);
+    shard.clear();
+    assert(alloc.allocated == 1);
+    assert(code.code() == ENOENT);
+    assert(code.info()->GetFullMessage() ==
+           "shard 4: " + SystemCategory().GetMessage(ENOENT));
+  }
+  assert(alloc.allocated == 0);
+
+  // Wrapped, the shared info is not modified
+  SharedError const shared(MakeSharedMsgError("queue full"));
+  auto err2 = shared.get();
+  err2.AddContext("enqueue");
+  assert(IsA<ContextErrorInfo>(err2.info()));
+  assert(DynCast<SharedMsgErrorInfo>(err2.info())->message() == "queue full");
+  assert(err2.info()->GetFullMessage() == "enqueue: queue full");
+  err2.AddContext("request");
+  assert(err2.info()->GetFullMessage() == "request: enqueue: queue full");
+  assert(shared.get().info()->GetFullMessage() == "queue full");
+
+  auto no_info = MakeNoInfoError();
+  no_info.AddContext("timeout");
+  assert(no_info && no_info.info()->GetFullMessage() == "timeout");
+
+  auto success = MakeSuccess();
+  success.AddContext("unused");
+  assert(!success);
+}
+
+void TestWriteMessage()
+{
+  auto err = MakeMsgError("message is not moved out");
+  assert(err.info()->GetMessage() == "message is not moved out");
+  assert(err.info()->GetMessage() == "message is not moved out");
+
+  err.AddContext("ctx");
+  char buf[64];
+  auto n = err.info()->WriteFullMessage(buf, sizeof buf);
+  assert(n == strlen("ctx: message is not moved out"));
+  assert(!strcmp(buf, "ctx: message is not moved out"));
+
+  // Truncated but terminated
+  char small[8];
+  n = err.info()->WriteFullMessage(small, sizeof small);
+  assert(n == strlen("ctx: message is not moved out"));
+  assert(!strcmp(small, "ctx: me"));
+  assert(err.info()->WriteFullMessage(nullptr, 0) == n);
+
+  // The message is streamed by pieces
+  StringSink sink;
+  err.info()->WriteMessage(sink);
+  assert(sink.str() == "message is not moved out");
+
+  // Fallback to GetMessage()
+  auto large = MakeError<LargeErrorInfo>();
+  large.info()->WriteFullMessage(buf, sizeof buf);
+  assert(!strcmp(buf, "large"));
+
+  auto code = MakeSysError(ENOENT);
+  code.info()->WriteFullMessage(buf, sizeof buf);
+  assert(SystemCategory().GetMessage(ENOENT) == buf);
+
+  auto lazy = MakeLazyMsgErrorf("%d-%s", 1, std::string("a"));
+  lazy.info()->WriteFullMessage(buf, sizeof buf);
+  assert(!strcmp(buf, "1-a"));
+
+  // The empty pieces are not separated
+  auto no_info = MakeNoInfoError();
+  no_info.AddContext("").AddContext("outer");
+  assert(no_info.info()->GetFullMessage() == "outer");
+}
+
+// Read all from fd until EOF
+std::string ReadAll(int fd)
+{
+  std::string out;
+  char buf[256];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof buf)) > 0) {
+    out.append(buf, n);
+  }
+  close(fd);
+  return out;
+}
+
+template <typename F>
+std::string CaptureStderr(F f)
+{
+  int fds[2];
+  auto const ret = pipe(fds);
+  assert(ret == 0);
+  (void)ret;
+  auto const saved = dup(STDERR_FILENO);
+  dup2(fds[1], STDERR_FILENO);
+  f();
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+  close(fds[1]);
+  return ReadAll(fds[0]);
+}
+
+void ReportInSignalHandler(int)
+{
+  auto err = MakeStaticError("in signal handler");
+  PError("Signal: ", err);
+}
+
+// Report in the report of the outer
+struct ReentrantSink : ReportSink {
+  explicit ReentrantSink(std::string const &msg)
+    : msg(msg)
+  {
+  }
+
+  void Write(char const *data, size_t n) noexcept override
+  {
+    reports.append(data, n);
+    if (reentered) return;
+    reentered = true;
+    PError("Inner: ", MakeMsgError(msg));
+    errno = ENOENT;
+    PSysErrorf("%s", msg.c_str());
+  }
+
+  std::string const &msg;
+  std::string reports;
+  bool reentered = false;
+};
+
+void TestReport()
+{
+  auto out = CaptureStderr([] {
+    auto err = MakeSysError(ENOENT);
+    err.AddContext("open");
+    PError("Reason: ", err);
+    PError("Code: ", MakeCodeError(kHttpCategory, 404));
+    PError("NoInfo", MakeNoInfoError());
+  });
+  auto const enoent = SystemCategory().GetMessage(ENOENT);
+  assert(out == "Reason: open: " + enoent + "\nCode: Not Found\nNoInfo\n");
+
+  out = CaptureStderr([] {
+    errno = EINVAL;
+    PSysErrorf("Failed to %s", "parse");
+  });
+  assert(out == "Failed to parse\nSysError: " +
+                    SystemCategory().GetMessage(EINVAL) + "(22)\n");
+
+  out = CaptureStderr([] { PErrorSys("R: ", "S", MakeSysError(ENOENT)); });
+  assert(out == "R: " + enoent + "\nS: " + enoent + "(2)\n");
+
+  out = CaptureStderr([] {
+    signal(SIGUSR1, ReportInSignalHandler);
+    raise(SIGUSR1);
+    signal(SIGUSR1, SIG_DFL);
+  });
+  assert(out == "Signal: in signal handler\n");
+
+  // The long report is written in chunks, the output of vsnprintf() longer
+  // than the buffer is marked
+  std::string const long_msg(5000, 'a');
+  out = CaptureStderr([&long_msg] {
+    PError("Long: ", MakeMsgError(long_msg));
+    errno = ENOENT;
+    PSysErrorf("%s", long_msg.c_str());
+  });
+  assert(out == "Long: " + long_msg + "\n" + long_msg.substr(0, 4095) +
+                    "...(truncated)\nSysError: " + enoent + "(2)\n");
+
+  // The static buffer is busy, the stack buffer is used
+  ReentrantSink reentrant(long_msg);
+  auto old = SetReportSink(&reentrant);
+  PError("Outer", MakeNoInfoError());
+  SetReportSink(old);
+  assert(reentrant.reports == "Outer\nInner: " + long_msg + "\n" +
+                                  long_msg.substr(0, 511) +
+                                  "...(truncated)\nSysError: " + enoent +
+                                  "(2)\n");
+
+  // The arguments are formatted by vsnprintf() and the process is aborted
+  int fds[2];
+  auto const ret = pipe(fds);
+  assert(ret == 0);
+  (void)ret;
+  auto const pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDERR_FILENO);
+    Panicf("Panic: %d %s", 1, "fatal");
+  }
+  close(fds[1]);
+  out = ReadAll(fds[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  assert(out == "Panic: 1 fatal");
+}
+
+// Blocked until released, then collect the reports
+struct CollectingSink : ReportSink {
+  std::atomic<bool> released{false};
+  std::atomic<int> writes{0};
+  std::string reports;
+
+  void Write(char const *data, size_t n) noexcept override
+  {
+    while (!released.load()) {
+      std::this_thread::yield();
+    }
+    reports.append(data, n);
+    ++writes;
+  }
+};
+
+void TestAsyncSink()
+{
+  {
+    CollectingSink collected;
+    collected.released = true;
+    AsyncReportSink sink(16, AsyncReportSink::OverflowPolicy::kDrop,
+                         collected);
+    assert(sink.capacity() == 16);
+
+    auto old = SetReportSink(&sink);
+    assert(old == &StderrSink() && &GetReportSink() == &sink);
+    PError("Async: ", MakeStaticError("first"));
+    PError("Async: ", MakeStaticError("second"));
+    sink.Flush();
+    assert(collected.reports == "Async: first\nAsync: second\n");
+    assert(sink.dropped() == 0);
+
+    // Written into consecutive records
+    collected.reports.clear();
+    std::string long_report(AsyncReportSink::kRecordSize * 2 + 1, 'x');
+    long_report.back() = 'y';
+    sink.Write(long_report.data(), long_report.size());
+    sink.Flush();
+    assert(collected.reports == long_report);
+    assert(sink.truncated() == 0);
+
+    // Truncated to the whole ring only
+    collected.reports.clear();
+    std::string huge_report(AsyncReportSink::kRecordSize * 20, 'z');
+    sink.Write(huge_report.data(), huge_report.size());
+    sink.Flush();
+    assert(collected.reports == huge_report.substr(
+                                    0, AsyncReportSink::kRecordSize * 16));
+    assert(sink.truncated() == 1 && sink.dropped() == 0);
+  }
+  // Restored by the destructor
+  assert(&GetReportSink() == &StderrSink());
+
+  // Dropped if the ring is full
+  CollectingSink blocked;
+  {
+    AsyncReportSink sink(4, AsyncReportSink::OverflowPolicy::kDrop, blocked);
+    for (int i = 0; i < 20; ++i) {
+      sink.Write("r", 1);
+    }
+    assert(sink.dropped() >= 12);
+    auto const dropped = sink.dropped();
+    blocked.released = true;
+    sink.Flush();
+    assert(blocked.reports.size() + dropped == 20);
+  }
+
+  // Concurrent reporting threads, nothing is lost in kBlock
+  CollectingSink collected;
+  collected.released = true;
+  {
+    AsyncReportSink sink(8, AsyncReportSink::OverflowPolicy::kBlock,
+                         collected);
+    std::thread threads[4];
+    for (auto &thread : threads) {
+      thread = std::thread([&sink]() {
+        for (int i = 0; i < 1000; ++i) {
+          sink.Write("ab", 2);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  assert(collected.reports.size() == 4 * 1000 * 2);
+  for (size_t i = 0; i < collected.reports.size(); i += 2) {
+    assert(collected.reports.compare(i, 2, "ab") == 0);
+  }
+}
+
+void TestReportLimiter()
+{
+  // 2 per second, burst of 3
+  ReportLimiter limiter(2, 3);
+  uint64_t const kSecond = 1000000000;
+  uint64_t now = 10 * kSecond;
+  assert(limiter.Acquire(now));
+  assert(limiter.Acquire(now));
+  assert(limiter.Acquire(now));
+  assert(!limiter.Acquire(now));
+  assert(!limiter.Acquire(now + kSecond / 4));
+  // A token is refilled every 500ms
+  assert(limiter.Acquire(now + kSecond / 2));
+  assert(!limiter.Acquire(now + kSecond / 2));
+  assert(limiter.TakeSuppressed() == 3);
+  assert(limiter.TakeSuppressed() == 0);
+  // The bucket is full after idle for a long time
+  now += 100 * kSecond;
+  for (int i = 0; i < 3; ++i) {
+    assert(limiter.Acquire(now));
+  }
+  assert(!limiter.Acquire(now));
+
+  auto out = CaptureStderr([] {
+    for (int i = 0; i < 10; ++i) {
+      // Checked even if suppressed
+      KERROR_PERROR_LIMITED(1, 2, "Limited: ", MakeStaticError("storm"));
+    }
+  });
+  assert(out == "Limited: storm\nLimited: storm\n");
+
+  ReportLimiter summarized(1000000, 1);
+  out = CaptureStderr([&summarized] {
+    for (int i = 0; i < 5; ++i) {
+      summarized.Acquire(0);
+    }
+    PError(summarized, "Summary: ", MakeStaticError("storm"));
+  });
+  assert(out == "Summary: storm\n(Suppressed 4 similar reports)\n");
+
+  // A noisy kind of the site doesn't suppress the others
+  out = CaptureStderr([] {
+    for (int i = 0; i < 10; ++i) {
+      KERROR_PERROR_LIMITED(1, 1, "Kind: ",
+                            i < 8 ? MakeStaticError("storm")
+                            : i == 8 ? MakeCodeError(kHttpCategory, 404)
+                                     : MakeSysError(ENOENT));
+    }
+  });
+  assert(out == "Kind: storm\nKind: Not Found\nKind: " +
+                    std::string(strerror(ENOENT)) + "\n");
+
+  auto const storm = GetErrorKind(MakeStaticError("storm"));
+  auto const other = GetErrorKind(MakeStaticError("other storm"));
+  auto const not_found = GetErrorKind(MakeCodeError(kHttpCategory, 404));
+  auto const eof = GetErrorKind(MakeError<LargeErrorInfo>());
+  assert(storm == other);
+  assert(storm != not_found);
+  assert(not_found != GetErrorKind(MakeCodeError(kHttpCategory, 500)));
+  assert(storm != eof);
+  // Seen through the context
+  assert(GetErrorKind(MakeNoInfoError().AddContext("while reading")) ==
+         GetErrorKind(MakeNoInfoError()));
+
+  SiteReportLimiter site(1, 1);
+  assert(site.Acquire(storm, now));
+  assert(!site.Acquire(storm, now));
+  assert(!site.Acquire(storm, now));
+  assert(site.Acquire(not_found, now));
+  assert(site.TakeSuppressed(storm) == 2);
+  assert(site.TakeSuppressed(not_found) == 0);
+  // The kinds beyond kMaxKinds share a bucket
+  for (uintptr_t kind = 1; kind <= SiteReportLimiter::kMaxKinds; ++kind) {
+    site.Acquire(kind * 16, now);
+  }
+  now += 100 * kSecond;
+  assert(site.Acquire(1000 * 16, now));
+  assert(!site.Acquire(1001 * 16, now));
+}
+
+Error FailAtSite(bool allocate)
+{
+  if (allocate) return KERROR_SITE_ERROR(MakeError<LargeErrorInfo>());
+  return KERROR_SITE_ERROR(MakeNoInfoError());
+}
+
+void TestSiteMetrics()
+{
+  auto find = [](char const *function, bool allocated) -> SiteMetrics {
+    for (auto const &m : SnapshotSiteMetrics()) {
+      if (strcmp(m.site->function(), function) == 0 &&
+          (m.counts[ErrorSite::kAllocated] != 0) == allocated)
+      {
+        return m;
+      }
+    }
+    return SiteMetrics{};
+  };
+
+  for (int i = 0; i < 3; ++i) {
+    FailAtSite(false).IgnoreCheck();
+  }
+  FailAtSite(true).IgnoreCheck();
+  // The counters of the exited threads are kept
+  std::thread([] {
+    for (int i = 0; i < 100; ++i) {
+      FailAtSite(false).IgnoreCheck();
+    }
+  }).join();
+
+  auto no_info = find("FailAtSite", false);
+  assert(no_info.site && strcmp(no_info.site->file(), __FILE__) == 0);
+  assert(no_info.counts[ErrorSite::kCreated] == 103);
+  auto heap = find("FailAtSite", true);
+  assert(heap.site && heap.site->line() == no_info.site->line() - 1);
+  assert(heap.counts[ErrorSite::kCreated] == 1);
+  assert(heap.counts[ErrorSite::kAllocated] == 1);
+
+  // Success is not counted
+  auto success = KERROR_SITE_ERROR(MakeSuccess());
+  assert(!success);
+
+  StringSink sink;
+  WriteSiteMetrics(sink);
+  auto const line = std::to_string(no_info.site->line());
+  assert(sink.str().find("# TYPE kerror_errors_total counter\n") == 0);
+  assert(sink.str().find("kerror_errors_total{file=\"" __FILE__ "\",line=\"" +
+                         line + "\",function=\"FailAtSite\"} 103\n") !=
+         std::string::npos);
+}
+
+KERROR_NOINLINE Error FailWithBacktrace()
+{
+  return WithBacktrace(MakeError<EofErrorInfo>());
+}
+
+void TestBacktrace()
+{
+  auto err = FailWithBacktrace();
+  auto backtrace = GetBacktrace(err);
+  assert(backtrace && backtrace->size() > 0);
+  assert(backtrace->size() <= Backtrace::kMaxFrames);
+  // The type and the message of the cause are kept
+  assert(IsA<EofErrorInfo>(err.info()));
+  assert(err.info()->GetFullMessage() == "eof");
+  err.AddContext("read");
+  assert(err.info()->GetFullMessage() == "read: eof");
+  assert(GetBacktrace(err) == backtrace);
+
+  StringSink first;
+  backtrace->Write(first);
+  assert(first.str().find("#0 0x") == 0);
+  // Cached
+  StringSink second;
+  backtrace->Write(second);
+  assert(first.str() == second.str());
+
+  auto out = CaptureStderr([&err] { PErrorBacktrace("Reason: ", err); });
+  assert(out == "Reason: read: eof\n" + first.str());
+
+  // The same kind as the cause for the rate limiters
+  assert(GetErrorKind(err) == GetErrorKind(MakeError<EofErrorInfo>()));
+  auto code_err = WithBacktrace(MakeCodeError(kHttpCategory, 404));
+  assert(GetErrorKind(code_err) ==
+         GetErrorKind(MakeCodeError(kHttpCategory, 404)));
+
+  auto success = WithBacktrace(MakeSuccess());
+  assert(!success && !GetBacktrace(success));
+  assert(!GetBacktrace(MakeNoInfoError()));
+}
+
+Error FailSampled(int i)
+{
+  return KERROR_SAMPLED_ERRORF(kOneIn, 4, "Failed at %d", i);
+}
+
+void TestSampling()
+{
+  ErrorSampler one_in(ErrorSampler::kOneIn, 3);
+  int sampled = 0;
+  for (int i = 0; i < 9; ++i) {
+    sampled += one_in.Sample();
+  }
+  assert(sampled == 3);
+
+  // The burst is sampled, the rest in the same second are not
+  ErrorSampler per_second(ErrorSampler::kPerSecond, 5);
+  sampled = 0;
+  for (int i = 0; i < 100; ++i) {
+    sampled += per_second.Sample();
+  }
+  assert(sampled >= 5 && sampled < 100);
+
+  // The unsampled errors degrade to the marked static message
+  std::string messages;
+  for (int i = 0; i < 5; ++i) {
+    messages += FailSampled(i).info()->GetMessage() + ";";
+  }
+  assert(messages == "Failed at 0;Failed at %d [args not sampled];"
+                     "Failed at %d [args not sampled];"
+                     "Failed at %d [args not sampled];Failed at 4;");
+  // Of the same type whether sampled or not
+  auto unsampled_err = FailSampled(5);
+  FailSampled(6).IgnoreCheck();
+  FailSampled(7).IgnoreCheck();
+  auto sampled_err = FailSampled(8);
+  auto sampled_info = DynCast<LazyMsgErrorInfo<int>>(sampled_err.info());
+  auto unsampled_info = DynCast<LazyMsgErrorInfo<int>>(unsampled_err.info());
+  assert(sampled_info && sampled_info->sampled());
+  assert(unsampled_info && !unsampled_info->sampled());
+  assert(GetErrorKind(sampled_err) == GetErrorKind(unsampled_err));
+
+  // The type of the cause is kept without the backtrace
+  int backtraces = 0;
+  for (int i = 0; i < 4; ++i) {
+    auto err = KERROR_SAMPLED_BACKTRACE(kOneIn, 2, MakeError<EofErrorInfo>());
+    assert(IsA<EofErrorInfo>(err.info()));
+    backtraces += GetBacktrace(err) != nullptr;
+  }
+  assert(backtraces == 2);
+
+  auto err = MakeCodeError(kHttpCategory, 404);
+  for (int i = 0; i < 2; ++i) {
+    if (KERROR_SAMPLED(kOneIn, 2)) err.AddContextf("try %d", i);
+  }
+  assert(err.code() == 404);
+  assert(err.info()->GetFullMessage() == "try 0: Not Found");
+}
+
+void TestMultiError()
+{
+  {
+    ErrorList list(4);
+    assert(list.ToError().is_success());
+  }
+
+  ErrorList list(64);
+  std::thread workers[8];
+  for (int i = 0; i < 8; ++i) {
+    workers[i] = std::thread([&list, i]() {
+      for (int j = 0; j < 10; ++j) {
+        // Only the odd workers fail
+        list.Append(i % 2 ? MakeCodeError(kHttpCategory, 404) : MakeSuccess());
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  auto err = list.ToError();
+  assert(err && list.capacity() == 0);
+  auto multi = DynCast<MultiErrorInfo>(err.info());
+  assert(multi && multi->size() == 40 && multi->dropped() == 0);
+  for (auto const &e : *multi) {
+    assert(e.code() == 404);
+  }
+
+  ErrorList overflowed(2);
+  assert(overflowed.Append(MakeStaticError("a")));
+  assert(overflowed.Append(MakeCodeError(kHttpCategory, 404)));
+  assert(!overflowed.Append(MakeStaticError("c")));
+  assert(!overflowed.Append(MakeStaticError("d")));
+  err = overflowed.ToError();
+  assert(err.info()->GetFullMessage() ==
+         "4 errors: a; Not Found (2 more errors are dropped)");
+  // Unchecked errors in the list don't abort
+  err.IgnoreCheck();
+}
+
+void TestErrorLatch()
+{
+  ErrorLatch latch;
+  assert(!latch.cancelled() && !latch.Take());
+
+  std::atomic<int> published{0};
+  std::thread workers[8];
+  for (int i = 0; i < 8; ++i) {
+    workers[i] = std::thread([&latch, &published, i]() {
+      for (int j = 0; !latch.cancelled(); ++j) {
+        if (j == 100 * (i + 1)) {
+          published += latch.Publish(MakeCodeError(kHttpCategory, 400 + i));
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  assert(published == 1 && latch.cancelled());
+  auto err = latch.Take();
+  assert(err && err.category() == &kHttpCategory);
+  assert(!latch.Publish(MakeStaticError("late")));
+
+  ErrorLatch cancelled;
+  cancelled.Cancel();
+  assert(cancelled.cancelled() && !cancelled.Take());
+  assert(!cancelled.Publish(MakeSuccess()));
+}
+
+void TestWire()
+{
+  // The code is decoded with the category of the receiver
+  StringSink sink;
+  auto err = MakeCodeError(kHttpCategory, 404);
+  err.AddContext("GET /index").AddContextf("from %s", "proxy");
+  EncodeError(err, sink);
+  auto const record = sink.str();
+
+  auto res = DecodeError(record);
+  assert(!res && res->size == record.size());
+  auto decoded = std::move(res->error);
+  assert(decoded.category() == &kHttpCategory && decoded.code() == 404);
+  assert(decoded.info()->GetFullMessage() ==
+         "from proxy: GET /index: Not Found");
+
+  // Relaying is a copy of the record
+  StringSink relayed;
+  EncodeError(decoded, relayed);
+  assert(relayed.str() == record);
+
+  // The message points into the buffer
+  sink.str().clear();
+  EncodeError(MakeMsgErrorf("disk %d is full", 3), sink);
+  EncodeError(MakeNoInfoError().AddContext("no info"), sink);
+  EncodeError(MakeSuccess(), sink);
+  auto const &records = sink.str();
+  res = DecodeError(records);
+  assert(!res);
+  decoded = std::move(res->error);
+  auto slice = DynCast<SliceMsgErrorInfo>(decoded.info());
+  assert(slice && slice->GetMessage() == "disk 3 is full");
+  assert(slice->message().data() >= records.data() &&
+         slice->message().data() < records.data() + records.size());
+  auto offset = res->size;
+
+  res = DecodeError(
+      StringSlice(records.data() + offset, records.size() - offset));
+  assert(!res);
+  decoded = std::move(res->error);
+  assert(decoded && !decoded.category());
+  assert(decoded.info()->GetFullMessage() == "no info");
+  offset += res->size;
+
+  res = DecodeError(
+      StringSlice(records.data() + offset, records.size() - offset));
+  assert(!res && offset + res->size == records.size() && !res->error);
+
+  // Copied into the allocator
+  CountingAllocator alloc;
+  {
+    std::string buf = record;
+    res = DecodeError(buf, &alloc);
+    assert(!res);
+    decoded = std::move(res->error);
+    buf.assign(buf.size(), 0);
+    assert(alloc.allocated == 2);
+    assert(decoded.info()->GetFullMessage() ==
+           "from proxy: GET /index: Not Found");
+    decoded = MakeSuccess();
+  }
+  assert(alloc.allocated == 0);
+
+  // The unknown category is decoded as message
+  {
+    HttpCategory other;
+    StringSink unknown;
+    EncodeError(MakeCodeError(other, 500), unknown);
+    // version, kind, code(2 bytes), length, "http"
+    auto p = &unknown.str()[5];
+    assert(*p == 'h');
+    *p = 'x';
+    res = DecodeError(unknown.str());
+    assert(!res && !res->error.category());
+    assert(res->error.info()->GetMessage() == "Unknown");
+  }
+
+  // The long chain overflows the stack if it is written recursively
+  auto chained = MakeStaticError("root");
+  for (int i = 0; i < 1000000; ++i) {
+    chained.AddContext("context");
+  }
+  sink.str().clear();
+  EncodeError(chained, sink);
+  res = DecodeError(sink.str());
+  assert(!res && res->size == sink.str().size());
+  assert(res->error.info()->GetMessage() == "root");
+  chained.IgnoreCheck();
+
+  res = DecodeError(StringSlice(record.data(), record.size() - 1));
+  assert(res && res.info()->GetMessage() == "Truncated error record");
+  res = DecodeError(StringSlice("\x02\x00", 2));
+  assert(res && res.info()->GetMessage() ==
+                    "Unsupported version of error record");
+
+  sink.str().clear();
+  ErrorOr<int> value(42);
+  EncodeErrorOr(value, sink, [](int v, MessageSink &out) {
+    out.Write(reinterpret_cast<char const *>(&v), sizeof v);
+  });
+  assert(sink.str().size() == 2 + sizeof(int));
+}
+
+void TestErrorOrBatch()
+{
+  ErrorOrBatch<int> batch(130);
+  assert(batch.size() == 130 && batch.all_succeeded());
+  assert(batch.failure_count() == 0 && batch.failures().empty());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    batch[i] = static_cast<int>(i);
+  }
+  batch.SetError(3, MakeSuccess());
+  assert(batch.all_succeeded() && !batch.error(3));
+
+  // Out of order, the failures are still iterated by index
+  batch.SetError(129, MakeCodeError(kHttpCategory, 404));
+  batch.SetError(64, MakeStaticError("b"));
+  batch.SetError(1, MakeStaticError("a"));
+  assert(!batch.all_succeeded() && batch.failure_count() == 3);
+  assert(batch.failed(64) && !batch.failed(65) && batch.data()[65] == 65);
+  assert(batch.error(129)->code() == 404 && !batch.error(2));
+
+  size_t const indices[] = {1, 64, 129};
+  size_t n = 0;
+  for (auto const &failure : batch.failures()) {
+    assert(failure.index == indices[n++]);
+  }
+  assert(n == 3);
+
+  // Replace the error, the failure is not counted twice
+  batch.SetError(64, MakeStaticError("c"));
+  assert(batch.failure_count() == 3 &&
+         batch.error(64)->info()->GetMessage() == "c");
+
+  // The values of bool are contiguous too
+  ErrorOrBatch<bool> flags(3);
+  bool *values = flags.data();
+  assert(!values[0] && !values[1] && !values[2]);
+  flags[1] = true;
+  flags.SetError(2, MakeStaticError("d"));
+  assert(values[1] && flags.failed(2) && flags.failure_count() == 1);
+}
+
+void TestBinaryLog()
+{
+  // Not open, written as text
+  auto out = CaptureStderr([] {
+    KERROR_BINLOG_PERROR("Code: ", MakeCodeError(kHttpCategory, 404));
+    errno = EINVAL;
+    KERROR_BINLOG_PSYSERRORF("Failed to %s %d", "parse", 7);
+  });
+  assert(out == "Code: Not Found\nFailed to parse 7\nSysError: " +
+                    SystemCategory().GetMessage(EINVAL) + "(22)\n");
+
+  auto const path = "/tmp/kerror_test_" + std::to_string(getpid()) + ".klog";
+  // The report longer than the buffer is dropped and counted, the small
+  // buffer is not reused after the buffer size is increased
+  auto opened = OpenBinaryLog(path.c_str(), 64);
+  assert(!opened);
+  std::thread dropper([] {
+    KERROR_BINLOG_PSYSERRORF("%s", std::string(100, 'a').c_str());
+  });
+  dropper.join();
+  CloseBinaryLog();
+  auto const dropped_fd = open(path.c_str(), O_RDONLY);
+  auto const dropped_data = ReadAll(dropped_fd);
+  unlink(path.c_str());
+  StringSink dropped_text;
+  auto decoded = DecodeBinaryLog(dropped_data, dropped_text);
+  assert(!decoded);
+  assert(dropped_text.str() == "(1 reports are dropped)\n");
+
+  opened = OpenBinaryLog(path.c_str());
+  assert(!opened);
+  opened = OpenBinaryLog(path.c_str());
+  assert(opened && opened.info()->GetMessage() ==
+                       "The binary log is already open");
+
+  auto err = MakeSysError(ENOENT);
+  err.AddContext("open");
+  KERROR_BINLOG_PERROR("Reason: ", err);
+  // The reports of the different threads are ordered by the flushes
+  FlushBinaryLog();
+  std::thread worker([] {
+    for (int i = 0; i < 3; ++i) {
+      errno = ENOENT;
+      KERROR_BINLOG_PSYSERRORF("%5.2f|%-4s|%x|%c|%%|%.3s|%lu", 1.5, "ab",
+                               255u, 'k', "abcdef", 42ul);
+    }
+  });
+  worker.join();
+  FlushBinaryLog();
+  KERROR_BINLOG_PERROR("Code: ", MakeCodeError(kHttpCategory, 404));
+  FlushBinaryLog();
+  CloseBinaryLog();
+
+  auto const fd = open(path.c_str(), O_RDONLY);
+  assert(fd >= 0);
+  auto const data = ReadAll(fd);
+  unlink(path.c_str());
+
+  StringSink text;
+  decoded = DecodeBinaryLog(data, text);
+  assert(!decoded);
+  auto const enoent = SystemCategory().GetMessage(ENOENT);
+  std::vector<std::string> lines;
+  for (size_t pos = 0, next; pos < text.str().size(); pos = next + 1) {
+    next = text.str().find('\n', pos);
+    lines.push_back(text.str().substr(pos, next - pos));
+  }
+  // Each report is prefixed with "YYYY-mm-dd HH:MM:SS.mmm "
+  assert(lines.size() == 8);
+  assert(lines[0].substr(24) == "Reason: open: " + enoent);
+  assert(lines[0][19] == '.' && lines[0][23] == ' ');
+  for (int i = 0; i < 3; ++i) {
+    assert(lines[1 + 2 * i].substr(24) == " 1.50|ab  |ff|k|%|abc|42");
+    assert(lines[2 + 2 * i] == "SysError: " + enoent + "(2)");
+  }
+  assert(lines[7].substr(24) == "Code: Not Found");
+
+  decoded = DecodeBinaryLog("text", text);
+  assert(decoded && decoded.info()->GetMessage() == "Not a binary log");
+  text.str().clear();
+  decoded = DecodeBinaryLog(StringSlice(data.data(), data.size() - 1), text);
+  assert(decoded && decoded.info()->GetMessage() == "Truncated binary log");
+  assert(text.str().find("Reason: open: ") != std::string::npos);
+
+  // The corrupted site id is rejected instead of allocating for it, the
+  // first entry follows the 8 bytes header, its id follows u8 type, u32 size
+  auto corrupted = data;
+  assert(corrupted[8] == 1);
+  memset(&corrupted[8 + 5], 0xff, 4);
+  decoded = DecodeBinaryLog(corrupted, text);
+  assert(decoded &&
+         decoded.info()->GetMessage() == "Malformed site of binary log");
+}
+
+enum class DbError {
+  kTimeout = 1,
+  kConflict,
+  kUnlisted,
+};
+
+template <>
+struct kerror::ErrorDomainTraits<DbError> {
+  static constexpr char const *kName = "db";
+  static constexpr ErrorDomainEntry<DbError> kMessages[] = {
+      {DbError::kTimeout, "Timeout"},
+      {DbError::kConflict, "Conflict"},
+  };
+};
+
+#if __cplusplus < 201703L
+constexpr ErrorDomainEntry<DbError>
+    kerror::ErrorDomainTraits<DbError>::kMessages[];
+#endif
+
+static_assert(GetErrorDomainMessage(DbError::kTimeout)[0] == 'T', "");
+static_assert(GetErrorDomainMessage(DbError::kUnlisted) == nullptr, "");
+
+int HandleDbError(Error const &err)
+{
+  switch (ErrorCodeOf<DbError>(err)) {
+  case DbError::kTimeout:
+    return 1;
+  case DbError::kConflict:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+void TestErrorDomain()
+{
+  auto err = MakeCodeError(DbError::kTimeout);
+  assert(err);
+  assert(!err.is_allocated());
+  assert(IsErrorOf<DbError>(err));
+  assert(HandleDbError(err) == 1);
+  assert(HandleDbError(MakeCodeError(DbError::kConflict)) == 2);
+  assert(err.category()->GetName() == std::string("db"));
+  assert(err.category()->GetMessage(err.code()) == "Timeout");
+  assert(err.info()->GetMessage() == "Timeout");
+
+  auto unlisted = MakeCodeError(DbError::kUnlisted);
+  assert(unlisted.info()->GetMessage() == "Unknown error 3");
+
+  // Not the error of the domain
+  auto other = MakeCodeError(kHttpCategory, 1);
+  assert(!IsErrorOf<DbError>(other));
+  assert(ErrorCodeOf<DbError>(other) == DbError{});
+  other.IgnoreCheck();
+  auto success = Error();
+  assert(!IsErrorOf<DbError>(success));
+}
+
+#if defined(__GNUC__) && defined(__ELF__) && defined(__OPTIMIZE__) && \
+    !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+// The linker defines __start_/__stop_ symbols for the section whose name is
+// a C identifier, then the code size of the probe function is measurable.
+__attribute__((noinline, section("kerror_size_probe"))) Error
+ParseDigit(char c, int *digit)
+{
+  if (KERROR_UNLIKELY(c < '0' || c > '9')) {
+    return MakeMsgError("The character is not a decimal digit");
+  }
+  *digit = c - '0';
+  return MakeSuccess();
+}
+
+__attribute__((noinline, cold)) Error MakeDigitError()
+{
+  return MakeMsgError("The character is not a decimal digit");
+}
+
+// The error path is an opaque call, so the difference of the sizes is the
+// code of the error path inlined by MakeMsgError(), independent of the
+// target and the flags(e.g. -fstack-protector-all or -fcf-protection)
+__attribute__((noinline, section("kerror_size_baseline"))) Error
+ParseDigitBaseline(char c, int *digit)
+{
+  if (KERROR_UNLIKELY(c < '0' || c > '9')) {
+    return MakeDigitError();
+  }
+  *digit = c - '0';
+  return MakeSuccess();
+}
+
+extern "C" char const __start_kerror_size_probe[];
+extern "C" char const __stop_kerror_size_probe[];
+extern "C" char const __start_kerror_size_baseline[];
+extern "C" char const __stop_kerror_size_baseline[];
+
+void TestCodeSize()
+{
+  int digit = 0;
+  assert(!ParseDigit('7', &digit) && digit == 7);
+  auto err = ParseDigit('x', &digit);
+  assert(err && err.info()->GetMessage().size() > 0);
+  err = ParseDigitBaseline('x', &digit);
+  assert(err && err.info()->GetMessage().size() > 0);
+
+  // The error path should be a call only, passing the message is a few
+  // instructions. If the std::string or the info is constructed in the
+  // caller, it is more than 64 bytes larger on x86-64.
+  auto size = __stop_kerror_size_probe - __start_kerror_size_probe;
+  auto baseline = __stop_kerror_size_baseline - __start_kerror_size_baseline;
+  assert(size <= baseline + 32);
+  (void)size;
+  (void)baseline;
+}
+#else
+void TestCodeSize() {}
+#endif
+
 int main()
 {
   auto err = MakeSuccess();
@@ -53,4 +1592,40 @@ int main()
   assert(!obj);
 
   printf("x = %d\n", obj->x_);
+  // Constructed in place and NRVO
+  assert(A::moves == 0);
+
+  ErrorOr<std::string> str(kInPlace, 3, 'a');
+  assert(*str == "aaa");
+  str.emplace("b");
+  assert(*str == "b");
+
+  TestInlineInfo();
+  TestAllocator();
+  TestInfoFreeList();
+  TestStaticError();
+  TestCompactError();
+  TestCheckPolicy();
+  TestLazyMsgError();
+  TestFormat();
+  TestCodeError();
+  TestErrorOrSpecializations();
+  TestPropagation();
+  TestTypeId();
+  TestSharedError();
+  TestContext();
+  TestWriteMessage();
+  TestReport();
+  TestAsyncSink();
+  TestReportLimiter();
+  TestSiteMetrics();
+  TestBacktrace();
+  TestSampling();
+  TestMultiError();
+  TestErrorLatch();
+  TestWire();
+  TestErrorOrBatch();
+  TestBinaryLog();
+  TestErrorDomain();
+  TestCodeSize();
 }
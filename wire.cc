@@ -0,0 +1,216 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+#include "wire.h"
+
+#include <vector>
+
+using namespace kerror;
+
+namespace {
+
+void WriteVarint(MessageSink &sink, uint64_t v)
+{
+  char buf[10];
+  size_t n = 0;
+  do {
+    auto byte = static_cast<uint8_t>(v & 0x7f);
+    v >>= 7;
+    if (v) byte |= 0x80;
+    buf[n++] = static_cast<char>(byte);
+  } while (v);
+  sink.Write(buf, n);
+}
+
+void WriteSlice(MessageSink &sink, StringSlice slice)
+{
+  WriteVarint(sink, slice.size());
+  sink.Write(slice.data(), slice.size());
+}
+
+/**
+ * The contexts are written from the oldest, then the decoder can add them
+ * in order. Not recursive since the chain may be long.
+ */
+void WriteContexts(MessageSink &sink, IErrorInfo const *newest,
+                   size_t count, StringSink &scratch)
+{
+  std::vector<IErrorInfo const *> contexts(count);
+  for (auto context = newest; context; context = context->context()) {
+    contexts[--count] = context;
+  }
+  for (auto context : contexts) {
+    scratch.str().clear();
+    context->WriteMessage(scratch);
+    WriteSlice(sink, scratch.str());
+  }
+}
+
+class Reader {
+ public:
+  explicit Reader(StringSlice data) noexcept
+    : begin_(data.data())
+    , p_(data.data())
+    , end_(data.data() + data.size())
+  {
+  }
+
+  bool ReadByte(uint8_t *byte) noexcept
+  {
+    if (p_ == end_) return false;
+    *byte = static_cast<uint8_t>(*p_++);
+    return true;
+  }
+
+  bool ReadVarint(uint64_t *v) noexcept
+  {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte;
+      if (!ReadByte(&byte)) return false;
+      *v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  bool ReadSlice(StringSlice *slice) noexcept
+  {
+    uint64_t size;
+    if (!ReadVarint(&size) || size > static_cast<uint64_t>(end_ - p_)) {
+      return false;
+    }
+    *slice = StringSlice(p_, static_cast<size_t>(size));
+    p_ += size;
+    return true;
+  }
+
+  size_t consumed() const noexcept
+  {
+    return static_cast<size_t>(p_ - begin_);
+  }
+
+ private:
+  char const *begin_;
+  char const *p_;
+  char const *end_;
+};
+
+Error MakeMessage(ErrorAllocator *alloc, StringSlice msg)
+{
+  return alloc ? MakeMsgError(alloc, msg) : MakeSliceError(msg);
+}
+
+} // namespace
+
+void kerror::EncodeError(Error const &err, MessageSink &sink)
+{
+  auto const category = err.category();
+  // Don't materialize the packed error code
+  IErrorInfo const *info =
+      err.is_inline() || err.is_allocated() ? err.info() : nullptr;
+
+  WireKind kind;
+  if (err.is_success()) {
+    kind = WireKind::kSuccess;
+  } else if (category) {
+    kind = WireKind::kCode;
+  } else if (!info) {
+    kind = WireKind::kNoInfo;
+  } else if (auto context = DynCast<ContextErrorInfo>(info)) {
+    // The no info error wrapped for the contexts
+    kind = context->cause().info() ? WireKind::kMessage : WireKind::kNoInfo;
+  } else {
+    kind = WireKind::kMessage;
+  }
+
+  char const header[] = {static_cast<char>(kWireVersion),
+                         static_cast<char>(kind)};
+  sink.Write(header, sizeof header);
+  if (kind == WireKind::kSuccess) return;
+
+  StringSink scratch;
+  if (kind == WireKind::kCode) {
+    auto const code = err.code();
+    WriteVarint(sink, static_cast<uint32_t>(code));
+    WriteSlice(sink, category->GetName());
+    category->WriteMessage(code, scratch);
+    WriteSlice(sink, scratch.str());
+  } else if (kind == WireKind::kMessage) {
+    info->WriteMessage(scratch);
+    WriteSlice(sink, scratch.str());
+  }
+
+  size_t contexts = 0;
+  for (auto context = info ? info->context() : nullptr; context;
+       context = context->context())
+  {
+    ++contexts;
+  }
+  WriteVarint(sink, contexts);
+  if (contexts > 0) WriteContexts(sink, info->context(), contexts, scratch);
+}
+
+auto kerror::DecodeError(StringSlice data, ErrorAllocator *alloc)
+    -> ErrorOr<DecodedError>
+{
+  Reader reader(data);
+  uint8_t version;
+  uint8_t kind;
+  if (!reader.ReadByte(&version) || !reader.ReadByte(&kind)) {
+    return MakeStaticError("Truncated error record");
+  }
+  if (version != kWireVersion) {
+    return MakeStaticError("Unsupported version of error record");
+  }
+
+  Error err;
+  switch (static_cast<WireKind>(kind)) {
+    case WireKind::kSuccess:
+      return DecodedError{MakeSuccess(), reader.consumed()};
+    case WireKind::kNoInfo:
+      err = MakeNoInfoError();
+      break;
+    case WireKind::kCode: {
+      uint64_t code;
+      StringSlice name("");
+      StringSlice msg("");
+      if (!reader.ReadVarint(&code) || !reader.ReadSlice(&name) ||
+          !reader.ReadSlice(&msg))
+      {
+        return MakeStaticError("Truncated error record");
+      }
+      auto category = detail::FindErrorCategory(name);
+      err = category ? MakeCodeError(*category,
+                                     static_cast<int>(
+                                         static_cast<uint32_t>(code)))
+                     : MakeMessage(alloc, msg);
+    } break;
+    case WireKind::kMessage: {
+      StringSlice msg("");
+      if (!reader.ReadSlice(&msg)) {
+        return MakeStaticError("Truncated error record");
+      }
+      err = MakeMessage(alloc, msg);
+    } break;
+    default:
+      return MakeStaticError("Unknown kind of error record");
+  }
+
+  uint64_t contexts;
+  if (!reader.ReadVarint(&contexts)) {
+    err.IgnoreCheck();
+    return MakeStaticError("Truncated error record");
+  }
+  for (uint64_t i = 0; i < contexts; ++i) {
+    StringSlice context("");
+    if (!reader.ReadSlice(&context)) {
+      err.IgnoreCheck();
+      return MakeStaticError("Truncated error record");
+    }
+    if (alloc)
+      err.AddContext(alloc, context);
+    else
+      err.AddContext(context);
+  }
+
+  return DecodedError{std::move(err), reader.consumed()};
+}
@@ -0,0 +1,79 @@
+// SPDX-LICENSE-IDENTIFIER: MIT
+//
+// Compact binary encoding of Error for passing errors across processes.
+//
+// The error code is kept with its category(identified by name, since the
+// category id is assigned per process), the message and the contexts are
+// length-prefixed slices, so the decoded error points into the receive
+// buffer without copy, and relaying an error is a memcpy of the record.
+//
+// The record(version 1):
+//   u8      version
+//   u8      kind(WireKind)
+//   kCode:  varint code(as uint32), slice category name
+//   kCode, kMessage: slice message(without contexts)
+//   varint  the number of contexts, slices from the oldest to the newest
+// where slice = varint length + bytes, varint is LEB128.
+
+#ifndef _KERROR_WIRE_H__
+#define _KERROR_WIRE_H__
+
+#include "kerror.h"
+
+namespace kerror {
+
+constexpr uint8_t kWireVersion = 1;
+
+enum class WireKind : uint8_t {
+  kSuccess,
+  kNoInfo,
+  kCode,
+  kMessage,
+};
+
+/**
+ * Append the record of \p err to \p sink.
+ * The type of the infos other than error code is not kept, only the message.
+ */
+void EncodeError(Error const &err, MessageSink &sink);
+
+struct DecodedError {
+  Error error;
+  // The length of the record
+  size_t size;
+};
+
+/**
+ * Decode the record at the beginning of \p data.
+ *
+ * If the category of the error code is registered in this process, the
+ * error code is decoded, otherwise, the message.
+ *
+ * \Param alloc nullptr to point the message and the contexts into \p data
+ *              without copy, then the decoded error must not outlive it.
+ *              Otherwise they are copied into the infos allocated from it.
+ * \return
+ *   The decoded error and the length of the record, or the error if
+ *   \p data is malformed
+ */
+ErrorOr<DecodedError> DecodeError(StringSlice data,
+                                  ErrorAllocator *alloc = nullptr);
+
+/**
+ * Append the record of the error of \p result, or a success record followed
+ * by the value encoded by \p encode_value(value, sink).
+ */
+template <typename R, typename F>
+void EncodeErrorOr(R const &result, MessageSink &sink, F &&encode_value)
+{
+  if (result) {
+    EncodeError(result.error(), sink);
+  } else {
+    EncodeError(MakeSuccess(), sink);
+    encode_value(*result, sink);
+  }
+}
+
+} // namespace kerror
+
+#endif